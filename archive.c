@@ -0,0 +1,423 @@
+/*
+ * File: archive.c
+ * ---------------
+ * List pages beyond index.html (page/2.html, page/3.html, ...) and the
+ * per-year and per-tag archive pages. All of them come out of one walk over
+ * the date sorted post table: a list page is written as soon as it is full,
+ * a year page as soon as the walk leaves that year, and the tag pages, which
+ * collect their entries along the way, at the end.
+ *
+ * Every page written here is recorded in the manifest as a generated ('G')
+ * entry, so an incremental build removes the pages of tags that are gone.
+ */
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "txt2web.h"
+
+typedef struct {
+        char* name;             /* as written in the first post that has it */
+        char* slug;             /* file name below tags/ */
+        Buf list;               /* <li> entries, newest first */
+        size_t count;
+        const Post* last;       /* post added last; a post that lists the tag twice is added once */
+} ArchiveTag;
+
+/* a page being filled; the slots of the layout come from post and head */
+typedef struct {
+        Buf out;
+        Buf head;
+        Post post;
+        TemplatePage slots;
+        size_t rest;            /* layout segment after {{content}} */
+} ArchivePage;
+
+typedef struct {
+        ArchiveTag* tags;
+        size_t count;
+        size_t cap;
+        size_t* slots;          /* by slug: index + 1 into tags, 0 when empty */
+        size_t slot_cap;        /* a power of two */
+} TagSet;
+
+static void page_begin(ArchivePage* page, const char* site_title, const char* title);
+static void page_end(ArchivePage* page);
+static void page_free(ArchivePage* page);
+static bool page_write(Build* build, const char* name, ArchivePage* page);
+static void year_end(Build* build, ArchivePage* page, Buf* years, int year, size_t count, bool* ok);
+static ArchiveTag* tag_get(TagSet* set, Arena* strings, const char* name, size_t len);
+static size_t* tag_slot(const TagSet* set, const char* slug);
+static void add_tags(TagSet* set, Arena* strings, const Post* post);
+static int compare_tags(const void* a, const void* b);
+
+
+/* one <li> of a post list; root is prepended to the link ("" on index.html) */
+void write_post_item(Buf* out, const Post* post, const char* root)
+{
+        buf_put_markup(out, "    <li><span class='date'>");
+        buf_puts(out, post->date_str);
+        buf_puts(out, "</span> - <a href='");
+        buf_puts(out, root);
+        buf_puts(out, "posts/");
+        buf_puts(out, post->filename);
+        buf_puts(out, ".html'>");
+        buf_puts(out, post->title);
+        buf_put_markup(out, "</a></li>\n");
+}
+
+
+/* links to the newer and older list pages around page (1 is index.html) */
+void write_pager(Buf* out, size_t page, size_t pages)
+{
+        char link[64];
+
+        if (pages <= 1)
+                return;
+
+        buf_put_markup(out, "  <nav class='pages'>");
+        if (page == 2) {
+                buf_puts(out, "<a href='/'>&lt;-- newer posts</a>");
+        }
+        else if (page > 2) {
+                sprintf(link, "/page/%lu.html", (unsigned long) page - 1);
+                buf_puts(out, "<a href='");
+                buf_puts(out, link);
+                buf_puts(out, "'>&lt;-- newer posts</a>");
+        }
+        if (page < pages) {
+                sprintf(link, "/page/%lu.html", (unsigned long) page + 1);
+                buf_puts(out, page > 1 ? " <a href='" : "<a href='");
+                buf_puts(out, link);
+                buf_puts(out, "'>older posts --&gt;</a>");
+        }
+        buf_put_markup(out, "</nav>\n");
+}
+
+
+/*
+ * Writes the list pages after the first (when build->per_page is set) and the
+ * year and tag pages with archive.html (when build->archives is set). posts
+ * must be sorted. Returns false if a page could not be written.
+ */
+bool archive_write(Build* build, const PostTable* posts, const char* site_title)
+{
+        size_t per_page = build->per_page;
+        size_t pages = per_page ? (posts->count + per_page - 1) / per_page : 1;
+        TagSet tags = { 0 };
+        ArchivePage page;       /* list or tag page being filled */
+        ArchivePage year_page;  /* year page being filled */
+        ArchivePage index;      /* archive.html */
+        Buf years = { 0 };      /* <li> entries of archive.html */
+        size_t year_count = 0;
+        int year = 0;
+        bool ok = true;
+        char* dir;
+        char name[64];
+        size_t i;
+
+        if (pages <= 1 && !build->archives)
+                return true;
+
+        if (site_title == NULL)
+                site_title = "Archive";
+        memset(&page, 0, sizeof(page));
+        memset(&year_page, 0, sizeof(year_page));
+        memset(&index, 0, sizeof(index));
+
+        if (pages > 1) {
+                dir = path_join(build->dir, "page");
+                mkdir(dir, 0755);
+                free(dir);
+        }
+        if (build->archives) {
+                dir = path_join(build->dir, "years");
+                mkdir(dir, 0755);
+                free(dir);
+                dir = path_join(build->dir, "tags");
+                mkdir(dir, 0755);
+                free(dir);
+        }
+
+        for (i = 0; i < posts->count; i++) {
+                Post* post = post_table_get(posts, i);
+                struct tm tm_date;
+
+                /* list pages; the first one is index.html */
+                if (pages > 1 && i >= per_page) {
+                        size_t number = i / per_page + 1;
+
+                        if (i % per_page == 0) {
+                                sprintf(name, "Page %lu", (unsigned long) number);
+                                page_begin(&page, site_title, name);
+                                buf_put_markup(&page.out, "  <nav><ul>\n");
+                        }
+                        write_post_item(&page.out, post, "/");
+                        if ((i + 1) % per_page == 0 || i + 1 == posts->count) {
+                                buf_put_markup(&page.out, "  </ul></nav>\n");
+                                write_pager(&page.out, number, pages);
+                                page_end(&page);
+                                sprintf(name, "page/%lu.html", (unsigned long) number);
+                                ok = page_write(build, name, &page) && ok;
+                        }
+                }
+
+                if (!build->archives)
+                        continue;
+
+                /* sorted by date, so the posts of one year are next to each other */
+                if (!str_empty(post->date_str) && gmtime_r(&post->date, &tm_date) != NULL) {
+                        if (year_count > 0 && tm_date.tm_year + 1900 != year) {
+                                year_end(build, &year_page, &years, year, year_count, &ok);
+                                year_count = 0;
+                        }
+                        if (year_count == 0) {
+                                year = tm_date.tm_year + 1900;
+                                sprintf(name, "%d", year);
+                                page_begin(&year_page, site_title, name);
+                                buf_put_markup(&year_page.out, "  <nav><ul>\n");
+                        }
+                        write_post_item(&year_page.out, post, "/");
+                        year_count++;
+                }
+
+                add_tags(&tags, &build->strings, post);
+        }
+
+        if (build->archives) {
+                if (year_count > 0)
+                        year_end(build, &year_page, &years, year, year_count, &ok);
+
+                if (tags.count > 1)
+                        qsort(tags.tags, tags.count, sizeof(ArchiveTag), compare_tags);
+                page_begin(&index, site_title, "Archive");
+                buf_put_markup(&index.out, "  <h2>Years</h2>\n  <ul>\n");
+                if (years.len)
+                        buf_append(&index.out, years.data, years.len);
+                buf_put_markup(&index.out, "  </ul>\n  <h2>Tags</h2>\n  <ul>\n");
+
+                for (i = 0; i < tags.count; i++) {
+                        ArchiveTag* tag = &tags.tags[i];
+                        char* tag_page = str_printf("tags/%s.html", tag->slug);
+
+                        buf_put_markup(&index.out, "    <li><a href='/");
+                        buf_puts(&index.out, tag_page);
+                        buf_puts(&index.out, "'>");
+                        buf_puts(&index.out, tag->name);
+                        buf_puts(&index.out, "</a> (");
+                        buf_put_int(&index.out, (int) tag->count);
+                        buf_put_markup(&index.out, ")</li>\n");
+
+                        page_begin(&page, site_title, tag->name);
+                        buf_put_markup(&page.out, "  <nav><ul>\n");
+                        buf_append(&page.out, tag->list.data, tag->list.len);
+                        buf_put_markup(&page.out, "  </ul></nav>\n");
+                        page_end(&page);
+                        ok = page_write(build, tag_page, &page) && ok;
+
+                        free(tag_page);
+                        buf_free(&tag->list);
+                }
+
+                buf_put_markup(&index.out, "  </ul>\n");
+                page_end(&index);
+                ok = page_write(build, "archive.html", &index) && ok;
+        }
+
+        free(tags.tags);
+        free(tags.slots);
+        page_free(&page);
+        page_free(&year_page);
+        page_free(&index);
+        buf_free(&years);
+        return ok;
+}
+
+
+/* starts page with the layout up to {{content}}, then a heading */
+static void page_begin(ArchivePage* page, const char* site_title, const char* title)
+{
+        free(page->post.title);
+        memset(&page->post, 0, sizeof(page->post));
+        page->post.title = str_printf("%s - %s", site_title, title);
+
+        buf_clear(&page->out);
+        buf_clear(&page->head);
+        buf_put_markup(&page->head, "  <title>");
+        buf_puts(&page->head, page->post.title);
+        buf_puts(&page->head, "</title>");
+
+        page->slots.post = &page->post;
+        page->slots.head = &page->head;
+        page->slots.add_link = true;
+        page->slots.posts = NULL;
+        page->rest = template_render(layout_get(), 0, &page->out, NULL, &page->slots);
+
+        buf_put_markup(&page->out, "\n  <h1>");
+        buf_puts(&page->out, title);
+        buf_put_markup(&page->out, "</h1>\n");
+}
+
+
+static void page_end(ArchivePage* page)
+{
+        template_render(layout_get(), page->rest, &page->out, NULL, &page->slots);
+}
+
+
+static void page_free(ArchivePage* page)
+{
+        free(page->post.title);
+        buf_free(&page->out);
+        buf_free(&page->head);
+}
+
+
+/* writes page to build->dir/name and records it in the manifest */
+static bool page_write(Build* build, const char* name, ArchivePage* page)
+{
+        Buf* out = &page->out;
+        char* path = path_join(build->dir, name);
+        char* tmp;
+        FILE* f = output_open(path, &tmp);
+        struct stat none = { 0 };
+        unsigned long hash = hash_bytes(HASH_INIT, out->data, out->len);
+        bool ok = f != NULL;
+
+        if (f)
+                ok = output_commit(f, path, tmp, buf_flush(out, f));
+        if (ok)
+                manifest_add(&build->next, 'G', path, path, &none, hash);
+        else
+                fprintf(stderr, "ERROR: Could not write to file: %s\n", path);
+
+        buf_clear(out);
+        free(path);
+        return ok;
+}
+
+
+/* closes the page of year and adds it to the list on archive.html */
+static void year_end(Build* build, ArchivePage* page, Buf* years, int year, size_t count, bool* ok)
+{
+        char name[64];
+
+        buf_put_markup(&page->out, "  </ul></nav>\n");
+        page_end(page);
+        sprintf(name, "years/%d.html", year);
+        *ok = page_write(build, name, page) && *ok;
+
+        buf_put_markup(years, "    <li><a href='/");
+        buf_puts(years, name);
+        buf_puts(years, "'>");
+        buf_put_int(years, year);
+        buf_puts(years, "</a> (");
+        buf_put_int(years, (int) count);
+        buf_put_markup(years, ")</li>\n");
+}
+
+
+/* finds the tag whose slug matches name, adding it when it is new */
+static ArchiveTag* tag_get(TagSet* set, Arena* strings, const char* name, size_t len)
+{
+        char* slug = arena_alloc(strings, len + 1);
+        char* p = slug;
+        size_t* slot;
+        size_t i;
+
+        for (i = 0; i < len; i++) {
+                unsigned char c = (unsigned char) name[i];
+                if (isalnum(c))
+                        *p++ = (char) tolower(c);
+                else if (p > slug && p[-1] != '-')
+                        *p++ = '-';
+        }
+        while (p > slug && p[-1] == '-')
+                p--;
+        *p = '\0';
+        if (*slug == '\0')
+                strcpy(slug, "-");
+
+        if ((set->count + 1) * 2 > set->slot_cap) {
+                size_t cap = set->slot_cap ? set->slot_cap * 2 : 64;
+
+                free(set->slots);
+                set->slots = calloc(cap, sizeof(size_t));
+                if (set->slots == NULL) {
+                        fprintf(stderr, "ERROR: Out of memory while collecting tags\n");
+                        abort();
+                }
+                set->slot_cap = cap;
+                for (i = 0; i < set->count; i++)
+                        *tag_slot(set, set->tags[i].slug) = i + 1;
+        }
+        slot = tag_slot(set, slug);
+        if (*slot)
+                return &set->tags[*slot - 1];
+
+        if (set->count == set->cap) {
+                set->cap = set->cap ? set->cap * 2 : 32;
+                set->tags = realloc(set->tags, set->cap * sizeof(ArchiveTag));
+                if (set->tags == NULL) {
+                        fprintf(stderr, "ERROR: Out of memory while collecting tags\n");
+                        abort();
+                }
+        }
+        memset(&set->tags[set->count], 0, sizeof(ArchiveTag));
+        set->tags[set->count].name = arena_strndup(strings, name, len);
+        set->tags[set->count].slug = slug;
+        *slot = ++set->count;
+        return &set->tags[set->count - 1];
+}
+
+
+/* the slot of slug in the index of set: the one holding it, or the empty one where it goes */
+static size_t* tag_slot(const TagSet* set, const char* slug)
+{
+        size_t i = hash_str(HASH_INIT, slug) & (set->slot_cap - 1);
+
+        while (set->slots[i] && strcmp(set->tags[set->slots[i] - 1].slug, slug) != 0)
+                i = (i + 1) & (set->slot_cap - 1);
+        return &set->slots[i];
+}
+
+
+/* adds post to the list of every tag in its comma separated tags: line */
+static void add_tags(TagSet* set, Arena* strings, const Post* post)
+{
+        const char* p = post->tags;
+
+        while (p && *p) {
+                const char* end = strchr(p, ',');
+                const char* stop;
+
+                if (end == NULL)
+                        end = p + strlen(p);
+                while (p < end && isspace((unsigned char) *p))
+                        p++;
+                for (stop = end; stop > p && isspace((unsigned char) stop[-1]); stop--)
+                        ;
+
+                if (stop > p) {
+                        ArchiveTag* tag = tag_get(set, strings, p, stop - p);
+
+                        if (tag->last != post) {
+                                write_post_item(&tag->list, post, "/");
+                                tag->count++;
+                                tag->last = post;
+                        }
+                }
+                p = *end ? end + 1 : end;
+        }
+}
+
+
+static int compare_tags(const void* a, const void* b)
+{
+        const ArchiveTag* tag_a = a;
+        const ArchiveTag* tag_b = b;
+        return strcmp(tag_a->slug, tag_b->slug);
+}
@@ -0,0 +1,97 @@
+/*
+ * File: arena.c
+ * -------------
+ * String arena. Strings that live as long as the build (post metadata,
+ * manifest paths) are packed into large blocks instead of being malloc'd
+ * one by one, and are all released together by arena_free(). Allocation is
+ * guarded by a mutex so render workers can share one arena.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "txt2web.h"
+
+#define ARENA_BLOCK_SIZE 65536
+
+struct ArenaBlock {
+        struct ArenaBlock* next;
+        size_t used;
+        size_t cap;
+};
+
+
+void arena_init(Arena* a)
+{
+        a->head = NULL;
+        pthread_mutex_init(&a->lock, NULL);
+}
+
+
+void* arena_alloc(Arena* a, size_t size)
+{
+        ArenaBlock* block;
+        char* p;
+
+        /* keep every allocation aligned for any type */
+        size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+
+        pthread_mutex_lock(&a->lock);
+        block = a->head;
+        if (block == NULL || block->cap - block->used < size) {
+                size_t cap = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+
+                block = malloc(sizeof(ArenaBlock) + cap);
+                stats_count(STAT_ALLOCS, 1);
+                if (block == NULL) {
+                        fprintf(stderr, "ERROR: Out of memory\n");
+                        abort();
+                }
+                block->used = 0;
+                block->cap = cap;
+
+                /* an oversized block goes behind the head so the head's free space is kept */
+                if (a->head && size > ARENA_BLOCK_SIZE) {
+                        block->next = a->head->next;
+                        a->head->next = block;
+                }
+                else {
+                        block->next = a->head;
+                        a->head = block;
+                }
+        }
+
+        p = (char*) (block + 1) + block->used;
+        block->used += size;
+        pthread_mutex_unlock(&a->lock);
+        return p;
+}
+
+
+char* arena_strndup(Arena* a, const char* str, size_t len)
+{
+        char* copy = arena_alloc(a, len + 1);
+        memcpy(copy, str, len);
+        copy[len] = '\0';
+        return copy;
+}
+
+
+char* arena_strdup(Arena* a, const char* str)
+{
+        return str ? arena_strndup(a, str, strlen(str)) : NULL;
+}
+
+
+void arena_free(Arena* a)
+{
+        ArenaBlock* block = a->head;
+
+        while (block) {
+                ArenaBlock* next = block->next;
+                free(block);
+                block = next;
+        }
+        a->head = NULL;
+        pthread_mutex_destroy(&a->lock);
+}
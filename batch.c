@@ -0,0 +1,162 @@
+/*
+ * File: batch.c
+ * -------------
+ * Batch mode (-b list): builds many sites in one process. The list has one
+ * site per line,
+ *
+ *     <source directory> <build directory> [base url]
+ *
+ * and blank lines and lines starting with # are skipped. The sites are built
+ * one after the other with the options from the command line (a base URL in
+ * the list overrides -u), each build using all worker threads, while the
+ * layout, the render cache and the process itself are set up only once.
+ * A result line per site follows at the end.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "txt2web.h"
+
+typedef struct {
+        const char* src;
+        const char* dir;
+        const char* url;        /* NULL: -u, if given */
+        int status;
+        double seconds;
+        size_t posts;
+        int rendered;
+} BatchSite;
+
+static bool batch_read(const char* list_path, Arena* strings, BatchSite** sites, size_t* count);
+static double now(void);
+
+
+/* builds every site in list_path with the settings in options; 0 when all of them built */
+int batch_build(const Build* options, const char* list_path)
+{
+        Arena strings;
+        BatchSite* sites;
+        size_t count;
+        size_t failed = 0;
+        double start = now();
+        size_t i;
+
+        arena_init(&strings);
+        if (!batch_read(list_path, &strings, &sites, &count)) {
+                arena_free(&strings);
+                return 1;
+        }
+
+        for (i = 0; i < count; i++) {
+                BatchSite* site = &sites[i];
+                Build build = *options;
+                double site_start = now();
+
+                build.src = site->src;
+                build.dir = site->dir;
+                if (site->url)
+                        build.base_url = site->url;
+                if (!direxists(site->dir))
+                        mkdir(site->dir, 0755);
+
+                printf("Building %s into %s\n", site->src, site->dir);
+                if (!hasperms(site->dir)) {
+                        fprintf(stderr, "Write or read permission not granted for directory: %s\n", site->dir);
+                        site->status = 1;
+                }
+                else {
+                        site->status = build_site(&build);
+                }
+                site->seconds = now() - site_start;
+                site->posts = build.post_count;
+                site->rendered = build.rendered;
+                if (site->status != 0)
+                        failed++;
+        }
+
+        printf("\n%-7s %9s %7s %9s  %s\n", "result", "seconds", "posts", "rendered", "site");
+        for (i = 0; i < count; i++) {
+                printf("%-7s %9.3f %7lu %9d  %s -> %s\n", sites[i].status == 0 ? "ok" : "FAILED",
+                       sites[i].seconds, (unsigned long) sites[i].posts, sites[i].rendered,
+                       sites[i].src, sites[i].dir);
+        }
+        printf("Built %lu of %lu sites in %.3f s\n", (unsigned long) (count - failed),
+               (unsigned long) count, now() - start);
+
+        free(sites);
+        arena_free(&strings);
+        return failed ? 1 : 0;
+}
+
+
+/* reads the site list; the strings live in strings, *sites must be freed */
+static bool batch_read(const char* list_path, Arena* strings, BatchSite** sites, size_t* count)
+{
+        FILE* f = fopen(list_path, "r");
+        char* line = NULL;
+        size_t line_cap = 0;
+        size_t cap = 0;
+        int line_no = 0;
+        bool ok = true;
+
+        *sites = NULL;
+        *count = 0;
+        if (f == NULL) {
+                fprintf(stderr, "ERROR: Could not read site list: %s\n", list_path);
+                return false;
+        }
+
+        while (getline(&line, &line_cap, f) > 0) {
+                char* src = strtok(line, " \t\r\n");
+                char* dir = strtok(NULL, " \t\r\n");
+                char* url = strtok(NULL, " \t\r\n");
+
+                line_no++;
+                if (src == NULL || *src == '#')
+                        continue;
+                if (dir == NULL) {
+                        fprintf(stderr, "ERROR: %s:%d: expected a source and a build directory\n", list_path, line_no);
+                        ok = false;
+                        break;
+                }
+
+                if (*count == cap) {
+                        cap = cap ? cap * 2 : 64;
+                        *sites = realloc(*sites, cap * sizeof(BatchSite));
+                        if (*sites == NULL) {
+                                fprintf(stderr, "ERROR: Out of memory while reading the site list\n");
+                                abort();
+                        }
+                }
+                cleandirname(src);
+                cleandirname(dir);
+                memset(&(*sites)[*count], 0, sizeof(BatchSite));
+                (*sites)[*count].src = arena_strdup(strings, src);
+                (*sites)[*count].dir = arena_strdup(strings, dir);
+                if (url) {
+                        cleandirname(url);
+                        (*sites)[*count].url = arena_strdup(strings, url);
+                }
+                (*count)++;
+        }
+
+        free(line);
+        fclose(f);
+        if (!ok) {
+                free(*sites);
+                *sites = NULL;
+        }
+        return ok;
+}
+
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
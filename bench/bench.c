@@ -0,0 +1,434 @@
+/*
+ * File: bench.c
+ * -------------
+ * Benchmarks for txt2web, run with `make bench`. The string helpers and the
+ * renderer are timed in isolation on fixed inputs, then a whole site
+ * generated by gencorpus is built (full and incremental) in-process.
+ *
+ *   bench [-r rounds] [-j jobs] <corpus directory>
+ *
+ * Every benchmark is repeated and the fastest round is reported, which is
+ * the least noisy figure on a shared machine.
+ */
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../txt2web.h"
+
+#define MICRO_SECONDS 0.2       /* minimum run time of one micro-benchmark round */
+
+typedef struct {
+        size_t len;
+        Post post;
+        Buf out;
+        Buf scratch;
+        FILE* devnull;
+        Arena strings;          /* lives as long as the benchmarks */
+        Arena page_strings;     /* reset after every render_html() */
+} MicroInput;
+
+typedef void (*MicroFunc)(MicroInput* in);
+
+static double now(void);
+static void micro(const char* name, MicroFunc fn, MicroInput* in, int rounds);
+static void bench_inline_plain(MicroInput* in);
+static void bench_inline_url(MicroInput* in);
+static void bench_inline_placeholder(MicroInput* in);
+static void bench_expand_placeholders(MicroInput* in);
+static void bench_render_code(MicroInput* in);
+static void bench_css_minify(MicroInput* in);
+static void bench_scan_next(MicroInput* in);
+static void bench_starts_with(MicroInput* in);
+static void bench_get_value(MicroInput* in);
+static void bench_parse_date(MicroInput* in);
+static void bench_render_html(MicroInput* in);
+static void bench_render_buffer(MicroInput* in);
+static bool corpus_size(const char* dir, unsigned long* bytes, unsigned long* posts);
+static double site_build(const char* corpus, const char* out, int jobs, bool incremental);
+static void bench_usage(const char* prog);
+
+static const char plain_line[] =
+        "The quick brown fox jumps over the lazy dog while the site generator renders every line.\n";
+static const char url_line[] =
+        "See https://example.com/posts/2023/05/page.html and http://example.org/ for the details.\n";
+static const char placeholder_line[] =
+        "This is {title}, written on {date}, which is the {title} of a post from {date}.\n";
+static const char code_line[] =
+        "    if (a < b && c > d) { return buf[i] << 2 > limit; }\n";
+static const char scan_text[] =
+        "A long paragraph of plain prose, the common case for the scanner: the renderer looks for "
+        "the few bytes that matter and copies everything between them in one piece, so most of the "
+        "time goes into skipping text like this. Only at the very end is there a <tag> to stop at, "
+        "after several hundred bytes without a single character of the class being searched for.\n";
+static const char css_text[] =
+        "/* a stylesheet as it is written by hand */\n"
+        "body {\n  font-family: Open Sans, Arial;\n  color: black;\n  background-color: white;\n}\n\n"
+        "main {\n  max-width: 800px;\n  margin: 0 auto;\n}\n\n"
+        "nav ul > li, .date {\n  list-style: none;\n  content: \"a; b\";\n}\n";
+static const char meta_line[] =
+        "description:    A post about benchmarking the txt2web renderer\n";
+static const char post_page[] =
+        "-----\ntitle: Benchmark\ndate: May 11 2023\ndescription: Page\ntags: a, b\n-----\n"
+        "# {title}\nWritten on {date}. See https://example.com/1 for the details.\n\n"
+        "## Section\nThe quick brown fox jumps over the lazy dog while the site generator renders.\n"
+        "Another line of the same paragraph, long enough to be representative of prose.\n\n"
+        "@/images/pic.png\n\n```\nint main(void) { return a < b; }\n```\n"
+        "### Closing\nTrailing paragraph with a link to http://example.org/ and nothing else.\n";
+
+
+int main(int argc, char** argv)
+{
+        MicroInput in;
+        unsigned long bytes;
+        unsigned long posts;
+        char* corpus;
+        char* out;
+        double best_full = 0;
+        double best_incremental = 0;
+        int rounds = 3;
+        int jobs = pool_default_jobs();
+        int opt;
+        int level;
+        int i;
+
+        while ((opt = getopt(argc, argv, "r:j:")) != -1) {
+                switch (opt) {
+                case 'r':
+                        rounds = atoi(optarg);
+                        break;
+                case 'j':
+                        jobs = atoi(optarg);
+                        break;
+                default:
+                        bench_usage(argv[0]);
+                        return 1;
+                }
+        }
+        if (optind != argc - 1 || rounds < 1 || jobs < 1) {
+                bench_usage(argv[0]);
+                return 1;
+        }
+
+        memset(&in, 0, sizeof(in));
+        in.post.title = arena_strdup(&in.strings, "Benchmark post");
+        in.post.date_str = arena_strdup(&in.strings, "May 11 2023");
+        in.devnull = fopen("/dev/null", "w");
+        arena_init(&in.strings);
+        arena_init(&in.page_strings);
+
+        printf("%-28s %12s %10s\n", "micro-benchmark", "ns/op", "MB/s");
+        micro("render_inline (plain)", bench_inline_plain, &in, rounds);
+        micro("render_inline (urls)", bench_inline_url, &in, rounds);
+        micro("render_inline (placeholders)", bench_inline_placeholder, &in, rounds);
+        micro("expand_placeholders", bench_expand_placeholders, &in, rounds);
+        micro("render_code", bench_render_code, &in, rounds);
+        micro("css_minify", bench_css_minify, &in, rounds);
+        /* the last level the CPU supports is also the one picked by default */
+        for (level = SCAN_SCALAR; level <= SCAN_AVX2; level++) {
+                char name[32];
+
+                if (!scan_set_level((ScanLevel) level))
+                        continue;
+                sprintf(name, "scan_next (%s)", scan_level_name());
+                micro(name, bench_scan_next, &in, rounds);
+        }
+        micro("str_starts_with", bench_starts_with, &in, rounds);
+        micro("str_get_value", bench_get_value, &in, rounds);
+        micro("parse_date", bench_parse_date, &in, rounds);
+        micro("render_html (page)", bench_render_html, &in, rounds);
+        micro("render_buffer (page)", bench_render_buffer, &in, rounds);
+
+        buf_free(&in.out);
+        buf_free(&in.scratch);
+        arena_free(&in.strings);
+        arena_free(&in.page_strings);
+        fclose(in.devnull);
+
+        corpus = realpath(argv[optind], NULL);
+        if (corpus == NULL || !corpus_size(corpus, &bytes, &posts)) {
+                fprintf(stderr, "Could not read corpus: %s/posts\n", argv[optind]);
+                free(corpus);
+                return 1;
+        }
+        out = str_printf("%s.out", corpus);
+
+        for (i = 0; i < rounds; i++) {
+                double full = site_build(corpus, out, jobs, false);
+                double incremental = site_build(corpus, out, jobs, true);
+
+                if (full < 0 || incremental < 0) {
+                        fprintf(stderr, "Site build failed\n");
+                        free(corpus);
+                        free(out);
+                        return 1;
+                }
+                if (i == 0 || full < best_full)
+                        best_full = full;
+                if (i == 0 || incremental < best_incremental)
+                        best_incremental = incremental;
+        }
+
+        printf("\nsite build: %lu posts, %.1f MB of source, %d jobs\n", posts, bytes / 1e6, jobs);
+        printf("%-28s %10.4f s %10.1f MB/s %10.0f posts/s\n", "full build",
+               best_full, bytes / 1e6 / best_full, posts / best_full);
+        printf("%-28s %10.4f s %10.1f MB/s %10.0f posts/s\n", "incremental (no changes)",
+               best_incremental, bytes / 1e6 / best_incremental, posts / best_incremental);
+
+        free(corpus);
+        free(out);
+        return 0;
+}
+
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* runs fn until MICRO_SECONDS have passed, rounds times, and prints the best */
+static void micro(const char* name, MicroFunc fn, MicroInput* in, int rounds)
+{
+        double best = 0;
+        int r;
+
+        for (r = 0; r < rounds; r++) {
+                unsigned long iterations = 0;
+                unsigned long batch = 64;
+                double start = now();
+                double elapsed;
+                unsigned long i;
+
+                do {
+                        for (i = 0; i < batch; i++)
+                                fn(in);
+                        iterations += batch;
+                        batch *= 2;
+                        elapsed = now() - start;
+                } while (elapsed < MICRO_SECONDS);
+
+                elapsed /= iterations;
+                if (r == 0 || elapsed < best)
+                        best = elapsed;
+        }
+
+        printf("%-28s %12.1f %10.1f\n", name, best * 1e9, in->len / 1e6 / best);
+}
+
+
+static void bench_inline_plain(MicroInput* in)
+{
+        in->len = sizeof(plain_line) - 1;
+        buf_clear(&in->out);
+        render_inline(&in->out, &in->scratch, plain_line, in->len, &in->post);
+}
+
+
+static void bench_inline_url(MicroInput* in)
+{
+        in->len = sizeof(url_line) - 1;
+        buf_clear(&in->out);
+        render_inline(&in->out, &in->scratch, url_line, in->len, &in->post);
+}
+
+
+static void bench_inline_placeholder(MicroInput* in)
+{
+        in->len = sizeof(placeholder_line) - 1;
+        buf_clear(&in->out);
+        render_inline(&in->out, &in->scratch, placeholder_line, in->len, &in->post);
+}
+
+
+static void bench_expand_placeholders(MicroInput* in)
+{
+        in->len = sizeof(placeholder_line) - 1;
+        expand_placeholders(&in->scratch, placeholder_line, in->len, &in->post);
+}
+
+
+static void bench_render_code(MicroInput* in)
+{
+        in->len = sizeof(code_line) - 1;
+        buf_clear(&in->out);
+        render_code(&in->out, code_line, in->len);
+}
+
+
+static void bench_css_minify(MicroInput* in)
+{
+        CssMinifier m;
+
+        in->len = sizeof(css_text) - 1;
+        buf_clear(&in->out);
+        css_minify_init(&m);
+        css_minify(&m, &in->out, css_text, in->len);
+        css_minify_finish(&m, &in->out);
+}
+
+
+/* every '<', '>' and '{' in a long stretch of prose */
+static void bench_scan_next(MicroInput* in)
+{
+        static const ScanClass chars = { "<>{", 3 };
+        const char* end = scan_text + sizeof(scan_text) - 1;
+        const char* p = scan_text;
+
+        in->len = sizeof(scan_text) - 1;
+        while ((p = scan_next(&chars, p, end)) < end)
+                p++;
+}
+
+
+static void bench_starts_with(MicroInput* in)
+{
+        static const char* prefixes[] = { "-----", "title:", "date:", "description:", "```", "#", "@" };
+        size_t i;
+
+        in->len = sizeof(meta_line) - 1;
+        for (i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++) {
+                if (str_starts_with(meta_line, in->len, prefixes[i]))
+                        in->out.len++;
+        }
+}
+
+
+static void bench_get_value(MicroInput* in)
+{
+        size_t value_len;
+
+        in->len = sizeof(meta_line) - 1;
+        in->out.len += (size_t) str_get_value(meta_line, in->len, "description:", &value_len) & 1;
+}
+
+
+static void bench_parse_date(MicroInput* in)
+{
+        static const char date[] = "May 11 2023";
+        time_t t;
+
+        in->len = sizeof(date) - 1;
+        parse_date(date, &t);
+        in->out.len += (size_t) t & 1;
+}
+
+
+static void bench_render_html(MicroInput* in)
+{
+        Post post = { 0 };
+
+        in->len = sizeof(post_page) - 1;
+        render_html(post_page, in->len, "bench.txt", in->devnull, true, NULL, &post, &in->page_strings, in->devnull);
+
+        /* keep the arena from growing with every iteration */
+        arena_free(&in->page_strings);
+        arena_init(&in->page_strings);
+}
+
+
+/* render_html() through the library API, into memory */
+static void bench_render_buffer(MicroInput* in)
+{
+        RenderResult result;
+
+        in->len = sizeof(post_page) - 1;
+        in->out.len = 0;
+        render_buffer(post_page, in->len, "bench.txt", true, render_sink_buf, &in->out, &result);
+        render_result_free(&result);
+}
+
+
+/* sums the size of the .txt files in dir/posts */
+static bool corpus_size(const char* dir, unsigned long* bytes, unsigned long* posts)
+{
+        char* postdir = path_join(dir, "posts");
+        DIR* d = opendir(postdir);
+        struct dirent* ent;
+
+        *bytes = 0;
+        *posts = 0;
+        if (d == NULL) {
+                free(postdir);
+                return false;
+        }
+
+        while ((ent = readdir(d)) != NULL) {
+                char* path;
+                struct stat st;
+
+                if (strstr(ent->d_name, ".txt") == NULL)
+                        continue;
+                path = path_join(postdir, ent->d_name);
+                if (stat(path, &st) == 0) {
+                        *bytes += st.st_size;
+                        (*posts)++;
+                }
+                free(path);
+        }
+
+        closedir(d);
+        free(postdir);
+        return *posts > 0;
+}
+
+
+/*
+ * Builds corpus into out with build_site() and returns the wall clock time,
+ * or -1 when the build failed. Progress messages are sent to /dev/null.
+ */
+static double site_build(const char* corpus, const char* out, int jobs, bool incremental)
+{
+        Build build;
+        int saved_stdout;
+        int saved_stderr;
+        int devnull;
+        double start;
+        double elapsed;
+        int status;
+
+        memset(&build, 0, sizeof(build));
+        build.src = corpus;
+        build.dir = out;
+        build.jobs = jobs;
+        build.queue_depth = 64;
+        build.incremental = incremental;
+
+        mkdir(out, 0755);
+
+        fflush(stdout);
+        fflush(stderr);
+        saved_stdout = dup(STDOUT_FILENO);
+        saved_stderr = dup(STDERR_FILENO);
+        devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        close(devnull);
+
+        start = now();
+        status = build_site(&build);
+        elapsed = now() - start;
+
+        fflush(stdout);
+        fflush(stderr);
+        dup2(saved_stdout, STDOUT_FILENO);
+        dup2(saved_stderr, STDERR_FILENO);
+        close(saved_stdout);
+        close(saved_stderr);
+
+        return status == 0 ? elapsed : -1;
+}
+
+
+static void bench_usage(const char* prog)
+{
+        fprintf(stderr, "Usage: %s [-r rounds] [-j jobs] <corpus directory>\n", prog);
+}
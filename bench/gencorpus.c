@@ -0,0 +1,318 @@
+/*
+ * File: gencorpus.c
+ * -----------------
+ * Writes a synthetic txt2web site for benchmarking. The output only depends
+ * on the options (and the seed), so two runs with the same options produce
+ * byte-identical trees and timings can be compared across commits.
+ *
+ *   gencorpus [-n posts] [-s post_bytes] [-l link_density] [-c code_ratio]
+ *             [-H heading_density] [-m missing_ratio] [-a assets] [-S seed] <directory>
+ *
+ * Densities and ratios are fractions between 0 and 1: -l is the share of
+ * paragraph lines that contain a URL, -c the share of blocks that are code
+ * blocks, -H the share of blocks that start with a heading and -m the share
+ * of metadata lines (title, date, description, tags) left out of a post.
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define ASSET_FANOUT 8
+
+typedef struct {
+        long posts;
+        long post_bytes;
+        double link_density;
+        double code_ratio;
+        double heading_density;
+        double missing_ratio;
+        long assets;
+        unsigned long seed;
+} CorpusOptions;
+
+static const char* words[] = {
+        "the", "static", "site", "generator", "renders", "plain", "text", "into",
+        "pages", "with", "a", "single", "pass", "over", "every", "line", "of",
+        "input", "while", "buffers", "grow", "to", "fit", "longest", "post",
+        "index", "lists", "all", "posts", "sorted", "by", "date", "and", "title",
+        "{title}", "{date}", "quickly", "without", "copying", "data", "twice"
+};
+
+static const char* months[] = {
+        "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+static unsigned long rng_state;
+
+static unsigned long rng_next(void);
+static double rng_unit(void);
+static void write_words(FILE* f, long count);
+static long write_paragraph(FILE* f, const CorpusOptions* opts);
+static long write_code(FILE* f);
+static bool has_line(const CorpusOptions* opts);
+static bool write_post(const char* dir, long n, const CorpusOptions* opts);
+static bool write_asset(const char* dir, long n);
+static bool write_file(const char* path, const char* contents);
+static bool make_dir(const char* path);
+static void usage(const char* prog);
+
+
+int main(int argc, char** argv)
+{
+        CorpusOptions opts;
+        char path[4096];
+        long i;
+        int opt;
+
+        opts.posts = 1000;
+        opts.post_bytes = 4096;
+        opts.link_density = 0.1;
+        opts.code_ratio = 0.1;
+        opts.heading_density = 0.2;
+        opts.missing_ratio = 0;
+        opts.assets = 100;
+        opts.seed = 1;
+
+        while ((opt = getopt(argc, argv, "n:s:l:c:H:m:a:S:")) != -1) {
+                switch (opt) {
+                case 'n': opts.posts = atol(optarg); break;
+                case 's': opts.post_bytes = atol(optarg); break;
+                case 'l': opts.link_density = atof(optarg); break;
+                case 'c': opts.code_ratio = atof(optarg); break;
+                case 'H': opts.heading_density = atof(optarg); break;
+                case 'm': opts.missing_ratio = atof(optarg); break;
+                case 'a': opts.assets = atol(optarg); break;
+                case 'S': opts.seed = strtoul(optarg, NULL, 10); break;
+                default:
+                        usage(argv[0]);
+                        return 1;
+                }
+        }
+        if (optind != argc - 1 || opts.posts < 0 || opts.post_bytes < 0 || opts.assets < 0) {
+                usage(argv[0]);
+                return 1;
+        }
+        rng_state = opts.seed ? opts.seed : 1;
+
+        if (!make_dir(argv[optind]))
+                return 1;
+
+        sprintf(path, "%.4000s/index", argv[optind]);
+        if (!write_file(path, "-----\ntitle: Benchmark corpus\ndescription: Generated by gencorpus\ntags: bench\n-----\n"
+                        "# {title}\nA synthetic site, see https://example.com/txt2web for details.\n"))
+                return 1;
+        sprintf(path, "%.4000s/style.css", argv[optind]);
+        if (!write_file(path, "body { max-width: 40em; margin: auto; }\n"))
+                return 1;
+
+        sprintf(path, "%.4000s/posts", argv[optind]);
+        if (!make_dir(path))
+                return 1;
+        for (i = 0; i < opts.posts; i++) {
+                if (!write_post(path, i, &opts))
+                        return 1;
+        }
+
+        sprintf(path, "%.4000s/assets", argv[optind]);
+        if (opts.assets > 0 && !make_dir(path))
+                return 1;
+        for (i = 0; i < opts.assets; i++) {
+                if (!write_asset(path, i))
+                        return 1;
+        }
+
+        printf("Generated %ld posts of about %ld bytes and %ld assets in %s\n",
+               opts.posts, opts.post_bytes, opts.assets, argv[optind]);
+        return 0;
+}
+
+
+/* xorshift32, kept to 32 bits so the corpus is the same on every platform */
+static unsigned long rng_next(void)
+{
+        rng_state ^= (rng_state << 13) & 0xffffffffUL;
+        rng_state ^= rng_state >> 17;
+        rng_state ^= (rng_state << 5) & 0xffffffffUL;
+        return rng_state;
+}
+
+
+static double rng_unit(void)
+{
+        return (double) rng_next() / 4294967296.0;
+}
+
+
+static void write_words(FILE* f, long count)
+{
+        long i;
+
+        for (i = 0; i < count; i++)
+                fprintf(f, "%s%s", i ? " " : "", words[rng_next() % (sizeof(words) / sizeof(words[0]))]);
+}
+
+
+/* returns roughly the number of bytes written */
+static long write_paragraph(FILE* f, const CorpusOptions* opts)
+{
+        long lines = 1 + rng_next() % 4;
+        long written = 0;
+        long i;
+
+        for (i = 0; i < lines; i++) {
+                write_words(f, 8 + rng_next() % 8);
+                if (rng_unit() < opts->link_density)
+                        fprintf(f, " see https://example.com/%lu/page.html", rng_next() % 10000);
+                fprintf(f, "\n");
+                written += 80;
+        }
+        fprintf(f, "\n");
+        return written;
+}
+
+
+static long write_code(FILE* f)
+{
+        long lines = 2 + rng_next() % 6;
+        long i;
+
+        fprintf(f, "```\n");
+        for (i = 0; i < lines; i++)
+                fprintf(f, "    if (a < b && c > d) return buf[%lu];\n", rng_next() % 100);
+        fprintf(f, "```\n\n");
+        return lines * 40;
+}
+
+
+static bool write_post(const char* dir, long n, const CorpusOptions* opts)
+{
+        char path[4096];
+        FILE* f;
+        long written = 0;
+        unsigned long month;
+        unsigned long day;
+        unsigned long year;
+
+        sprintf(path, "%.4000s/p%05ld.txt", dir, n);
+        if ((f = fopen(path, "w")) == NULL) {
+                fprintf(stderr, "Could not write %s: %s\n", path, strerror(errno));
+                return false;
+        }
+
+        fprintf(f, "-----\n");
+        if (has_line(opts)) {
+                fprintf(f, "title: Post %ld ", n);
+                write_words(f, 3);
+                fprintf(f, "\n");
+        }
+        if (has_line(opts)) {
+                /* one draw per statement: argument evaluation order is unspecified */
+                month = rng_next() % 12;
+                day = 1 + rng_next() % 28;
+                year = 2000 + rng_next() % 24;
+                fprintf(f, "date: %s %02lu %lu\n", months[month], day, year);
+        }
+        if (has_line(opts)) {
+                fprintf(f, "description: ");
+                write_words(f, 10);
+                fprintf(f, "\n");
+        }
+        if (has_line(opts))
+                fprintf(f, "tags: bench, t%lu\n", rng_next() % 50);
+        fprintf(f, "-----\n");
+
+        while (written < opts->post_bytes) {
+                if (rng_unit() < opts->heading_density) {
+                        fprintf(f, "%.*s ", (int) (1 + rng_next() % 3), "###");
+                        write_words(f, 4);
+                        fprintf(f, "\n");
+                        written += 30;
+                }
+                if (rng_unit() < opts->code_ratio)
+                        written += write_code(f);
+                else
+                        written += write_paragraph(f, opts);
+        }
+
+        if (fclose(f) != 0) {
+                fprintf(stderr, "Could not write %s: %s\n", path, strerror(errno));
+                return false;
+        }
+        return true;
+}
+
+
+/* whether the next metadata line is written; draws nothing without -m, so the corpus stays the same */
+static bool has_line(const CorpusOptions* opts)
+{
+        return opts->missing_ratio <= 0 || rng_unit() >= opts->missing_ratio;
+}
+
+
+/* assets are spread over a tree ASSET_FANOUT wide, 1 to 64 KiB each */
+static bool write_asset(const char* dir, long n)
+{
+        char path[4096];
+        char block[1024];
+        long size = 1 + rng_next() % 64;
+        long parent = n / ASSET_FANOUT;
+        FILE* f;
+        long i;
+
+        sprintf(path, "%.4000s/d%ld", dir, parent % ASSET_FANOUT);
+        if (!make_dir(path))
+                return false;
+        sprintf(path, "%.4000s/d%ld/d%ld", dir, parent % ASSET_FANOUT, parent);
+        if (!make_dir(path))
+                return false;
+        sprintf(path, "%.4000s/d%ld/d%ld/a%05ld.bin", dir, parent % ASSET_FANOUT, parent, n);
+        if ((f = fopen(path, "wb")) == NULL) {
+                fprintf(stderr, "Could not write %s: %s\n", path, strerror(errno));
+                return false;
+        }
+
+        for (i = 0; i < (long) sizeof(block); i++)
+                block[i] = (char) rng_next();
+        for (i = 0; i < size; i++)
+                fwrite(block, 1, sizeof(block), f);
+
+        if (fclose(f) != 0) {
+                fprintf(stderr, "Could not write %s: %s\n", path, strerror(errno));
+                return false;
+        }
+        return true;
+}
+
+
+static bool write_file(const char* path, const char* contents)
+{
+        FILE* f = fopen(path, "w");
+
+        if (f == NULL || fputs(contents, f) == EOF) {
+                fprintf(stderr, "Could not write %s: %s\n", path, strerror(errno));
+                if (f)
+                        fclose(f);
+                return false;
+        }
+        return fclose(f) == 0;
+}
+
+
+static bool make_dir(const char* path)
+{
+        if (mkdir(path, 0755) == 0 || errno == EEXIST)
+                return true;
+        fprintf(stderr, "Could not create directory %s: %s\n", path, strerror(errno));
+        return false;
+}
+
+
+static void usage(const char* prog)
+{
+        fprintf(stderr, "Usage: %s [-n posts] [-s post_bytes] [-l link_density] [-c code_ratio]\n", prog);
+        fprintf(stderr, "       [-H heading_density] [-m missing_ratio] [-a assets] [-S seed] <directory>\n");
+}
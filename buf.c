@@ -0,0 +1,92 @@
+/*
+ * File: buf.c
+ * -----------
+ * Growable byte buffer. A Buf is meant to be reused: buf_clear() keeps the
+ * allocation around so that rendering a line does not touch the heap once
+ * the buffer has grown to fit the longest line seen so far.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "txt2web.h"
+
+
+void buf_reserve(Buf* b, size_t extra)
+{
+        size_t cap;
+
+        if (b->len + extra + 1 <= b->cap)
+                return;
+
+        cap = b->cap ? b->cap : 256;
+        while (cap < b->len + extra + 1)
+                cap *= 2;
+
+        b->data = realloc(b->data, cap);
+        stats_count(STAT_ALLOCS, 1);
+        if (b->data == NULL) {
+                fprintf(stderr, "ERROR: Out of memory\n");
+                abort();
+        }
+        b->cap = cap;
+}
+
+
+void buf_append(Buf* b, const char* data, size_t len)
+{
+        buf_reserve(b, len);
+        memcpy(b->data + b->len, data, len);
+        b->len += len;
+        b->data[b->len] = '\0';
+}
+
+
+void buf_puts(Buf* b, const char* str)
+{
+        if (str)
+                buf_append(b, str, strlen(str));
+}
+
+
+void buf_putc(Buf* b, char c)
+{
+        buf_reserve(b, 1);
+        b->data[b->len++] = c;
+        b->data[b->len] = '\0';
+}
+
+
+void buf_put_int(Buf* b, int n)
+{
+        char digits[24];
+        int len = sprintf(digits, "%d", n);
+        buf_append(b, digits, len);
+}
+
+
+void buf_clear(Buf* b)
+{
+        b->len = 0;
+        if (b->data)
+                b->data[0] = '\0';
+}
+
+
+/* writes the buffer to f and empties it; returns false on a write error */
+bool buf_flush(Buf* b, FILE* f)
+{
+        bool ok = fwrite(b->data, 1, b->len, f) == b->len;
+        stats_count(STAT_BYTES_WRITTEN, b->len);
+        buf_clear(b);
+        return ok;
+}
+
+
+void buf_free(Buf* b)
+{
+        free(b->data);
+        b->data = NULL;
+        b->len = 0;
+        b->cap = 0;
+}
@@ -0,0 +1,330 @@
+/*
+ * File: cache.c
+ * -------------
+ * Render cache shared between build directories (--cache=DIR). A rendered
+ * post is stored under a key made from its source text, its file name, the
+ * layout and whether search terms are collected (-s), so any build of the
+ * same post with the same settings, in any output directory, can copy (or
+ * reflink, see copy.c) the cached page instead of rendering it again:
+ *
+ *     DIR/3f/3fa9c0d1e2b45678.html    the rendered page
+ *     DIR/3f/3fa9c0d1e2b45678.meta    the post's metadata and the messages
+ *                                     printed while rendering it
+ *
+ * Both are written to a temporary name and renamed into place, .meta last,
+ * so several builds can share one cache. The modification time of a .meta
+ * file is the last time the entry was used; cache_trim() removes the least
+ * recently used entries until the cache fits in its size limit. Only the
+ * first trim of a process walks the whole cache; after that it is trimmed
+ * again once the pages stored since take it over the limit.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "txt2web.h"
+
+/* change whenever render_html() writes something different for the same input */
+#define CACHE_VERSION "txt2web-cache 3"
+
+typedef struct {
+        char* meta;
+        time_t used;
+        off_t size;             /* .html and .meta together */
+} CacheEntry;
+
+static char* entry_path(unsigned long key, const char* suffix);
+static void put_field(Buf* out, const char* value);
+static char* get_field(Arena* strings, const char** p, const char* end, bool* ok);
+static bool copy_into_place(const char* src, const char* dest);
+static int compare_used(const void* a, const void* b);
+
+static char* cache_dir = NULL;
+static unsigned long cache_max = 0;
+static unsigned long cache_size = 0;    /* after the last trim, plus what was stored since */
+static bool cache_size_known = false;
+
+
+/* uses dir (created if needed) as the render cache, holding up to max_bytes */
+bool cache_open(const char* dir, unsigned long max_bytes)
+{
+        if (mkdir(dir, 0755) != 0 && !direxists(dir)) {
+                fprintf(stderr, "ERROR: Could not create cache directory: %s\n", dir);
+                return false;
+        }
+        free(cache_dir);
+        cache_dir = str_printf("%s", dir);
+        cache_max = max_bytes;
+        cache_size_known = false;
+        return true;
+}
+
+
+bool cache_enabled(void)
+{
+        return cache_dir != NULL;
+}
+
+
+void cache_close(void)
+{
+        free(cache_dir);
+        cache_dir = NULL;
+}
+
+
+/* the key of a post rendered from source text with hash source_hash */
+unsigned long cache_key(unsigned long source_hash, const char* input_filename, bool add_link)
+{
+        unsigned long key = hash_str(HASH_INIT, CACHE_VERSION);
+
+        key = hash_bytes(key, &source_hash, sizeof(source_hash));
+        key = hash_str(key, input_filename);
+        key = hash_bytes(key, &add_link, sizeof(add_link));
+        key = hash_str(key, search_enabled() ? "search" : NULL);
+        key = hash_str(key, minify_enabled() ? "minify" : NULL);
+        if (fingerprint_enabled()) {
+                unsigned long assets = fingerprint_hash();
+                key = hash_bytes(key, &assets, sizeof(assets));
+        }
+        if (image_enabled()) {
+                unsigned long images = image_hash();
+                key = hash_bytes(key, &images, sizeof(images));
+        }
+        return hash_bytes(key, &layout_get()->hash, sizeof(layout_get()->hash));
+}
+
+
+/*
+ * Looks key up. On a hit the cached page is copied to output_filename, the
+ * stored metadata is set in blog_post, the messages from the original render
+ * are repeated on log, and true is returned. size and source_hash must match
+ * what was stored, which guards against the rare key collision.
+ */
+bool cache_fetch(unsigned long key, unsigned long source_hash, size_t size, const char* output_filename,
+                 Post* blog_post, Arena* strings, FILE* log)
+{
+        char* meta = entry_path(key, ".meta");
+        char* html = entry_path(key, ".html");
+        char* header = str_printf("%s\n%lx %lu\n", CACHE_VERSION, source_hash, (unsigned long) size);
+        MappedFile src;
+        const char* p;
+        const char* end;
+        Post post;
+        bool ok = false;
+
+        if (!map_file(meta, &src))
+                goto done;
+
+        p = src.data;
+        end = src.data + src.len;
+        ok = src.len >= strlen(header) && memcmp(p, header, strlen(header)) == 0;
+        if (ok) {
+                p += strlen(header);
+                memset(&post, 0, sizeof(post));
+                post.title = get_field(strings, &p, end, &ok);
+                post.date_str = get_field(strings, &p, end, &ok);
+                post.description = get_field(strings, &p, end, &ok);
+                post.tags = get_field(strings, &p, end, &ok);
+                post.terms = get_field(strings, &p, end, &ok);
+        }
+        ok = ok && copy_into_place(html, output_filename);
+        if (ok) {
+                if (post.date_str)
+                        parse_date(post.date_str, &post.date);
+                *blog_post = post;
+                fwrite(p, 1, end - p, log);
+                /* mark the entry as used for cache_trim() */
+                utimensat(AT_FDCWD, meta, NULL, 0);
+        }
+        unmap_file(&src);
+
+done:
+        free(meta);
+        free(html);
+        free(header);
+        return ok;
+}
+
+
+/* adds the page just written to output_filename to the cache under key */
+void cache_store(unsigned long key, unsigned long source_hash, size_t size, const char* output_filename,
+                 const Post* blog_post, const char* messages)
+{
+        char* dir = str_printf("%s/%02lx", cache_dir, key >> 56);
+        char* meta = entry_path(key, ".meta");
+        char* html = entry_path(key, ".html");
+        char* tmp = str_printf("%s.%ld.tmp", meta, (long) getpid());
+        char* header = str_printf("%s\n%lx %lu\n", CACHE_VERSION, source_hash, (unsigned long) size);
+        Buf out = { 0 };
+        unsigned long stored;
+        struct stat st;
+        FILE* f;
+        bool ok;
+
+        mkdir(dir, 0755);
+        ok = copy_into_place(output_filename, html);
+
+        buf_puts(&out, header);
+        put_field(&out, blog_post->title);
+        put_field(&out, blog_post->date_str);
+        put_field(&out, blog_post->description);
+        put_field(&out, blog_post->tags);
+        put_field(&out, blog_post->terms);
+        if (messages)
+                buf_puts(&out, messages);
+        stored = out.len;
+
+        if (ok && (f = fopen(tmp, "w")) != NULL) {
+                ok = buf_flush(&out, f);
+                ok = fclose(f) == 0 && ok && rename(tmp, meta) == 0;
+                if (!ok)
+                        remove(tmp);
+                else if (stat(html, &st) == 0)
+                        __atomic_fetch_add(&cache_size, stored + st.st_size, __ATOMIC_RELAXED);
+        }
+
+        buf_free(&out);
+        free(header);
+        free(dir);
+        free(meta);
+        free(html);
+        free(tmp);
+}
+
+
+/* removes the least recently used entries until the cache is within its limit */
+void cache_trim(void)
+{
+        Arena strings;
+        FsEntry* files;
+        CacheEntry* entries;
+        size_t file_count;
+        size_t count = 0;
+        unsigned long total = 0;
+        size_t i;
+
+        if (cache_size_known && cache_size <= cache_max)
+                return;
+
+        arena_init(&strings);
+        if (!fs_scan(&strings, cache_dir, false, NULL, NULL, &files, &file_count)) {
+                arena_free(&strings);
+                return;
+        }
+
+        entries = malloc((file_count + 1) * sizeof(CacheEntry));
+        if (entries == NULL) {
+                fprintf(stderr, "ERROR: Out of memory while trimming the cache\n");
+                abort();
+        }
+
+        for (i = 0; i < file_count; i++) {
+                size_t len = strlen(files[i].path);
+                struct stat st;
+                char* html;
+
+                if (files[i].is_dir || len < 5 || strcmp(files[i].path + len - 5, ".meta") != 0
+                    || stat(files[i].path, &st) != 0)
+                        continue;
+
+                entries[count].meta = files[i].path;
+                entries[count].used = st.st_mtime;
+                entries[count].size = st.st_size;
+                html = str_printf("%.*s.html", (int) (len - 5), files[i].path);
+                if (stat(html, &st) == 0)
+                        entries[count].size += st.st_size;
+                free(html);
+                total += entries[count].size;
+                count++;
+        }
+
+        if (total > cache_max) {
+                qsort(entries, count, sizeof(CacheEntry), compare_used);
+                for (i = 0; i < count && total > cache_max; i++) {
+                        size_t len = strlen(entries[i].meta);
+                        char* html = str_printf("%.*s.html", (int) (len - 5), entries[i].meta);
+
+                        /* .meta first: without it the page is never used again */
+                        remove(entries[i].meta);
+                        remove(html);
+                        free(html);
+                        total -= entries[i].size;
+                }
+        }
+        cache_size = total;
+        cache_size_known = true;
+
+        free(entries);
+        free(files);
+        arena_free(&strings);
+}
+
+
+static char* entry_path(unsigned long key, const char* suffix)
+{
+        return str_printf("%s/%02lx/%016lx%s", cache_dir, key >> 56, key, suffix);
+}
+
+
+/* one line per field: '=' and the value, or '-' when it was not set */
+static void put_field(Buf* out, const char* value)
+{
+        if (value == NULL) {
+                buf_puts(out, "-\n");
+                return;
+        }
+        buf_putc(out, '=');
+        buf_puts(out, value);
+        buf_putc(out, '\n');
+}
+
+
+static char* get_field(Arena* strings, const char** p, const char* end, bool* ok)
+{
+        const char* line = *p;
+        const char* eol = memchr(line, '\n', end - line);
+
+        if (!*ok || eol == NULL || (*line != '=' && *line != '-')) {
+                *ok = false;
+                return NULL;
+        }
+        *p = eol + 1;
+        if (*line == '-')
+                return NULL;
+        return arena_strndup(strings, line + 1, eol - line - 1);
+}
+
+
+/*
+ * Copies src over dest through a temporary file, so readers of dest (another
+ * build sharing the cache) never see half a file. The copy gets the current
+ * time, not src's: compress.c goes by the page's modification time.
+ */
+static bool copy_into_place(const char* src, const char* dest)
+{
+        char* tmp = str_printf("%s.%ld.tmp", dest, (long) getpid());
+        unsigned long hash;
+        struct stat st;
+        bool ok;
+
+        ok = stat(src, &st) == 0 && copy_file(src, tmp, &st, COPY_AUTO, &hash)
+                && utimensat(AT_FDCWD, tmp, NULL, 0) == 0 && rename(tmp, dest) == 0;
+        if (!ok)
+                remove(tmp);
+        free(tmp);
+        return ok;
+}
+
+
+/* least recently used first */
+static int compare_used(const void* a, const void* b)
+{
+        const CacheEntry* x = a;
+        const CacheEntry* y = b;
+
+        return (x->used > y->used) - (x->used < y->used);
+}
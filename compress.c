@@ -0,0 +1,250 @@
+/*
+ * File: compress.c
+ * ----------------
+ * Precompressed variants of the build output (-z): page.html.gz, .br and
+ * .zst next to every generated page and compressible asset, for servers
+ * that serve them directly (nginx gzip_static/brotli_static). Each format
+ * is only built in when its library was found (see the Makefile).
+ *
+ * A variant carries the modification time of the file it was made from, so
+ * it is up to date exactly when both times match and is skipped otherwise.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "txt2web.h"
+
+typedef struct {
+        const char* suffix;
+        bool (*compress)(const char* data, size_t len, Buf* out);
+} CompressFormat;
+
+#ifdef HAVE_ZLIB
+static bool compress_gzip(const char* data, size_t len, Buf* out);
+#endif
+#ifdef HAVE_BROTLI
+static bool compress_brotli(const char* data, size_t len, Buf* out);
+#endif
+#ifdef HAVE_ZSTD
+static bool compress_zstd(const char* data, size_t len, Buf* out);
+#endif
+static bool compress_wanted(const char* path);
+static void compress_job(void* arg, size_t i);
+static bool compress_file(const char* path, const struct stat* st, const CompressFormat* format);
+
+static const CompressFormat formats[] = {
+#ifdef HAVE_ZLIB
+        { ".gz", compress_gzip },
+#endif
+#ifdef HAVE_BROTLI
+        { ".br", compress_brotli },
+#endif
+#ifdef HAVE_ZSTD
+        { ".zst", compress_zstd },
+#endif
+        { NULL, NULL }
+};
+
+/* every suffix that may have been written, whatever this build supports */
+static const char* all_suffixes[] = { ".gz", ".br", ".zst" };
+
+static const char* compressible[] = {
+        ".html", ".css", ".js", ".mjs", ".svg", ".txt", ".xml", ".json", ".map"
+};
+
+
+/* the compressed formats built in, e.g. ".gz .br", or "" when there are none */
+const char* compress_formats(void)
+{
+        static char names[32];
+        size_t i;
+
+        names[0] = '\0';
+        for (i = 0; formats[i].suffix; i++) {
+                if (i > 0)
+                        strcat(names, " ");
+                strcat(names, formats[i].suffix);
+        }
+        return names;
+}
+
+
+/* compresses every compressible output recorded in build->next on the pool */
+void compress_outputs(Build* build)
+{
+        const char** paths = malloc((build->next.count + 1) * sizeof(char*));
+        size_t count = 0;
+        size_t i;
+
+        if (paths == NULL) {
+                fprintf(stderr, "ERROR: Out of memory while compressing output\n");
+                return;
+        }
+
+        for (i = 0; i < build->next.count; i++) {
+                if (compress_wanted(build->next.entries[i].out))
+                        paths[count++] = build->next.entries[i].out;
+        }
+
+        pool_run(build->jobs, count, compress_job, paths);
+        free(paths);
+}
+
+
+/* removes the compressed variants of path, when path goes away or is no longer compressed */
+void compress_remove(const char* path)
+{
+        size_t i;
+
+        for (i = 0; i < sizeof(all_suffixes) / sizeof(all_suffixes[0]); i++) {
+                char* variant = str_printf("%s%s", path, all_suffixes[i]);
+                remove(variant);
+                free(variant);
+        }
+}
+
+
+static bool compress_wanted(const char* path)
+{
+        const char* dot = strrchr(path, '.');
+        size_t i;
+
+        if (dot == NULL || strchr(dot, '/'))
+                return false;
+        for (i = 0; i < sizeof(compressible) / sizeof(compressible[0]); i++) {
+                if (strcmp(dot, compressible[i]) == 0)
+                        return true;
+        }
+        return false;
+}
+
+
+/* pool callback: brings every variant of paths[i] up to date */
+static void compress_job(void* arg, size_t i)
+{
+        const char* path = ((const char**) arg)[i];
+        struct stat st;
+        size_t f;
+
+        if (stat(path, &st) != 0)
+                return;
+
+        for (f = 0; formats[f].suffix; f++) {
+                if (!compress_file(path, &st, &formats[f])) {
+                        console_lock();
+                        fprintf(stderr, "ERROR: Could not compress %s to %s\n", path, formats[f].suffix);
+                        console_unlock();
+                }
+        }
+}
+
+
+static bool compress_file(const char* path, const struct stat* st, const CompressFormat* format)
+{
+        char* variant = str_printf("%s%s", path, format->suffix);
+        struct timespec times[2];
+        struct stat variant_st;
+        MappedFile src;
+        Buf out = { 0 };
+        char* tmp;
+        FILE* f;
+        bool ok;
+
+        if (stat(variant, &variant_st) == 0
+            && variant_st.st_mtim.tv_sec == st->st_mtim.tv_sec
+            && variant_st.st_mtim.tv_nsec == st->st_mtim.tv_nsec) {
+                free(variant);
+                return true;
+        }
+
+        if (!map_file(path, &src)) {
+                free(variant);
+                return false;
+        }
+        ok = format->compress(src.data, src.len, &out);
+        unmap_file(&src);
+
+        if (ok && (f = output_open(variant, &tmp)) != NULL)
+                ok = output_commit(f, variant, tmp, buf_flush(&out, f));
+        else
+                ok = false;
+
+        if (ok) {
+                times[0] = st->st_atim;
+                times[1] = st->st_mtim;
+                ok = utimensat(AT_FDCWD, variant, times, 0) == 0;
+        }
+
+        buf_free(&out);
+        free(variant);
+        return ok;
+}
+
+
+#ifdef HAVE_ZLIB
+static bool compress_gzip(const char* data, size_t len, Buf* out)
+{
+        z_stream zs;
+        int status;
+
+        memset(&zs, 0, sizeof(zs));
+        /* 15 + 16: largest window, with a gzip header (mtime 0, so output is reproducible) */
+        if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+                return false;
+
+        buf_reserve(out, deflateBound(&zs, len));
+        zs.next_in = (Bytef*) data;
+        zs.avail_in = len;
+        zs.next_out = (Bytef*) out->data;
+        zs.avail_out = out->cap;
+        status = deflate(&zs, Z_FINISH);
+        out->len = zs.total_out;
+        deflateEnd(&zs);
+        return status == Z_STREAM_END;
+}
+#endif
+
+
+#ifdef HAVE_BROTLI
+static bool compress_brotli(const char* data, size_t len, Buf* out)
+{
+        size_t size = BrotliEncoderMaxCompressedSize(len);
+
+        if (size == 0)
+                return false;
+        buf_reserve(out, size);
+        if (!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                                   len, (const uint8_t*) data, &size, (uint8_t*) out->data))
+                return false;
+        out->len = size;
+        return true;
+}
+#endif
+
+
+#ifdef HAVE_ZSTD
+static bool compress_zstd(const char* data, size_t len, Buf* out)
+{
+        size_t size;
+
+        buf_reserve(out, ZSTD_compressBound(len));
+        size = ZSTD_compress(out->data, out->cap, data, len, 19);
+        if (ZSTD_isError(size))
+                return false;
+        out->len = size;
+        return true;
+}
+#endif
@@ -0,0 +1,246 @@
+/*
+ * File: copy.c
+ * ------------
+ * Asset copying. Files are copied with the cheapest method the filesystem
+ * supports, falling back down the chain
+ *
+ *     hardlink -> reflink (FICLONE) -> copy_file_range/sendfile -> read/write
+ *
+ * starting from the method selected with -c. Copies keep the source's mtime
+ * so unchanged files can be recognised and skipped on the next build.
+ * Stylesheets are read and written through the CSS minifier instead with -m.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/sendfile.h>
+#endif
+
+#include "txt2web.h"
+
+#define COPY_BUF_SIZE (1024 * 1024)
+
+static const char* copy_mode_names[] = { "auto", "hardlink", "reflink", "kernel", "copy" };
+
+static bool copy_hardlink(const char* src, const char* dest);
+static bool copy_reflink(int in, int out);
+static bool copy_kernel(int in, int out, off_t size);
+static bool copy_read_write(int in, int out, unsigned long* hash);
+
+
+bool parse_copy_mode(const char* name, CopyMode* mode)
+{
+        size_t i;
+
+        for (i = 0; i < sizeof(copy_mode_names) / sizeof(copy_mode_names[0]); i++) {
+                if (strcmp(name, copy_mode_names[i]) == 0) {
+                        *mode = (CopyMode) i;
+                        return true;
+                }
+        }
+        return false;
+}
+
+
+/* true when the copy is a regular file with the same size and mtime as its source */
+bool copy_up_to_date(const struct stat* src_st, const struct stat* dest_st)
+{
+        return S_ISREG(dest_st->st_mode) && dest_st->st_size == src_st->st_size
+                && dest_st->st_mtime == src_st->st_mtime;
+}
+
+
+/*
+ * Copies src to dest. *hash is set to the FNV-1a hash of the contents when
+ * the data passed through user space, and to 0 (unknown) otherwise.
+ */
+bool copy_file(const char* src, const char* dest, const struct stat* st, CopyMode mode, unsigned long* hash)
+{
+        struct timespec times[2];
+        int in;
+        int out;
+        bool ok = false;
+
+        *hash = 0;
+        stats_count(STAT_FILES_COPIED, 1);
+        stats_count(STAT_BYTES_COPIED, st->st_size);
+        if (mode == COPY_HARDLINK && copy_hardlink(src, dest))
+                return true;
+
+        if ((in = open(src, O_RDONLY)) == -1)
+                return false;
+
+        /* never write through an old hardlink into the source */
+        unlink(dest);
+        if ((out = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+                close(in);
+                return false;
+        }
+
+        if (mode == COPY_AUTO || mode == COPY_HARDLINK || mode == COPY_REFLINK)
+                ok = copy_reflink(in, out);
+        if (!ok && mode != COPY_READ)
+                ok = copy_kernel(in, out, st->st_size);
+        if (!ok) {
+                /* a failed kernel copy may have written part of the file */
+                ok = lseek(in, 0, SEEK_SET) == 0 && ftruncate(out, 0) == 0
+                        && lseek(out, 0, SEEK_SET) == 0 && copy_read_write(in, out, hash);
+        }
+
+        if (ok) {
+                times[0].tv_sec = st->st_atime;
+                times[0].tv_nsec = 0;
+                times[1].tv_sec = st->st_mtime;
+                times[1].tv_nsec = 0;
+                futimens(out, times);
+        }
+
+        close(in);
+        if (close(out) != 0)
+                ok = false;
+        return ok;
+}
+
+
+/*
+ * Copies the stylesheet src to dest minified (-m), a piece at a time, see
+ * css_minify(). *hash is the hash of src, as for copy_file(). The copy keeps
+ * the time it was written rather than src's: it is not the same file, and
+ * its compressed variants (see compress.c) have to follow it.
+ */
+bool copy_css_minified(const char* src, const char* dest, unsigned long* hash)
+{
+        char* buf = malloc(COPY_BUF_SIZE);
+        Buf min = { 0 };
+        CssMinifier m;
+        ssize_t n;
+        int in;
+        int out;
+        bool ok = true;
+
+        *hash = HASH_INIT;
+        if (buf == NULL) {
+                fprintf(stderr, "ERROR: Out of memory while copying %s\n", src);
+                abort();
+        }
+        stats_count(STAT_FILES_COPIED, 1);
+        if ((in = open(src, O_RDONLY)) == -1) {
+                free(buf);
+                return false;
+        }
+        unlink(dest);
+        if ((out = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+                close(in);
+                free(buf);
+                return false;
+        }
+
+        css_minify_init(&m);
+        while (ok && (n = read(in, buf, COPY_BUF_SIZE)) != 0) {
+                if (n < 0) {
+                        ok = errno == EINTR;
+                        continue;
+                }
+                *hash = hash_bytes(*hash, buf, n);
+                stats_count(STAT_BYTES_COPIED, n);
+                css_minify(&m, &min, buf, n);
+                ok = render_sink_fd(&out, min.data, min.len);
+                buf_clear(&min);
+        }
+        if (ok) {
+                css_minify_finish(&m, &min);
+                ok = render_sink_fd(&out, min.data, min.len);
+        }
+
+        close(in);
+        if (close(out) != 0)
+                ok = false;
+        buf_free(&min);
+        free(buf);
+        return ok;
+}
+
+
+static bool copy_hardlink(const char* src, const char* dest)
+{
+        unlink(dest);
+        return link(src, dest) == 0;
+}
+
+
+static bool copy_reflink(int in, int out)
+{
+#ifdef FICLONE
+        return ioctl(out, FICLONE, in) == 0;
+#else
+        (void) in;
+        (void) out;
+        return false;
+#endif
+}
+
+
+static bool copy_kernel(int in, int out, off_t size)
+{
+#ifdef __linux__
+        off_t left = size;
+        ssize_t n;
+
+        while (left > 0) {
+                n = copy_file_range(in, NULL, out, NULL, left, 0);
+                if (n <= 0)
+                        break;
+                left -= n;
+        }
+
+        /* copy_file_range() is not supported across all filesystems */
+        while (left > 0) {
+                n = sendfile(out, in, NULL, left);
+                if (n <= 0)
+                        return false;
+                left -= n;
+        }
+        return true;
+#else
+        (void) in;
+        (void) out;
+        (void) size;
+        return false;
+#endif
+}
+
+
+static bool copy_read_write(int in, int out, unsigned long* hash)
+{
+        char* buf = malloc(COPY_BUF_SIZE);
+        ssize_t n;
+        bool ok = buf != NULL;
+
+        *hash = HASH_INIT;
+        while (ok && (n = read(in, buf, COPY_BUF_SIZE)) != 0) {
+                ssize_t written = 0;
+
+                if (n < 0) {
+                        ok = errno == EINTR;
+                        continue;
+                }
+                *hash = hash_bytes(*hash, buf, n);
+                while (ok && written < n) {
+                        ssize_t w = write(out, buf + written, n - written);
+                        if (w < 0 && errno != EINTR)
+                                ok = false;
+                        else if (w > 0)
+                                written += w;
+                }
+        }
+
+        free(buf);
+        return ok;
+}
@@ -0,0 +1,208 @@
+/*
+ * File: date.c
+ * ------------
+ * Post dates. The `date:` line is parsed by hand instead of with strptime()
+ * and mktime(), which depend on the locale (month names) and read the time
+ * zone database on every call. Two forms are accepted:
+ *
+ *     May 11 2023                 month name (or a prefix of at least three
+ *                                 letters, any case), day, year
+ *     2023-05-11[THH:MM[:SS]]     ISO 8601, optionally with a time and a
+ *                                 zone (Z, +HH:MM or -HH:MM)
+ *
+ * The result is seconds since the epoch, counting a date or time without a
+ * zone as UTC, so the same text gives the same value on every machine and
+ * the value is the sort key of the post as it is.
+ */
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "txt2web.h"
+
+static const char* month_names[] = {
+        "january", "february", "march", "april", "may", "june",
+        "july", "august", "september", "october", "november", "december"
+};
+
+static bool parse_month_name(const char** p, int* month);
+static bool parse_iso(const char** p, int* year, int* month, int* day, long* seconds);
+static bool parse_number(const char** p, int min_digits, int max_digits, int* value);
+static int days_in_month(int year, int month);
+static long days_from_civil(long year, int month, int day);
+
+
+/*
+ * Parses date_str into *result. Returns false, with *result set to 0, when
+ * the text is not one of the forms above or names a day that does not exist.
+ */
+bool parse_date(const char* date_str, time_t* result)
+{
+        const char* p = date_str;
+        int year;
+        int month;
+        int day;
+        long seconds = 0;
+
+        *result = 0;
+        while (isspace((unsigned char) *p))
+                p++;
+
+        if (isdigit((unsigned char) *p)) {
+                if (!parse_iso(&p, &year, &month, &day, &seconds))
+                        return false;
+        }
+        else {
+                if (!parse_month_name(&p, &month))
+                        return false;
+                while (isspace((unsigned char) *p))
+                        p++;
+                if (!parse_number(&p, 1, 2, &day))
+                        return false;
+                if (*p == ',')
+                        p++;
+                while (isspace((unsigned char) *p))
+                        p++;
+                if (!parse_number(&p, 4, 4, &year))
+                        return false;
+        }
+
+        while (isspace((unsigned char) *p))
+                p++;
+        if (*p != '\0' || day < 1 || day > days_in_month(year, month))
+                return false;
+
+        *result = (time_t) (days_from_civil(year, month, day) * 86400L + seconds);
+        return true;
+}
+
+
+/* month is 1 to 12 */
+static bool parse_month_name(const char** p, int* month)
+{
+        const char* start = *p;
+        size_t len;
+        size_t i;
+        int m;
+
+        while (isalpha((unsigned char) **p))
+                (*p)++;
+        len = *p - start;
+        if (len < 3)
+                return false;
+
+        for (m = 0; m < 12; m++) {
+                if (len > strlen(month_names[m]))
+                        continue;
+                for (i = 0; i < len; i++) {
+                        if (tolower((unsigned char) start[i]) != month_names[m][i])
+                                break;
+                }
+                if (i == len) {
+                        *month = m + 1;
+                        return true;
+                }
+        }
+        return false;
+}
+
+
+/* YYYY-MM-DD, then optionally [T ]HH:MM[:SS[.fraction]] and Z or +-HH[:]MM */
+static bool parse_iso(const char** p, int* year, int* month, int* day, long* seconds)
+{
+        int hour = 0;
+        int minute = 0;
+        int second = 0;
+        int zone_hour;
+        int zone_minute = 0;
+
+        if (!parse_number(p, 4, 4, year) || *(*p)++ != '-'
+            || !parse_number(p, 2, 2, month) || *(*p)++ != '-'
+            || !parse_number(p, 2, 2, day))
+                return false;
+        if (*month < 1 || *month > 12)
+                return false;
+
+        if ((**p != 'T' && **p != 't' && **p != ' ') || !isdigit((unsigned char) (*p)[1]))
+                return true;
+        (*p)++;
+
+        if (!parse_number(p, 2, 2, &hour) || *(*p)++ != ':' || !parse_number(p, 2, 2, &minute))
+                return false;
+        if (**p == ':') {
+                (*p)++;
+                if (!parse_number(p, 2, 2, &second))
+                        return false;
+                if (**p == '.') {
+                        (*p)++;
+                        while (isdigit((unsigned char) **p))
+                                (*p)++;
+                }
+        }
+        if (hour > 23 || minute > 59 || second > 60)
+                return false;
+        *seconds = hour * 3600L + minute * 60L + second;
+
+        if (**p == 'Z' || **p == 'z') {
+                (*p)++;
+        }
+        else if (**p == '+' || **p == '-') {
+                int sign = *(*p)++ == '-' ? -1 : 1;
+
+                if (!parse_number(p, 2, 2, &zone_hour))
+                        return false;
+                if (**p == ':')
+                        (*p)++;
+                if (isdigit((unsigned char) **p) && !parse_number(p, 2, 2, &zone_minute))
+                        return false;
+                if (zone_hour > 23 || zone_minute > 59)
+                        return false;
+                /* local time minus its offset is UTC */
+                *seconds -= sign * (zone_hour * 3600L + zone_minute * 60L);
+        }
+        return true;
+}
+
+
+static bool parse_number(const char** p, int min_digits, int max_digits, int* value)
+{
+        int digits = 0;
+
+        *value = 0;
+        while (digits < max_digits && isdigit((unsigned char) **p)) {
+                *value = *value * 10 + (**p - '0');
+                (*p)++;
+                digits++;
+        }
+        return digits >= min_digits && !isdigit((unsigned char) **p);
+}
+
+
+static int days_in_month(int year, int month)
+{
+        static const int days[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+        bool leap = (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+
+        return month == 2 && leap ? 29 : days[month - 1];
+}
+
+
+/*
+ * Days between 1970-01-01 and the given date of the proleptic Gregorian
+ * calendar; the eras are 400 year cycles starting on March 1st, which puts
+ * the leap day at the end of the year.
+ */
+static long days_from_civil(long year, int month, int day)
+{
+        long era;
+        long year_of_era;
+        long day_of_year;
+        long day_of_era;
+
+        year -= month <= 2;
+        era = (year >= 0 ? year : year - 399) / 400;
+        year_of_era = year - era * 400;
+        day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+        day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+        return era * 146097 + day_of_era - 719468;
+}
@@ -0,0 +1,275 @@
+/*
+ * File: feed.c
+ * ------------
+ * feed.xml (Atom, or RSS 2.0) and sitemap.xml, written straight from the
+ * sorted post table. Entries are streamed out in OUT_FLUSH_SIZE chunks, so
+ * neither document is ever held in memory as a whole. Both need absolute
+ * URLs and are only written when a base URL is given (-u).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "txt2web.h"
+
+enum { DATE_ATOM, DATE_RSS, DATE_DAY };
+
+static void xml_escape(Buf* out, const char* str);
+static void put_url(Buf* out, const char* base, const char* path);
+static void put_date(Buf* out, time_t date, int style);
+static bool feed_commit(Build* build, const char* path, FILE* f, char* tmp, Buf* out, unsigned long hash);
+
+
+/*
+ * Writes build->dir/feed.xml with the newest build->feed_entries posts.
+ * posts must be sorted; site_title and site_description come from the index.
+ */
+bool feed_write(Build* build, const PostTable* posts, const char* site_title, const char* site_description)
+{
+        const char* base = build->base_url;
+        char* path = path_join(build->dir, "feed.xml");
+        char* tmp;
+        FILE* f = output_open(path, &tmp);
+        Buf out = { 0 };
+        unsigned long hash = HASH_INIT;
+        size_t written = 0;
+        size_t i;
+        bool ok;
+
+        if (f == NULL) {
+                fprintf(stderr, "ERROR: Could not write to file: %s\n", path);
+                free(path);
+                return false;
+        }
+
+        buf_puts(&out, "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n");
+        if (build->rss) {
+                buf_puts(&out, "<rss version=\"2.0\">\n<channel>\n  <title>");
+                xml_escape(&out, site_title);
+                buf_puts(&out, "</title>\n  <link>");
+                put_url(&out, base, "/");
+                buf_puts(&out, "</link>\n  <description>");
+                xml_escape(&out, !str_empty(site_description) ? site_description : site_title);
+                buf_puts(&out, "</description>\n");
+        }
+        else {
+                buf_puts(&out, "<feed xmlns=\"http://www.w3.org/2005/Atom\">\n  <title>");
+                xml_escape(&out, site_title);
+                buf_puts(&out, "</title>\n  <link href=\"");
+                put_url(&out, base, "/");
+                buf_puts(&out, "\"/>\n  <link rel=\"self\" href=\"");
+                put_url(&out, base, "/feed.xml");
+                buf_puts(&out, "\"/>\n  <id>");
+                put_url(&out, base, "/");
+                buf_puts(&out, "</id>\n  <updated>");
+                put_date(&out, posts->count ? post_table_get(posts, 0)->date : 0, DATE_ATOM);
+                buf_puts(&out, "</updated>\n");
+        }
+
+        for (i = 0; i < posts->count && written < build->feed_entries; i++) {
+                Post* post = post_table_get(posts, i);
+                char* link;
+
+                /* without a date the entry could not be ordered by readers */
+                if (str_empty(post->date_str))
+                        continue;
+
+                link = str_printf("/posts/%s.html", post->filename);
+                if (build->rss) {
+                        buf_puts(&out, "  <item>\n    <title>");
+                        xml_escape(&out, post->title);
+                        buf_puts(&out, "</title>\n    <link>");
+                        put_url(&out, base, link);
+                        buf_puts(&out, "</link>\n    <guid>");
+                        put_url(&out, base, link);
+                        buf_puts(&out, "</guid>\n    <pubDate>");
+                        put_date(&out, post->date, DATE_RSS);
+                        buf_puts(&out, "</pubDate>\n");
+                        if (!str_empty(post->description)) {
+                                buf_puts(&out, "    <description>");
+                                xml_escape(&out, post->description);
+                                buf_puts(&out, "</description>\n");
+                        }
+                        buf_puts(&out, "  </item>\n");
+                }
+                else {
+                        buf_puts(&out, "  <entry>\n    <title>");
+                        xml_escape(&out, post->title);
+                        buf_puts(&out, "</title>\n    <link href=\"");
+                        put_url(&out, base, link);
+                        buf_puts(&out, "\"/>\n    <id>");
+                        put_url(&out, base, link);
+                        buf_puts(&out, "</id>\n    <updated>");
+                        put_date(&out, post->date, DATE_ATOM);
+                        buf_puts(&out, "</updated>\n");
+                        if (!str_empty(post->description)) {
+                                buf_puts(&out, "    <summary>");
+                                xml_escape(&out, post->description);
+                                buf_puts(&out, "</summary>\n");
+                        }
+                        buf_puts(&out, "  </entry>\n");
+                }
+                free(link);
+                written++;
+
+                if (out.len >= OUT_FLUSH_SIZE) {
+                        hash = hash_bytes(hash, out.data, out.len);
+                        buf_flush(&out, f);
+                }
+        }
+
+        buf_puts(&out, build->rss ? "</channel>\n</rss>\n" : "</feed>\n");
+        ok = feed_commit(build, path, f, tmp, &out, hash);
+        free(path);
+        return ok;
+}
+
+
+/*
+ * Writes build->dir/sitemap.xml: the index, every post and every page
+ * generated so far in this build (list and archive pages).
+ */
+bool sitemap_write(Build* build, const PostTable* posts)
+{
+        const char* base = build->base_url;
+        char* path = path_join(build->dir, "sitemap.xml");
+        char* tmp;
+        FILE* f = output_open(path, &tmp);
+        Buf out = { 0 };
+        unsigned long hash = HASH_INIT;
+        size_t dir_len = strlen(build->dir);
+        size_t i;
+        bool ok;
+
+        if (f == NULL) {
+                fprintf(stderr, "ERROR: Could not write to file: %s\n", path);
+                free(path);
+                return false;
+        }
+
+        buf_puts(&out, "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n");
+        buf_puts(&out, "<urlset xmlns=\"http://www.sitemaps.org/schemas/sitemap/0.9\">\n");
+        buf_puts(&out, "  <url><loc>");
+        put_url(&out, base, "/");
+        buf_puts(&out, "</loc></url>\n");
+
+        for (i = 0; i < posts->count; i++) {
+                Post* post = post_table_get(posts, i);
+                char* link = str_printf("/posts/%s.html", post->filename);
+
+                buf_puts(&out, "  <url><loc>");
+                put_url(&out, base, link);
+                buf_puts(&out, "</loc>");
+                if (!str_empty(post->date_str)) {
+                        buf_puts(&out, "<lastmod>");
+                        put_date(&out, post->date, DATE_DAY);
+                        buf_puts(&out, "</lastmod>");
+                }
+                buf_puts(&out, "</url>\n");
+                free(link);
+
+                if (out.len >= OUT_FLUSH_SIZE) {
+                        hash = hash_bytes(hash, out.data, out.len);
+                        buf_flush(&out, f);
+                }
+        }
+
+        for (i = 0; i < build->next.count; i++) {
+                ManifestEntry* e = &build->next.entries[i];
+                size_t len = strlen(e->out);
+
+                if (e->kind != 'G' || len < 5 || strcmp(e->out + len - 5, ".html") != 0)
+                        continue;
+                buf_puts(&out, "  <url><loc>");
+                put_url(&out, base, e->out + dir_len);
+                buf_puts(&out, "</loc></url>\n");
+
+                if (out.len >= OUT_FLUSH_SIZE) {
+                        hash = hash_bytes(hash, out.data, out.len);
+                        buf_flush(&out, f);
+                }
+        }
+
+        buf_puts(&out, "</urlset>\n");
+        ok = feed_commit(build, path, f, tmp, &out, hash);
+        free(path);
+        return ok;
+}
+
+
+/* writes what is left of out, moves the file into place and records it */
+static bool feed_commit(Build* build, const char* path, FILE* f, char* tmp, Buf* out, unsigned long hash)
+{
+        struct stat none = { 0 };
+        bool ok;
+
+        hash = hash_bytes(hash, out->data, out->len);
+        ok = output_commit(f, path, tmp, buf_flush(out, f));
+        buf_free(out);
+
+        if (ok)
+                manifest_add(&build->next, 'G', path, path, &none, hash);
+        else
+                fprintf(stderr, "ERROR: Could not write to file: %s\n", path);
+        return ok;
+}
+
+
+static void xml_escape(Buf* out, const char* str)
+{
+        const char* run = str;
+        const char* p;
+
+        if (str == NULL)
+                return;
+
+        for (p = str; *p; p++) {
+                const char* entity;
+
+                switch (*p) {
+                case '&': entity = "&amp;"; break;
+                case '<': entity = "&lt;"; break;
+                case '>': entity = "&gt;"; break;
+                case '"': entity = "&quot;"; break;
+                case '\'': entity = "&apos;"; break;
+                default: continue;
+                }
+                buf_append(out, run, p - run);
+                buf_puts(out, entity);
+                run = p + 1;
+        }
+        buf_append(out, run, p - run);
+}
+
+
+/* base has no trailing slash (see main), path starts with one */
+static void put_url(Buf* out, const char* base, const char* path)
+{
+        xml_escape(out, base);
+        xml_escape(out, path);
+}
+
+
+/* post dates are UTC (see date.c), a date without a time is midnight */
+static void put_date(Buf* out, time_t date, int style)
+{
+        struct tm tm_date;
+        char text[64];
+
+        if (gmtime_r(&date, &tm_date) == NULL)
+                memset(&tm_date, 0, sizeof(tm_date));
+
+        switch (style) {
+        case DATE_RSS:
+                strftime(text, sizeof(text), "%a, %d %b %Y %H:%M:%S +0000", &tm_date);
+                break;
+        case DATE_DAY:
+                strftime(text, sizeof(text), "%Y-%m-%d", &tm_date);
+                break;
+        default:
+                strftime(text, sizeof(text), "%Y-%m-%dT%H:%M:%SZ", &tm_date);
+                break;
+        }
+        buf_puts(out, text);
+}
@@ -0,0 +1,262 @@
+/*
+ * File: fingerprint.c
+ * -------------------
+ * Fingerprinted asset names (-f). Every stylesheet, script, image and font
+ * copy_dir() copies also gets a second name with the hash of its contents
+ * in it, style.css -> style.1f2e3d4c.css, and pages link to that name
+ * instead. A file under such a name never changes, so it can be served as
+ * immutable and cached forever; a changed file gets a new name, and the
+ * pages are written again to point at it.
+ *
+ * The hash is the one copying computes anyway, so no file is read twice,
+ * and the second name is a hard link to the copy. The map from site URL
+ * to fingerprinted URL is filled while copying; the renderer looks up the
+ * src of images and the href of stylesheets in it (buf_put_asset_url()),
+ * and layout_relink() rewrites the links of the layout once per build.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "txt2web.h"
+
+typedef struct {
+        const char* url;        /* "/images/pic.png" */
+        const char* target;     /* "/images/pic.0a1b2c3d.png" */
+} AssetLink;
+
+static int compare_links(const void* a, const void* b);
+static const char* attribute_value(const char* p, size_t* len);
+
+static bool fingerprint_on = false;
+
+/* the map of the current build, sorted by url once copying is done */
+static bool link_strings_ready = false;
+static Arena link_strings;
+static AssetLink* links;
+static size_t link_count;
+static size_t link_cap;
+static unsigned long link_hash;
+
+static const char* fingerprinted[] = {
+        ".css", ".js", ".mjs", ".png", ".jpg", ".jpeg", ".gif", ".webp", ".avif", ".svg", ".ico",
+        ".woff", ".woff2", ".ttf", ".otf"
+};
+
+
+/* copy assets under fingerprinted names as well and link pages to those */
+void fingerprint_enable(void)
+{
+        fingerprint_on = true;
+}
+
+
+bool fingerprint_enabled(void)
+{
+        return fingerprint_on;
+}
+
+
+/* true for the files that get a fingerprinted name */
+bool fingerprint_wanted(const char* path)
+{
+        const char* ext = strrchr(path, '.');
+        size_t i;
+
+        if (!fingerprint_on || ext == NULL || strchr(ext, '/') != NULL)
+                return false;
+        for (i = 0; i < sizeof(fingerprinted) / sizeof(fingerprinted[0]); i++) {
+                if (strcasecmp(ext, fingerprinted[i]) == 0)
+                        return true;
+        }
+        return false;
+}
+
+
+/* path with the hash in front of its extension; must be freed */
+char* fingerprint_path(const char* path, unsigned long hash)
+{
+        const char* ext = strrchr(path, '.');
+
+        return str_printf("%.*s.%08lx%s", (int) (ext - path), path, hash & 0xffffffffUL, ext);
+}
+
+
+/*
+ * Pool side of copying an asset: gives job->dest its fingerprinted name
+ * (job->fingerprint_dest, to be freed) unless that exists already. The
+ * hash of the source is computed here if copying did not.
+ */
+void fingerprint_copy(CopyJob* job)
+{
+        char* fp;
+        struct stat st;
+        unsigned long hash;
+
+        if (job->hash == 0 && !hash_file(job->src, &job->hash))
+                return;
+
+        /* the minified copy of a stylesheet is not the same file */
+        hash = job->minify ? hash_str(job->hash, "minify") : job->hash;
+        fp = fingerprint_path(job->dest, hash);
+        if (access(fp, F_OK) != 0 && link(job->dest, fp) != 0
+            && (stat(job->dest, &st) != 0 || !copy_file(job->dest, fp, &st, COPY_AUTO, &hash))) {
+                console_lock();
+                fprintf(stderr, "ERROR: Could not copy %s to %s\n", job->dest, fp);
+                console_unlock();
+                free(fp);
+                return;
+        }
+        job->fingerprint_dest = fp;
+}
+
+
+/* empties the map for the next build */
+void fingerprint_reset(void)
+{
+        if (link_strings_ready)
+                arena_free(&link_strings);
+        arena_init(&link_strings);
+        link_strings_ready = true;
+        free(links);
+        links = NULL;
+        link_count = 0;
+        link_cap = 0;
+        link_hash = 0;
+}
+
+
+/* pages will link to target for url; both are site URLs, "/images/pic.png" */
+void fingerprint_add(const char* url, const char* target)
+{
+        if (link_count == link_cap) {
+                link_cap = link_cap ? link_cap * 2 : 64;
+                links = realloc(links, link_cap * sizeof(AssetLink));
+                if (links == NULL) {
+                        fprintf(stderr, "ERROR: Out of memory while fingerprinting assets\n");
+                        abort();
+                }
+        }
+        links[link_count].url = arena_strdup(&link_strings, url);
+        links[link_count].target = arena_strdup(&link_strings, target);
+        link_count++;
+}
+
+
+/*
+ * Makes the map ready for lookups once copying is done. Returns its hash,
+ * which changes whenever an asset does: every page has to be written again
+ * then. 0 when there is nothing fingerprinted.
+ */
+unsigned long fingerprint_finish(void)
+{
+        size_t i;
+
+        if (link_count)
+                qsort(links, link_count, sizeof(AssetLink), compare_links);
+        link_hash = 0;
+        for (i = 0; i < link_count; i++) {
+                link_hash = hash_str(i ? link_hash : HASH_INIT, links[i].url);
+                link_hash = hash_str(link_hash, links[i].target);
+        }
+        return link_hash;
+}
+
+
+/* the hash fingerprint_finish() returned */
+unsigned long fingerprint_hash(void)
+{
+        return link_hash;
+}
+
+
+/*
+ * The fingerprinted URL for [url, url + len), or NULL when there is none.
+ * A relative url is taken to be relative to the directory dir ("/posts/").
+ */
+const char* fingerprint_lookup(const char* dir, const char* url, size_t len)
+{
+        char key[SITE_URL_MAX];
+        AssetLink probe;
+        AssetLink* found;
+
+        if (link_count == 0 || !site_url(key, sizeof(key), dir, url, len))
+                return NULL;
+        probe.url = key;
+        found = bsearch(&probe, links, link_count, sizeof(AssetLink), compare_links);
+        return found ? found->target : NULL;
+}
+
+
+/* appends the URL pages should link to for the asset at url, see fingerprint_lookup() */
+void buf_put_asset_url(Buf* out, const char* dir, const char* url, size_t len)
+{
+        const char* target = fingerprint_on ? fingerprint_lookup(dir, url, len) : NULL;
+
+        if (target)
+                buf_puts(out, target);
+        else
+                buf_append(out, url, len);
+}
+
+
+/*
+ * Appends html with the href and src attributes that name fingerprinted
+ * assets pointed at their new names. Returns false when there were none, and
+ * html can be used as it is.
+ */
+bool fingerprint_html(Buf* out, const char* html)
+{
+        const char* p = html;
+        const char* value;
+        bool changed = false;
+        size_t len;
+
+        while ((value = attribute_value(p, &len)) != NULL) {
+                const char* target = fingerprint_lookup("/", value, len);
+
+                if (target) {
+                        buf_append(out, p, value - p);
+                        buf_puts(out, target);
+                        changed = true;
+                }
+                else {
+                        buf_append(out, p, value + len - p);
+                }
+                p = value + len;
+        }
+        buf_puts(out, p);
+        return changed;
+}
+
+
+/* the next quoted href or src value from p on, with its length in *len */
+static const char* attribute_value(const char* p, size_t* len)
+{
+        for (; *p; p++) {
+                const char* value;
+                const char* end;
+
+                if (strncasecmp(p, "href=", 5) == 0)
+                        value = p + 5;
+                else if (strncasecmp(p, "src=", 4) == 0)
+                        value = p + 4;
+                else
+                        continue;
+
+                if ((*value != '\'' && *value != '"') || (end = strchr(value + 1, *value)) == NULL)
+                        continue;
+                *len = end - (value + 1);
+                return value + 1;
+        }
+        return NULL;
+}
+
+
+static int compare_links(const void* a, const void* b)
+{
+        return strcmp(((const AssetLink*) a)->url, ((const AssetLink*) b)->url);
+}
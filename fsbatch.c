@@ -0,0 +1,391 @@
+/*
+ * File: fsbatch.c
+ * ---------------
+ * Batched filesystem operations for the clean and copy phases. Instead of
+ * one blocking syscall at a time, callers collect a whole array of FsOps
+ * (statx, unlink, rmdir, mkdir) and hand it to fs_batch_run(), which keeps
+ * up to `depth` of them in flight. With io_uring the operations are queued
+ * in the kernel's submission ring; where io_uring is unavailable (old
+ * kernels, seccomp filters, non-Linux) a worker pool issues them instead.
+ *
+ * fs_scan() walks a directory tree using the d_type readdir() already
+ * returns, so listing a tree needs no stat call per entry.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include "txt2web.h"
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING 1
+#else
+#define HAVE_IO_URING 0
+#endif
+
+static void fs_op_sync(void* arg, size_t i);
+static bool fs_scan_dir(Arena* strings, const char* dir, int depth, bool follow_links, FsFilter filter,
+                        void* ctx, FsEntry** entries, size_t* count, size_t* cap);
+#if HAVE_IO_URING
+static bool uring_init(FsBatch* b, unsigned depth);
+static void uring_run(FsBatch* b, FsOp* ops, size_t count);
+static unsigned uring_reap(FsBatch* b, FsOp* ops);
+static void uring_prep(struct io_uring_sqe* sqe, FsOp* op, size_t i);
+#endif
+
+
+bool fs_batch_init(FsBatch* b, unsigned depth, int jobs)
+{
+        memset(b, 0, sizeof(*b));
+        b->ring_fd = -1;
+        b->depth = depth ? depth : 1;
+        b->jobs = jobs;
+
+#if HAVE_IO_URING
+        if (uring_init(b, b->depth))
+                return true;
+#endif
+        return false;
+}
+
+
+/* runs every op in ops; the order in which they complete is unspecified */
+void fs_batch_run(FsBatch* b, FsOp* ops, size_t count)
+{
+        if (count == 0)
+                return;
+#if HAVE_IO_URING
+        if (b->ring_fd >= 0) {
+                uring_run(b, ops, count);
+                return;
+        }
+#endif
+        pool_run(b->jobs, count, fs_op_sync, ops);
+}
+
+
+void fs_batch_free(FsBatch* b)
+{
+#if HAVE_IO_URING
+        if (b->ring_fd >= 0) {
+                munmap(b->sqes, b->sqes_size);
+                if (b->cq_ring != b->sq_ring)
+                        munmap(b->cq_ring, b->cq_ring_size);
+                munmap(b->sq_ring, b->sq_ring_size);
+                close(b->ring_fd);
+        }
+#endif
+        b->ring_fd = -1;
+}
+
+
+/*
+ * Lists everything below root (not root itself) in pre-order: a directory
+ * always comes before its contents. Entries for which filter returns false
+ * are left out together with their children. When follow_links is set,
+ * symlinks are classified by what they point to, like stat() does, and links
+ * to anything but files and directories are skipped; otherwise a link is
+ * listed as a file and never descended into.
+ */
+bool fs_scan(Arena* strings, const char* root, bool follow_links, FsFilter filter, void* ctx,
+             FsEntry** entries, size_t* count)
+{
+        size_t cap = 0;
+
+        *entries = NULL;
+        *count = 0;
+        return fs_scan_dir(strings, root, 0, follow_links, filter, ctx, entries, count, &cap);
+}
+
+
+void statx_to_stat(const struct statx* stx, struct stat* st)
+{
+        memset(st, 0, sizeof(*st));
+        st->st_mode = stx->stx_mode;
+        st->st_size = stx->stx_size;
+        st->st_atime = stx->stx_atime.tv_sec;
+        st->st_mtime = stx->stx_mtime.tv_sec;
+}
+
+
+static bool fs_scan_dir(Arena* strings, const char* dir, int depth, bool follow_links, FsFilter filter,
+                        void* ctx, FsEntry** entries, size_t* count, size_t* cap)
+{
+        DIR* d = opendir(dir);
+        struct dirent* ent;
+
+        if (d == NULL)
+                return false;
+
+        while ((ent = readdir(d)) != NULL) {
+                FsEntry* e;
+                char* path;
+                bool is_dir;
+                struct stat st;
+
+                if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+                        continue;
+                path = str_printf("%s/%s", dir, ent->d_name);
+                if (ent->d_type == DT_DIR || ent->d_type == DT_REG) {
+                        is_dir = ent->d_type == DT_DIR;
+                }
+                else if (ent->d_type == DT_LNK && follow_links) {
+                        if (stat(path, &st) == -1 || !(S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))) {
+                                free(path);
+                                continue;
+                        }
+                        is_dir = S_ISDIR(st.st_mode);
+                }
+                else if (ent->d_type == DT_UNKNOWN && lstat(path, &st) == 0) {
+                        is_dir = S_ISDIR(st.st_mode);
+                }
+                else {
+                        is_dir = false;
+                }
+                if (filter && !filter(path, ent->d_name, is_dir, ctx)) {
+                        free(path);
+                        continue;
+                }
+
+                if (*count == *cap) {
+                        *cap = *cap ? *cap * 2 : 256;
+                        *entries = realloc(*entries, *cap * sizeof(FsEntry));
+                        if (*entries == NULL) {
+                                fprintf(stderr, "ERROR: Out of memory while scanning %s\n", dir);
+                                abort();
+                        }
+                }
+                e = &(*entries)[(*count)++];
+                e->path = arena_strdup(strings, path);
+                e->name = e->path + strlen(dir) + 1;
+                e->depth = depth;
+                e->is_dir = is_dir;
+                free(path);
+
+                if (is_dir)
+                        fs_scan_dir(strings, e->path, depth + 1, follow_links, filter, ctx, entries, count, cap);
+        }
+
+        closedir(d);
+        return true;
+}
+
+
+/* pool callback used when io_uring is not available */
+static void fs_op_sync(void* arg, size_t i)
+{
+        FsOp* op = (FsOp*) arg + i;
+        int r = -1;
+
+        switch (op->kind) {
+        case FS_STATX:
+                r = statx(AT_FDCWD, op->path, 0, STATX_BASIC_STATS, op->stx);
+                break;
+        case FS_UNLINK:
+                r = unlink(op->path);
+                break;
+        case FS_RMDIR:
+                r = rmdir(op->path);
+                break;
+        case FS_MKDIR:
+                r = mkdir(op->path, 0755);
+                break;
+        }
+        op->result = r == 0 ? 0 : -errno;
+}
+
+
+#if HAVE_IO_URING
+static bool uring_init(FsBatch* b, unsigned depth)
+{
+        struct io_uring_params p;
+        int fd;
+
+        memset(&p, 0, sizeof(p));
+        fd = (int) syscall(__NR_io_uring_setup, depth, &p);
+        if (fd < 0)
+                return false;
+
+        b->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        b->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                if (b->cq_ring_size > b->sq_ring_size)
+                        b->sq_ring_size = b->cq_ring_size;
+                b->cq_ring_size = b->sq_ring_size;
+        }
+
+        b->sq_ring = mmap(NULL, b->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          fd, IORING_OFF_SQ_RING);
+        if (b->sq_ring == MAP_FAILED) {
+                close(fd);
+                return false;
+        }
+
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                b->cq_ring = b->sq_ring;
+        }
+        else {
+                b->cq_ring = mmap(NULL, b->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                  fd, IORING_OFF_CQ_RING);
+                if (b->cq_ring == MAP_FAILED) {
+                        munmap(b->sq_ring, b->sq_ring_size);
+                        close(fd);
+                        return false;
+                }
+        }
+
+        b->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+        b->sqes = mmap(NULL, b->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       fd, IORING_OFF_SQES);
+        if (b->sqes == MAP_FAILED) {
+                if (b->cq_ring != b->sq_ring)
+                        munmap(b->cq_ring, b->cq_ring_size);
+                munmap(b->sq_ring, b->sq_ring_size);
+                close(fd);
+                return false;
+        }
+
+        b->sq_head = (unsigned*) ((char*) b->sq_ring + p.sq_off.head);
+        b->sq_tail = (unsigned*) ((char*) b->sq_ring + p.sq_off.tail);
+        b->sq_mask = *(unsigned*) ((char*) b->sq_ring + p.sq_off.ring_mask);
+        b->sq_array = (unsigned*) ((char*) b->sq_ring + p.sq_off.array);
+        b->cq_head = (unsigned*) ((char*) b->cq_ring + p.cq_off.head);
+        b->cq_tail = (unsigned*) ((char*) b->cq_ring + p.cq_off.tail);
+        b->cq_mask = *(unsigned*) ((char*) b->cq_ring + p.cq_off.ring_mask);
+        b->cqes = (char*) b->cq_ring + p.cq_off.cqes;
+
+        b->depth = p.sq_entries < depth ? p.sq_entries : depth;
+        b->ring_fd = fd;
+        return true;
+}
+
+
+static void uring_run(FsBatch* b, FsOp* ops, size_t count)
+{
+        struct io_uring_sqe* sqes = b->sqes;
+        size_t submitted = 0;
+        size_t completed = 0;
+        unsigned in_flight = 0;
+        unsigned to_submit = 0;         /* queued in the ring, not yet taken by the kernel */
+        size_t i;
+
+        for (i = 0; i < count; i++)
+                ops[i].result = FS_PENDING;
+
+        while (completed < count) {
+                unsigned tail = *b->sq_tail;
+                unsigned reaped;
+                long r;
+
+                /* fill the submission ring up to the queue depth */
+                while (submitted < count && in_flight < b->depth) {
+                        unsigned index = tail & b->sq_mask;
+
+                        uring_prep(&sqes[index], &ops[submitted], submitted);
+                        b->sq_array[index] = index;
+                        tail++;
+                        to_submit++;
+                        in_flight++;
+                        submitted++;
+                }
+                __atomic_store_n(b->sq_tail, tail, __ATOMIC_RELEASE);
+
+                r = syscall(__NR_io_uring_enter, b->ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+                if (r >= 0) {
+                        to_submit -= (unsigned) r;
+                }
+                else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                        /*
+                         * Ring unusable: take back the entries the kernel has not
+                         * read and wait for the ones it has, so that no op runs
+                         * twice. The rest is done synchronously.
+                         */
+                        __atomic_store_n(b->sq_tail, tail - to_submit, __ATOMIC_RELEASE);
+                        submitted -= to_submit;
+                        in_flight -= to_submit;
+                        while (in_flight > 0) {
+                                unsigned n = uring_reap(b, ops);
+
+                                in_flight -= n;
+                                if (n == 0 && syscall(__NR_io_uring_enter, b->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0
+                                    && errno != EINTR)
+                                        break;
+                        }
+                        for (i = 0; i < count; i++) {
+                                if (ops[i].result != FS_PENDING)
+                                        continue;
+                                if (i < submitted)
+                                        ops[i].result = -EIO;   /* lost in the ring */
+                                else
+                                        fs_op_sync(ops, i);
+                        }
+                        return;
+                }
+
+                reaped = uring_reap(b, ops);
+                in_flight -= reaped;
+                completed += reaped;
+        }
+}
+
+
+/* records the results of the completed ops; returns how many there were */
+static unsigned uring_reap(FsBatch* b, FsOp* ops)
+{
+        struct io_uring_cqe* cqes = b->cqes;
+        unsigned head = *b->cq_head;
+        unsigned n = 0;
+
+        while (head != __atomic_load_n(b->cq_tail, __ATOMIC_ACQUIRE)) {
+                struct io_uring_cqe* cqe = &cqes[head & b->cq_mask];
+
+                /* kernels without this opcode: do it the slow way */
+                if (cqe->res == -EINVAL)
+                        fs_op_sync(ops, cqe->user_data);
+                else
+                        ops[cqe->user_data].result = cqe->res;
+                head++;
+                n++;
+        }
+        __atomic_store_n(b->cq_head, head, __ATOMIC_RELEASE);
+        return n;
+}
+
+
+static void uring_prep(struct io_uring_sqe* sqe, FsOp* op, size_t i)
+{
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (unsigned long) op->path;
+        sqe->user_data = i;
+
+        switch (op->kind) {
+        case FS_STATX:
+                sqe->opcode = IORING_OP_STATX;
+                sqe->len = STATX_BASIC_STATS;
+                sqe->off = (unsigned long) op->stx;
+                break;
+        case FS_UNLINK:
+                sqe->opcode = IORING_OP_UNLINKAT;
+                break;
+        case FS_RMDIR:
+                sqe->opcode = IORING_OP_UNLINKAT;
+                sqe->unlink_flags = AT_REMOVEDIR;
+                break;
+        case FS_MKDIR:
+                sqe->opcode = IORING_OP_MKDIRAT;
+                sqe->len = 0755;
+                break;
+        }
+}
+#endif
@@ -0,0 +1,881 @@
+/*
+ * File: image.c
+ * -------------
+ * Image sizes (-l). While copy_dir() copies the assets, the workers read
+ * the size of every PNG, JPEG, GIF and WebP image from its header, and the
+ * images of @ lines are then written with width and height, so browsers
+ * can lay the page out before the images arrive, and with loading='lazy'
+ * (all but the first one on a page, which is usually in view when the page
+ * opens) and decoding='async'. Sizes are kept by path, mtime and file size
+ * for as long as the process runs, so an image is read at most once per
+ * build, and not at all again in watch mode or with -b while it is
+ * unchanged.
+ *
+ * --srcset=480,960 also writes copies of every PNG and JPEG image scaled
+ * down to those widths (pic-480w.png next to pic.png, for each width below
+ * the image's own) on the same workers, and lists them in a srcset. That
+ * takes libpng and libjpeg (see the Makefile); an image is only decoded
+ * when it changed or one of its copies is missing.
+ */
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+
+#ifdef HAVE_PNG
+#include <png.h>
+#endif
+#ifdef HAVE_JPEG
+#include <jpeglib.h>
+#endif
+
+#include "txt2web.h"
+
+#define IMAGE_MAX_PIXELS (64UL * 1024 * 1024)  /* larger images are measured, not scaled */
+#define JPEG_QUALITY 85
+#define JPEG_MAX_SEGMENTS 256
+
+typedef enum {
+        IMAGE_PNG,
+        IMAGE_JPEG,
+        IMAGE_GIF,
+        IMAGE_WEBP
+} ImageFormat;
+
+typedef struct {
+        ImageFormat format;
+        int width;              /* as displayed; 0 when the header could not be read */
+        int height;
+        bool upright;           /* no EXIF orientation: the pixels are stored as displayed */
+} ImageSize;
+
+/* an entry of the size cache; path is NULL in empty slots */
+typedef struct {
+        char* path;
+        long mtime;
+        long size;
+        ImageSize image;
+} ProbeEntry;
+
+/* what the pages of this build write on an image */
+typedef struct {
+        const char* url;        /* "/images/pic.png" */
+        int width;
+        int height;
+        const char* srcset;     /* NULL without scaled copies */
+} ImageInfo;
+
+typedef struct {
+        unsigned char* data;
+        int width;
+        int height;
+        int channels;           /* 3 (RGB) or 4 (RGBA) */
+} Pixels;
+
+#ifdef HAVE_JPEG
+typedef struct {
+        struct jpeg_error_mgr mgr;
+        jmp_buf jump;
+} JpegError;
+#endif
+
+static bool image_size(const char* path, const struct stat* st, ImageSize* size);
+static ProbeEntry* probe_slot(ProbeEntry* table, size_t cap, const char* path);
+static bool image_probe(const char* path, ImageSize* size);
+static bool probe_jpeg(int fd, ImageSize* size);
+static int exif_orientation(const unsigned char* data, size_t len);
+static bool image_decode(const char* path, const ImageSize* size, int need, Pixels* p);
+static bool image_encode(FILE* f, ImageFormat format, const Pixels* p);
+static bool write_variant(const Pixels* src, ImageFormat format, const char* path, int width);
+static void downscale(const Pixels* src, int width, int height, Pixels* dst);
+static int compare_infos(const void* a, const void* b);
+#ifdef HAVE_PNG
+static bool png_decode(const char* path, Pixels* p);
+static bool png_encode(FILE* f, const Pixels* p);
+#endif
+#ifdef HAVE_JPEG
+static bool jpeg_decode(const char* path, int need, Pixels* p);
+static void jpeg_decode_rows(struct jpeg_decompress_struct* cinfo, FILE* f, int need, Pixels* p);
+static bool jpeg_encode(FILE* f, const Pixels* p);
+static void jpeg_encode_rows(struct jpeg_compress_struct* cinfo, FILE* f, const Pixels* p);
+static void jpeg_fail(j_common_ptr cinfo);
+static void jpeg_quiet(j_common_ptr cinfo);
+#endif
+
+static bool image_on = false;
+static int widths[IMAGE_MAX_WIDTHS];    /* --srcset, ascending */
+static int width_count = 0;
+
+/* sizes read so far, by path; shared by the copy workers */
+static pthread_mutex_t probe_lock = PTHREAD_MUTEX_INITIALIZER;
+static ProbeEntry* probes;
+static size_t probe_cap;                /* a power of two */
+static size_t probe_count;
+
+/* the images of the current build, sorted by url once copying is done */
+static bool info_strings_ready = false;
+static Arena info_strings;
+static ImageInfo* infos;
+static size_t info_count;
+static size_t info_cap;
+static unsigned long info_hash;
+
+static const char* image_extensions[] = { ".png", ".jpg", ".jpeg", ".gif", ".webp" };
+
+
+/* measure images and write their size, lazy loading and async decoding on <img> */
+void image_enable(void)
+{
+        image_on = true;
+}
+
+
+bool image_enabled(void)
+{
+        return image_on;
+}
+
+
+/* sets the widths of --srcset from a list like "480,960"; false if it is not one */
+bool image_set_widths(const char* list)
+{
+        const char* p = list;
+
+        width_count = 0;
+        while (*p) {
+                char* end;
+                long width = strtol(p, &end, 10);
+                int i;
+
+                if (end == p || width < 16 || width > 16384 || width_count == IMAGE_MAX_WIDTHS
+                    || (*end != ',' && *end != '\0'))
+                        return false;
+                for (i = width_count; i > 0 && widths[i - 1] > width; i--)
+                        widths[i] = widths[i - 1];
+                if (i > 0 && widths[i - 1] == width)
+                        return false;
+                widths[i] = (int) width;
+                width_count++;
+                p = *end ? end + 1 : end;
+        }
+        return width_count > 0;
+}
+
+
+/* true for the files measured with -l */
+bool image_wanted(const char* path)
+{
+        const char* ext = strrchr(path, '.');
+        size_t i;
+
+        if (!image_on || ext == NULL || strchr(ext, '/') != NULL)
+                return false;
+        for (i = 0; i < sizeof(image_extensions) / sizeof(image_extensions[0]); i++) {
+                if (strcasecmp(ext, image_extensions[i]) == 0)
+                        return true;
+        }
+        return false;
+}
+
+
+/* path of the copy of the image at path scaled to width; must be freed */
+char* image_variant_path(const char* path, int width)
+{
+        const char* ext = strrchr(path, '.');
+
+        return str_printf("%.*s-%dw%s", (int) (ext - path), path, width, ext);
+}
+
+
+/* the scaled copy i of job's image (next to its fingerprinted name, if any), or NULL; must be freed */
+char* image_variant(const CopyJob* job, int i)
+{
+        if (i >= width_count || !(job->variants & (1U << i)))
+                return NULL;
+        return image_variant_path(job->fingerprint_dest ? job->fingerprint_dest : job->dest, widths[i]);
+}
+
+
+/*
+ * Pool side of copying an image: sets job->width and job->height, and
+ * writes the scaled copies of --srcset that are missing or out of date.
+ */
+void image_copy(CopyJob* job)
+{
+        const char* base = job->fingerprint_dest ? job->fingerprint_dest : job->dest;
+        ImageSize size;
+        Pixels pixels = { 0 };
+        int need = 0;
+        int i;
+
+        if (!image_size(job->src, &job->st, &size))
+                return;
+        job->width = size.width;
+        job->height = size.height;
+
+        /* a copy loses the EXIF orientation, so rotated images are not scaled */
+        if (!size.upright)
+                return;
+        for (i = 0; i < width_count && widths[i] < size.width; i++)
+                need = widths[i];
+
+        for (i = 0; i < width_count && widths[i] < size.width; i++) {
+                char* path = image_variant_path(base, widths[i]);
+                bool ok = !job->copy && access(path, F_OK) == 0;
+
+                if (!ok && pixels.data == NULL && !image_decode(job->src, &size, need, &pixels)) {
+                        free(path);
+                        break;
+                }
+                if (!ok && !write_variant(&pixels, size.format, path, widths[i])) {
+                        console_lock();
+                        fprintf(stderr, "ERROR: Could not write %s\n", path);
+                        console_unlock();
+                }
+                else {
+                        job->variants |= 1U << i;
+                }
+                free(path);
+        }
+        free(pixels.data);
+}
+
+
+/* empties the list of images for the next build */
+void image_reset(void)
+{
+        if (info_strings_ready)
+                arena_free(&info_strings);
+        arena_init(&info_strings);
+        info_strings_ready = true;
+        free(infos);
+        infos = NULL;
+        info_count = 0;
+        info_cap = 0;
+        info_hash = 0;
+}
+
+
+/* adds the image copied by job; the part of job->dest after root_len is its URL */
+void image_add(const CopyJob* job, size_t root_len)
+{
+        const char* url = job->dest + root_len;
+        const char* target = job->fingerprint_dest ? job->fingerprint_dest + root_len : url;
+        Buf srcset = { 0 };
+        int i;
+
+        for (i = 0; i < width_count; i++) {
+                if (job->variants & (1U << i)) {
+                        char* variant = image_variant_path(target, widths[i]);
+
+                        buf_puts(&srcset, variant);
+                        buf_putc(&srcset, ' ');
+                        buf_put_int(&srcset, widths[i]);
+                        buf_puts(&srcset, "w, ");
+                        free(variant);
+                }
+        }
+        if (srcset.len) {
+                buf_puts(&srcset, target);
+                buf_putc(&srcset, ' ');
+                buf_put_int(&srcset, job->width);
+                buf_putc(&srcset, 'w');
+        }
+
+        if (info_count == info_cap) {
+                info_cap = info_cap ? info_cap * 2 : 64;
+                infos = realloc(infos, info_cap * sizeof(ImageInfo));
+                if (infos == NULL) {
+                        fprintf(stderr, "ERROR: Out of memory while measuring images\n");
+                        abort();
+                }
+        }
+        infos[info_count].url = arena_strdup(&info_strings, url);
+        infos[info_count].width = job->width;
+        infos[info_count].height = job->height;
+        infos[info_count].srcset = srcset.len ? arena_strdup(&info_strings, srcset.data) : NULL;
+        info_count++;
+        buf_free(&srcset);
+}
+
+
+/*
+ * Makes the images ready for lookups once copying is done, and returns
+ * hash with everything the pages write about them mixed in: when an image
+ * changes size, every page is written again.
+ */
+unsigned long image_finish(unsigned long hash)
+{
+        size_t i;
+
+        if (info_count)
+                qsort(infos, info_count, sizeof(ImageInfo), compare_infos);
+        info_hash = HASH_INIT;
+        for (i = 0; i < info_count; i++) {
+                info_hash = hash_str(info_hash, infos[i].url);
+                info_hash = hash_bytes(info_hash, &infos[i].width, sizeof(infos[i].width));
+                info_hash = hash_bytes(info_hash, &infos[i].height, sizeof(infos[i].height));
+                info_hash = hash_str(info_hash, infos[i].srcset);
+        }
+        return hash_bytes(hash, &info_hash, sizeof(info_hash));
+}
+
+
+/* the hash of the images image_finish() mixed in */
+unsigned long image_hash(void)
+{
+        return info_hash;
+}
+
+
+/*
+ * Appends the attributes for the image at [url, url + len) on a page in
+ * directory dir: its size and srcset when it was measured, and how to load
+ * it. first is true for the first image of the page.
+ */
+void image_put_attributes(Buf* out, const char* dir, const char* url, size_t len, bool first)
+{
+        char key[SITE_URL_MAX];
+        ImageInfo probe;
+        const ImageInfo* info = NULL;
+
+        if (!image_on)
+                return;
+
+        if (info_count && site_url(key, sizeof(key), dir, url, len)) {
+                probe.url = key;
+                info = bsearch(&probe, infos, info_count, sizeof(ImageInfo), compare_infos);
+        }
+        if (info) {
+                buf_puts(out, " width='");
+                buf_put_int(out, info->width);
+                buf_puts(out, "' height='");
+                buf_put_int(out, info->height);
+                buf_putc(out, '\'');
+                if (info->srcset) {
+                        buf_puts(out, " srcset='");
+                        buf_puts(out, info->srcset);
+                        buf_putc(out, '\'');
+                }
+        }
+        if (!first)
+                buf_puts(out, " loading='lazy'");
+        buf_puts(out, " decoding='async'");
+}
+
+
+/* the size of the image at path, from the cache when st matches; false if it is not known */
+static bool image_size(const char* path, const struct stat* st, ImageSize* size)
+{
+        ProbeEntry* e;
+        bool cached;
+
+        pthread_mutex_lock(&probe_lock);
+        e = probe_cap ? probe_slot(probes, probe_cap, path) : NULL;
+        cached = e && e->path && e->mtime == (long) st->st_mtime && e->size == (long) st->st_size;
+        if (cached)
+                *size = e->image;
+        pthread_mutex_unlock(&probe_lock);
+        if (cached)
+                return size->width > 0;
+
+        /* images whose header cannot be read are remembered as well */
+        if (!image_probe(path, size))
+                memset(size, 0, sizeof(*size));
+
+        pthread_mutex_lock(&probe_lock);
+        if ((probe_count + 1) * 2 > probe_cap) {
+                size_t cap = probe_cap ? probe_cap * 2 : 256;
+                ProbeEntry* table = calloc(cap, sizeof(ProbeEntry));
+                size_t i;
+
+                if (table == NULL) {
+                        fprintf(stderr, "ERROR: Out of memory while measuring images\n");
+                        abort();
+                }
+                for (i = 0; i < probe_cap; i++) {
+                        if (probes[i].path)
+                                *probe_slot(table, cap, probes[i].path) = probes[i];
+                }
+                free(probes);
+                probes = table;
+                probe_cap = cap;
+        }
+        e = probe_slot(probes, probe_cap, path);
+        if (e->path == NULL) {
+                e->path = str_printf("%s", path);
+                probe_count++;
+        }
+        e->mtime = (long) st->st_mtime;
+        e->size = (long) st->st_size;
+        e->image = *size;
+        pthread_mutex_unlock(&probe_lock);
+        return size->width > 0;
+}
+
+
+/* the slot of path in table: its entry, or the empty slot where it belongs */
+static ProbeEntry* probe_slot(ProbeEntry* table, size_t cap, const char* path)
+{
+        size_t i = hash_str(HASH_INIT, path) & (cap - 1);
+
+        while (table[i].path && strcmp(table[i].path, path) != 0)
+                i = (i + 1) & (cap - 1);
+        return &table[i];
+}
+
+
+/* reads the size of a PNG, JPEG, GIF or WebP image from the start of the file */
+static bool image_probe(const char* path, ImageSize* size)
+{
+        unsigned char h[30];
+        int fd = open(path, O_RDONLY);
+        ssize_t n;
+        bool ok = true;
+
+        if (fd == -1)
+                return false;
+        memset(h, 0, sizeof(h));
+        n = pread(fd, h, sizeof(h), 0);
+        stats_count(STAT_BYTES_READ, n > 0 ? n : 0);
+        size->upright = true;
+
+        if (n >= 24 && memcmp(h, "\x89PNG\r\n\x1a\n", 8) == 0 && memcmp(h + 12, "IHDR", 4) == 0) {
+                unsigned long width = (unsigned long) h[16] << 24 | (unsigned long) h[17] << 16 | h[18] << 8 | h[19];
+                unsigned long height = (unsigned long) h[20] << 24 | (unsigned long) h[21] << 16 | h[22] << 8 | h[23];
+
+                size->format = IMAGE_PNG;
+                ok = width <= INT_MAX && height <= INT_MAX;
+                if (ok) {
+                        size->width = (int) width;
+                        size->height = (int) height;
+                }
+        }
+        else if (n >= 10 && memcmp(h, "GIF8", 4) == 0) {
+                size->format = IMAGE_GIF;
+                size->width = h[6] | (h[7] << 8);
+                size->height = h[8] | (h[9] << 8);
+        }
+        else if (n >= 30 && memcmp(h, "RIFF", 4) == 0 && memcmp(h + 8, "WEBP", 4) == 0) {
+                size->format = IMAGE_WEBP;
+                if (memcmp(h + 12, "VP8 ", 4) == 0) {
+                        size->width = (h[26] | (h[27] << 8)) & 0x3fff;
+                        size->height = (h[28] | (h[29] << 8)) & 0x3fff;
+                }
+                else if (memcmp(h + 12, "VP8L", 4) == 0) {
+                        size->width = 1 + (h[21] | ((h[22] & 0x3f) << 8));
+                        size->height = 1 + ((h[22] >> 6) | (h[23] << 2) | ((h[24] & 0x0f) << 10));
+                }
+                else if (memcmp(h + 12, "VP8X", 4) == 0) {
+                        size->width = 1 + (h[24] | (h[25] << 8) | (h[26] << 16));
+                        size->height = 1 + (h[27] | (h[28] << 8) | (h[29] << 16));
+                }
+                else {
+                        ok = false;
+                }
+        }
+        else if (n >= 4 && h[0] == 0xff && h[1] == 0xd8) {
+                size->format = IMAGE_JPEG;
+                ok = probe_jpeg(fd, size);
+        }
+        else {
+                ok = false;
+        }
+
+        close(fd);
+        return ok && size->width > 0 && size->height > 0;
+}
+
+
+/*
+ * Walks the segments of a JPEG file up to the frame header, which has the
+ * size. An EXIF orientation on the way that turns the image by 90 degrees
+ * swaps width and height, as browsers show it turned.
+ */
+static bool probe_jpeg(int fd, ImageSize* size)
+{
+        unsigned char* exif = NULL;
+        int orientation = 1;
+        off_t offset = 2;
+        int segments;
+
+        for (segments = 0; segments < JPEG_MAX_SEGMENTS; segments++) {
+                unsigned char h[9];
+                unsigned marker;
+                size_t len;
+
+                if (pread(fd, h, 4, offset) != 4 || h[0] != 0xff)
+                        break;
+                marker = h[1];
+                if (marker == 0xff) {           /* fill byte */
+                        offset++;
+                        continue;
+                }
+                if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd8)) {
+                        offset += 2;
+                        continue;
+                }
+                if (marker == 0xd9 || marker == 0xda)
+                        break;
+                len = (h[2] << 8) | h[3];
+                if (len < 2)
+                        break;
+
+                /* SOF0 to SOF15, except DHT (c4), JPG (c8) and DAC (cc) */
+                if (marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc) {
+                        if (pread(fd, h, 9, offset) != 9)
+                                break;
+                        size->height = (h[5] << 8) | h[6];
+                        size->width = (h[7] << 8) | h[8];
+                        if (orientation != 1)
+                                size->upright = false;
+                        if (orientation >= 5) {
+                                int width = size->width;
+                                size->width = size->height;
+                                size->height = width;
+                        }
+                        free(exif);
+                        return true;
+                }
+                if (marker == 0xe1 && exif == NULL && (exif = malloc(len - 2)) != NULL
+                    && pread(fd, exif, len - 2, offset + 4) == (ssize_t) (len - 2))
+                        orientation = exif_orientation(exif, len - 2);
+                offset += 2 + len;
+        }
+        free(exif);
+        return false;
+}
+
+
+/* the orientation tag (1 to 8) of an APP1 segment holding EXIF data; 1 when there is none */
+static int exif_orientation(const unsigned char* data, size_t len)
+{
+        const unsigned char* tiff = data + 6;
+        bool big_endian;
+        unsigned long ifd;
+        unsigned count;
+        unsigned i;
+
+        if (len < 14 || memcmp(data, "Exif\0\0", 6) != 0)
+                return 1;
+        len -= 6;
+        if (memcmp(tiff, "MM", 2) == 0)
+                big_endian = true;
+        else if (memcmp(tiff, "II", 2) == 0)
+                big_endian = false;
+        else
+                return 1;
+
+#define GET16(p) (big_endian ? ((p)[0] << 8) | (p)[1] : ((p)[1] << 8) | (p)[0])
+#define GET32(p) (big_endian ? ((unsigned long) GET16(p) << 16) | GET16((p) + 2) \
+                             : ((unsigned long) GET16((p) + 2) << 16) | GET16(p))
+        ifd = GET32(tiff + 4);
+        if (ifd + 2 > len)
+                return 1;
+        count = GET16(tiff + ifd);
+        for (i = 0; i < count && ifd + 2 + 12 * (i + 1) <= len; i++) {
+                const unsigned char* entry = tiff + ifd + 2 + 12 * i;
+
+                if (GET16(entry) == 0x0112) {
+                        int orientation = GET16(entry + 8);
+                        return orientation >= 1 && orientation <= 8 ? orientation : 1;
+                }
+        }
+#undef GET16
+#undef GET32
+        return 1;
+}
+
+
+/*
+ * Decodes the image at path into p->data, to be freed. A JPEG image may be
+ * decoded at a fraction of its size, as long as it stays need pixels wide.
+ */
+static bool image_decode(const char* path, const ImageSize* size, int need, Pixels* p)
+{
+        (void) path;
+        (void) need;
+        if ((unsigned long) size->width * size->height > IMAGE_MAX_PIXELS)
+                return false;
+#ifdef HAVE_PNG
+        if (size->format == IMAGE_PNG)
+                return png_decode(path, p);
+#endif
+#ifdef HAVE_JPEG
+        if (size->format == IMAGE_JPEG)
+                return jpeg_decode(path, need, p);
+#endif
+        (void) p;
+        return false;
+}
+
+
+static bool image_encode(FILE* f, ImageFormat format, const Pixels* p)
+{
+        (void) f;
+        (void) p;
+#ifdef HAVE_PNG
+        if (format == IMAGE_PNG)
+                return png_encode(f, p);
+#endif
+#ifdef HAVE_JPEG
+        if (format == IMAGE_JPEG)
+                return jpeg_encode(f, p);
+#endif
+        (void) format;
+        return false;
+}
+
+
+/* writes src scaled down to width pixels, in format, to path */
+static bool write_variant(const Pixels* src, ImageFormat format, const char* path, int width)
+{
+        Pixels small;
+        int height = (int) (((long) src->height * width + src->width / 2) / src->width);
+        char* tmp;
+        FILE* f;
+        bool ok;
+
+        downscale(src, width, height > 0 ? height : 1, &small);
+        if ((f = output_open(path, &tmp)) == NULL) {
+                free(small.data);
+                return false;
+        }
+        ok = image_encode(f, format, &small);
+        ok = output_commit(f, path, tmp, ok);
+        free(small.data);
+        return ok;
+}
+
+
+/*
+ * Scales src down to width x height by averaging the source pixels that
+ * fall into each target pixel. Colour is weighted by alpha, so transparent
+ * pixels do not darken the edges of what is opaque.
+ */
+static void downscale(const Pixels* src, int width, int height, Pixels* dst)
+{
+        int c = src->channels;
+        int x;
+        int y;
+
+        dst->width = width;
+        dst->height = height;
+        dst->channels = c;
+        dst->data = malloc((size_t) width * height * c);
+        if (dst->data == NULL) {
+                fprintf(stderr, "ERROR: Out of memory while scaling an image\n");
+                abort();
+        }
+
+        for (y = 0; y < height; y++) {
+                int y0 = (int) ((long) y * src->height / height);
+                int y1 = (int) ((long) (y + 1) * src->height / height);
+
+                if (y1 <= y0)
+                        y1 = y0 + 1;
+                for (x = 0; x < width; x++) {
+                        int x0 = (int) ((long) x * src->width / width);
+                        int x1 = (int) ((long) (x + 1) * src->width / width);
+                        unsigned long sum[4] = { 0, 0, 0, 0 };
+                        unsigned long weight = 0;
+                        unsigned long count;
+                        unsigned char* d = dst->data + ((size_t) y * width + x) * c;
+                        int sx;
+                        int sy;
+                        int k;
+
+                        if (x1 <= x0)
+                                x1 = x0 + 1;
+                        count = (unsigned long) (x1 - x0) * (y1 - y0);
+                        for (sy = y0; sy < y1; sy++) {
+                                const unsigned char* s = src->data + ((size_t) sy * src->width + x0) * c;
+
+                                for (sx = x0; sx < x1; sx++, s += c) {
+                                        unsigned long w = c == 4 ? s[3] : 1;
+
+                                        for (k = 0; k < 3; k++)
+                                                sum[k] += s[k] * w;
+                                        if (c == 4)
+                                                sum[3] += s[3];
+                                        weight += w;
+                                }
+                        }
+                        for (k = 0; k < 3; k++)
+                                d[k] = (unsigned char) (weight ? (sum[k] + weight / 2) / weight : 0);
+                        if (c == 4)
+                                d[3] = (unsigned char) ((sum[3] + count / 2) / count);
+                }
+        }
+}
+
+
+static int compare_infos(const void* a, const void* b)
+{
+        return strcmp(((const ImageInfo*) a)->url, ((const ImageInfo*) b)->url);
+}
+
+
+#ifdef HAVE_PNG
+static bool png_decode(const char* path, Pixels* p)
+{
+        png_image png;
+
+        memset(&png, 0, sizeof(png));
+        png.version = PNG_IMAGE_VERSION;
+        if (!png_image_begin_read_from_file(&png, path))
+                return false;
+
+        png.format = (png.format & PNG_FORMAT_FLAG_ALPHA) ? PNG_FORMAT_RGBA : PNG_FORMAT_RGB;
+        p->width = png.width;
+        p->height = png.height;
+        p->channels = PNG_IMAGE_PIXEL_CHANNELS(png.format);
+        p->data = malloc(PNG_IMAGE_SIZE(png));
+        if (p->data == NULL) {
+                fprintf(stderr, "ERROR: Out of memory while scaling %s\n", path);
+                abort();
+        }
+        /* frees png on failure as well */
+        if (!png_image_finish_read(&png, NULL, p->data, 0, NULL)) {
+                free(p->data);
+                p->data = NULL;
+                return false;
+        }
+        return true;
+}
+
+
+static bool png_encode(FILE* f, const Pixels* p)
+{
+        png_image png;
+
+        memset(&png, 0, sizeof(png));
+        png.version = PNG_IMAGE_VERSION;
+        png.width = p->width;
+        png.height = p->height;
+        png.format = p->channels == 4 ? PNG_FORMAT_RGBA : PNG_FORMAT_RGB;
+        return png_image_write_to_stdio(&png, f, 0, p->data, 0, NULL) != 0;
+}
+#endif
+
+
+#ifdef HAVE_JPEG
+/* libjpeg reports errors by calling jpeg_fail(), which jumps back here */
+static bool jpeg_decode(const char* path, int need, Pixels* p)
+{
+        struct jpeg_decompress_struct cinfo;
+        JpegError err;
+        FILE* f = fopen(path, "rb");
+
+        if (f == NULL)
+                return false;
+        cinfo.err = jpeg_std_error(&err.mgr);
+        err.mgr.error_exit = jpeg_fail;
+        err.mgr.output_message = jpeg_quiet;
+        if (setjmp(err.jump)) {
+                jpeg_destroy_decompress(&cinfo);
+                fclose(f);
+                free(p->data);
+                p->data = NULL;
+                return false;
+        }
+
+        jpeg_create_decompress(&cinfo);
+        jpeg_decode_rows(&cinfo, f, need, p);
+        jpeg_destroy_decompress(&cinfo);
+        fclose(f);
+        return true;
+}
+
+
+static void jpeg_decode_rows(struct jpeg_decompress_struct* cinfo, FILE* f, int need, Pixels* p)
+{
+        unsigned denom;
+        size_t stride;
+
+        jpeg_stdio_src(cinfo, f);
+        jpeg_read_header(cinfo, TRUE);
+        cinfo->out_color_space = JCS_RGB;
+
+        /* the DCT scales by 1/2, 1/4 or 1/8 for free while decoding */
+        for (denom = 8; denom > 1 && (cinfo->image_width + denom - 1) / denom < (unsigned) need; denom /= 2)
+                ;
+        cinfo->scale_num = 1;
+        cinfo->scale_denom = denom;
+        jpeg_start_decompress(cinfo);
+
+        p->width = cinfo->output_width;
+        p->height = cinfo->output_height;
+        p->channels = 3;
+        stride = (size_t) p->width * 3;
+        p->data = malloc(stride * p->height);
+        if (p->data == NULL) {
+                fprintf(stderr, "ERROR: Out of memory while scaling an image\n");
+                abort();
+        }
+        while (cinfo->output_scanline < cinfo->output_height) {
+                JSAMPROW row = p->data + cinfo->output_scanline * stride;
+                jpeg_read_scanlines(cinfo, &row, 1);
+        }
+        jpeg_finish_decompress(cinfo);
+}
+
+
+static bool jpeg_encode(FILE* f, const Pixels* p)
+{
+        struct jpeg_compress_struct cinfo;
+        JpegError err;
+
+        cinfo.err = jpeg_std_error(&err.mgr);
+        err.mgr.error_exit = jpeg_fail;
+        err.mgr.output_message = jpeg_quiet;
+        if (setjmp(err.jump)) {
+                jpeg_destroy_compress(&cinfo);
+                return false;
+        }
+
+        jpeg_create_compress(&cinfo);
+        jpeg_encode_rows(&cinfo, f, p);
+        jpeg_destroy_compress(&cinfo);
+        return true;
+}
+
+
+static void jpeg_encode_rows(struct jpeg_compress_struct* cinfo, FILE* f, const Pixels* p)
+{
+        size_t stride = (size_t) p->width * 3;
+
+        jpeg_stdio_dest(cinfo, f);
+        cinfo->image_width = p->width;
+        cinfo->image_height = p->height;
+        cinfo->input_components = 3;
+        cinfo->in_color_space = JCS_RGB;
+        jpeg_set_defaults(cinfo);
+        jpeg_set_quality(cinfo, JPEG_QUALITY, TRUE);
+        jpeg_start_compress(cinfo, TRUE);
+        while (cinfo->next_scanline < cinfo->image_height) {
+                JSAMPROW row = p->data + cinfo->next_scanline * stride;
+                jpeg_write_scanlines(cinfo, &row, 1);
+        }
+        jpeg_finish_compress(cinfo);
+}
+
+
+static void jpeg_fail(j_common_ptr cinfo)
+{
+        longjmp(((JpegError*) (void*) cinfo->err)->jump, 1);
+}
+
+
+/* corrupt data is reported through the return value, not on stderr */
+static void jpeg_quiet(j_common_ptr cinfo)
+{
+        (void) cinfo;
+}
+#endif
@@ -0,0 +1,212 @@
+/*
+ * File: lib.c
+ * -----------
+ * The renderer as a library (libtxt2web.a, see `make lib`), for programs that
+ * render posts in-process instead of running txt2web on files. The source
+ * comes from memory or a file descriptor, the page goes to a sink callback
+ * as it is written, and the metadata and the messages come back in a
+ * RenderResult: nothing is printed and nothing exits. The txt2web_*
+ * functions at the end are the same for other programs, declared in
+ * libtxt2web.h; they are all the library exports.
+ *
+ * Calls are not independent of everything: the page layout is the global
+ * one layout_load() set up, built on first use, and the -s, -m, -f and -l
+ * switches (search_enable() and the like) are global flags read while
+ * rendering. Set both up before rendering on several threads; calls share
+ * nothing else, so any number may then run at once, as the render workers
+ * do.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libtxt2web.h"
+#include "txt2web.h"
+
+typedef struct {
+        RenderSink sink;
+        void* ctx;
+        bool failed;
+} SinkCookie;
+
+static ssize_t sink_write(void* cookie, const char* data, size_t len);
+
+
+/*
+ * Renders the post source in [data, data + len) and passes the page to sink,
+ * in pieces of up to OUT_FLUSH_SIZE bytes. name is only used in messages.
+ * add_link adds the link back to the home page, as on the pages of a site.
+ * Returns false if the page could not be passed on completely; the messages
+ * in result say what was wrong with the source. result must be freed with
+ * render_result_free() either way.
+ */
+bool render_buffer(const char* data, size_t len, const char* name, bool add_link,
+                   RenderSink sink, void* ctx, RenderResult* result)
+{
+        static const cookie_io_functions_t sink_functions = { NULL, sink_write, NULL, NULL };
+        SinkCookie cookie;
+        FILE* out;
+        FILE* log;
+        size_t messages_len = 0;
+        bool ok = false;
+
+        memset(result, 0, sizeof(*result));
+        arena_init(&result->strings);
+        cookie.sink = sink;
+        cookie.ctx = ctx;
+        cookie.failed = false;
+
+        log = open_memstream(&result->messages, &messages_len);
+        out = fopencookie(&cookie, "w", sink_functions);
+        if (log != NULL && out != NULL) {
+                /* the page is already written in large chunks, see render_html() */
+                setvbuf(out, NULL, _IONBF, 0);
+                ok = render_html(data, len, name, out, add_link, NULL, &result->post, &result->strings, log);
+        }
+        if (out != NULL)
+                ok = fclose(out) == 0 && ok;
+        if (log != NULL)
+                fclose(log);
+
+        if (result->messages == NULL)
+                result->messages = str_printf("%s", "");
+        return ok && !cookie.failed;
+}
+
+
+/* render_buffer() for everything that can be read from fd, a file or a pipe */
+bool render_fd(int fd, const char* name, bool add_link, RenderSink sink, void* ctx, RenderResult* result)
+{
+        MappedFile src;
+        bool ok;
+
+        if (!map_fd(fd, &src)) {
+                memset(result, 0, sizeof(*result));
+                arena_init(&result->strings);
+                result->messages = str_printf("ERROR: Could not read %s: %s\n", name, strerror(errno));
+                return false;
+        }
+        ok = render_buffer(src.data, src.len, name, add_link, sink, ctx, result);
+        unmap_file(&src);
+        return ok;
+}
+
+
+void render_result_free(RenderResult* result)
+{
+        free(result->messages);
+        result->messages = NULL;
+        arena_free(&result->strings);
+}
+
+
+/* sink that appends to the Buf ctx */
+bool render_sink_buf(void* ctx, const char* data, size_t len)
+{
+        buf_append(ctx, data, len);
+        return true;
+}
+
+
+/* sink that writes to the file descriptor *(int*) ctx */
+bool render_sink_fd(void* ctx, const char* data, size_t len)
+{
+        int fd = *(int*) ctx;
+
+        while (len > 0) {
+                ssize_t n = write(fd, data, len);
+
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n <= 0)
+                        return false;
+                data += n;
+                len -= n;
+        }
+        return true;
+}
+
+
+static ssize_t sink_write(void* cookie, const char* data, size_t len)
+{
+        SinkCookie* c = cookie;
+
+        /* 0 is how a cookie write fails; it must not be negative */
+        if (c->failed || !c->sink(c->ctx, data, len)) {
+                c->failed = true;
+                return 0;
+        }
+        return len;
+}
+
+
+bool txt2web_render_buffer(const char* data, size_t len, const char* name, bool add_link,
+                           Txt2webSink sink, void* ctx, Txt2webResult* result)
+{
+        RenderResult* r = malloc(sizeof(RenderResult));
+        bool ok;
+
+        if (r == NULL) {
+                fprintf(stderr, "ERROR: Out of memory while rendering %s\n", name);
+                abort();
+        }
+        ok = render_buffer(data, len, name, add_link, sink, ctx, r);
+        result->title = r->post.title;
+        result->date = r->post.date_str;
+        result->description = r->post.description;
+        result->tags = r->post.tags;
+        result->time = r->post.date;
+        result->messages = r->messages;
+        result->internal = r;
+        return ok;
+}
+
+
+bool txt2web_render_fd(int fd, const char* name, bool add_link, Txt2webSink sink, void* ctx, Txt2webResult* result)
+{
+        MappedFile src;
+        bool ok;
+
+        if (!map_fd(fd, &src)) {
+                char* message = str_printf("ERROR: Could not read %s: %s\n", name, strerror(errno));
+                RenderResult* r = calloc(1, sizeof(RenderResult));
+
+                if (r == NULL) {
+                        fprintf(stderr, "ERROR: Out of memory while rendering %s\n", name);
+                        abort();
+                }
+                arena_init(&r->strings);
+                r->messages = message;
+                memset(result, 0, sizeof(*result));
+                result->messages = message;
+                result->internal = r;
+                return false;
+        }
+        ok = txt2web_render_buffer(src.data, src.len, name, add_link, sink, ctx, result);
+        unmap_file(&src);
+        return ok;
+}
+
+
+void txt2web_result_free(Txt2webResult* result)
+{
+        if (result->internal) {
+                render_result_free(result->internal);
+                free(result->internal);
+        }
+        memset(result, 0, sizeof(*result));
+}
+
+
+bool txt2web_sink_fd(void* ctx, const char* data, size_t len)
+{
+        return render_sink_fd(ctx, data, len);
+}
+
+
+bool txt2web_layout_load(const char* path)
+{
+        return layout_load(path);
+}
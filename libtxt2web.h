@@ -0,0 +1,60 @@
+/*
+ * File: libtxt2web.h
+ * ------------------
+ * The interface of libtxt2web.a (see `make lib`), for programs that render
+ * txt2web posts in-process, e.g. a preview in an editor. This is the only
+ * header such a program includes, and the functions below are the only
+ * symbols the library exports; everything else in it is internal.
+ *
+ * The layout pages are written into is process-wide: the built-in one, or
+ * the one txt2web_layout_load() read last. Load it before the first render
+ * when rendering on several threads; the render calls share nothing else
+ * and may then run at once on different threads. The site options of the
+ * txt2web program (search, minifying, fingerprinting, image sizes, the render
+ * cache) are all off in the library.
+ */
+#ifndef LIBTXT2WEB_H
+#define LIBTXT2WEB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#define TXT2WEB_API __attribute__((visibility("default")))
+
+/* receives a rendered page piece by piece; returns false to stop */
+typedef bool (*Txt2webSink)(void* ctx, const char* data, size_t len);
+
+/* what rendering found out about a post; free with txt2web_result_free() */
+typedef struct {
+        const char* title;      /* the file name when the post has no title */
+        const char* date;       /* NULL when the post does not have it */
+        const char* description;
+        const char* tags;       /* comma separated, as written in the post */
+        time_t time;            /* date as a time; 0 without a date */
+        const char* messages;   /* warnings and errors, one per line; "" when there are none */
+        void* internal;
+} Txt2webResult;
+
+/*
+ * Renders the post source in [data, data + len) and passes the page to sink.
+ * name is only used in messages; add_link adds the link back to the home
+ * page, as on the pages of a site. Returns false if the page could not be
+ * passed on completely. result must be freed either way.
+ */
+TXT2WEB_API bool txt2web_render_buffer(const char* data, size_t len, const char* name, bool add_link,
+                                       Txt2webSink sink, void* ctx, Txt2webResult* result);
+
+/* txt2web_render_buffer() for everything that can be read from fd, a file or a pipe */
+TXT2WEB_API bool txt2web_render_fd(int fd, const char* name, bool add_link,
+                                   Txt2webSink sink, void* ctx, Txt2webResult* result);
+
+TXT2WEB_API void txt2web_result_free(Txt2webResult* result);
+
+/* sink that writes to the file descriptor *(int*) ctx */
+TXT2WEB_API bool txt2web_sink_fd(void* ctx, const char* data, size_t len);
+
+/* reads the layout pages are written into from path, NULL for the built-in one; false if it is unusable */
+TXT2WEB_API bool txt2web_layout_load(const char* path);
+
+#endif
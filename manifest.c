@@ -0,0 +1,433 @@
+/*
+ * File: manifest.c
+ * ----------------
+ * Build manifest used for incremental rebuilds. The manifest lives in the
+ * build directory and records, for every generated file, the source it came
+ * from (path, mtime, size and content hash) and, for posts, the metadata
+ * needed to regenerate index.html (and the search index) without
+ * re-rendering the post. The last line holds the number of entries, so a
+ * manifest cut short is rejected as a whole.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "txt2web.h"
+
+#define MANIFEST_VERSION "txt2web-manifest 4"
+#define FNV_PRIME 1099511628211UL
+
+static char* field_escape(const char* str);
+static void field_unescape(char* str);
+static char* next_field(char** cursor);
+static char* meta_escape(const char* str);
+static char* next_meta(Arena* strings, char** cursor);
+static int compare_entries(const void* a, const void* b);
+
+
+unsigned long hash_bytes(unsigned long hash, const void* data, size_t len)
+{
+        const unsigned char* p = data;
+        size_t i;
+
+        for (i = 0; i < len; i++) {
+                hash ^= p[i];
+                hash *= FNV_PRIME;
+        }
+        return hash;
+}
+
+
+unsigned long hash_str(unsigned long hash, const char* str)
+{
+        /* include the terminator so ("ab", "c") and ("a", "bc") differ */
+        if (str == NULL)
+                return hash_bytes(hash, "", 1);
+        return hash_bytes(hash, str, strlen(str) + 1);
+}
+
+
+bool hash_file(const char* path, unsigned long* hash)
+{
+        FILE* f = fopen(path, "rb");
+        char buf[65536];
+        size_t size;
+
+        if (f == NULL)
+                return false;
+
+        *hash = HASH_INIT;
+        while ((size = fread(buf, 1, sizeof(buf), f)) > 0) {
+                *hash = hash_bytes(*hash, buf, size);
+                stats_count(STAT_BYTES_READ, size);
+        }
+
+        fclose(f);
+        return true;
+}
+
+
+void manifest_init(Manifest* m)
+{
+        memset(m, 0, sizeof(*m));
+        arena_init(&m->strings);
+}
+
+
+bool manifest_load(Manifest* m, const char* path)
+{
+        FILE* f = fopen(path, "r");
+        char* line = NULL;
+        size_t line_cap = 0;
+        ssize_t len;
+        bool ok = false;
+        bool ended = false;
+
+        if (f == NULL)
+                return false;
+
+        if ((len = getline(&line, &line_cap, f)) <= 0 || strncmp(line, MANIFEST_VERSION, strlen(MANIFEST_VERSION)) != 0)
+                goto done;
+
+        while ((len = getline(&line, &line_cap, f)) > 0) {
+                char* cursor = line;
+                char* kind;
+                char* src;
+                char* out;
+                ManifestEntry* e;
+                struct stat st = { 0 };
+
+                if (ended)
+                        goto done;
+                line[strcspn(line, "\n")] = '\0';
+                kind = next_field(&cursor);
+
+                if (strcmp(kind, "E") == 0) {
+                        if (strtoul(next_field(&cursor), NULL, 10) != m->count)
+                                goto done;
+                        ended = true;
+                        continue;
+                }
+                if (strcmp(kind, "L") == 0) {
+                        m->list_hash = strtoul(next_field(&cursor), NULL, 16);
+                        continue;
+                }
+                if (strcmp(kind, "T") == 0) {
+                        m->layout_hash = strtoul(next_field(&cursor), NULL, 16);
+                        continue;
+                }
+                if (strcmp(kind, "N") == 0) {
+                        m->asset_hash = strtoul(next_field(&cursor), NULL, 16);
+                        continue;
+                }
+                if (strcmp(kind, "Z") == 0) {
+                        m->compressed = strtol(next_field(&cursor), NULL, 10) != 0;
+                        continue;
+                }
+                if (strlen(kind) != 1 || strchr("PAIGFV", kind[0]) == NULL)
+                        continue;
+
+                src = next_field(&cursor);
+                out = next_field(&cursor);
+                e = manifest_add(m, kind[0], src, out, &st, 0);
+                e->mtime = strtol(next_field(&cursor), NULL, 10);
+                e->size = strtol(next_field(&cursor), NULL, 10);
+                e->hash = strtoul(next_field(&cursor), NULL, 16);
+
+                if (e->kind == 'P') {
+                        e->post.filename = next_meta(&m->strings, &cursor);
+                        e->post.date_str = next_meta(&m->strings, &cursor);
+                        e->post.title = next_meta(&m->strings, &cursor);
+                        e->post.description = next_meta(&m->strings, &cursor);
+                        e->post.tags = next_meta(&m->strings, &cursor);
+                        e->post.terms = next_meta(&m->strings, &cursor);
+                        if (e->post.date_str)
+                                parse_date(e->post.date_str, &e->post.date);
+                }
+        }
+        if (!ended)
+                goto done;
+        manifest_sort(m);
+        ok = true;
+done:
+        free(line);
+        fclose(f);
+        return ok;
+}
+
+
+/* writes m to path through a temporary file, so a save cut short leaves the old manifest */
+bool manifest_save(Manifest* m, const char* path)
+{
+        char* tmp;
+        FILE* f = output_open(path, &tmp);
+        size_t i;
+
+        if (f == NULL) {
+                fprintf(stderr, "Could not write manifest: %s\n", path);
+                return false;
+        }
+
+        fprintf(f, "%s\n", MANIFEST_VERSION);
+        fprintf(f, "L\t%lx\n", m->list_hash);
+        fprintf(f, "T\t%lx\n", m->layout_hash);
+        fprintf(f, "N\t%lx\n", m->asset_hash);
+        fprintf(f, "Z\t%d\n", m->compressed ? 1 : 0);
+        for (i = 0; i < m->count; i++) {
+                ManifestEntry* e = &m->entries[i];
+                char* src = field_escape(e->src);
+                char* out = field_escape(e->out);
+
+                fprintf(f, "%c\t%s\t%s\t%ld\t%ld\t%lx", e->kind, src, out, e->mtime, e->size, e->hash);
+                if (e->kind == 'P') {
+                        char* filename = meta_escape(e->post.filename);
+                        char* date_str = meta_escape(e->post.date_str);
+                        char* title = meta_escape(e->post.title);
+                        char* description = meta_escape(e->post.description);
+                        char* tags = meta_escape(e->post.tags);
+                        char* terms = meta_escape(e->post.terms);
+
+                        fprintf(f, "\t%s\t%s\t%s\t%s\t%s\t%s", filename, date_str, title, description, tags, terms);
+                        free(filename);
+                        free(date_str);
+                        free(title);
+                        free(description);
+                        free(tags);
+                        free(terms);
+                }
+                fprintf(f, "\n");
+                free(src);
+                free(out);
+        }
+        fprintf(f, "E\t%lu\n", (unsigned long) m->count);
+
+        if (!output_commit(f, path, tmp, fflush(f) == 0 && !ferror(f))) {
+                fprintf(stderr, "Could not write manifest: %s\n", path);
+                return false;
+        }
+        return true;
+}
+
+
+void manifest_free(Manifest* m)
+{
+        arena_free(&m->strings);
+        free(m->entries);
+        m->entries = NULL;
+        m->count = 0;
+        m->cap = 0;
+}
+
+
+ManifestEntry* manifest_add(Manifest* m, char kind, const char* src, const char* out,
+                            const struct stat* st, unsigned long hash)
+{
+        ManifestEntry* e;
+
+        if (m->count == m->cap) {
+                m->cap = m->cap ? m->cap * 2 : 64;
+                m->entries = realloc(m->entries, m->cap * sizeof(ManifestEntry));
+                if (m->entries == NULL) {
+                        fprintf(stderr, "ERROR: Out of memory while building manifest\n");
+                        abort();
+                }
+        }
+
+        e = &m->entries[m->count++];
+        memset(e, 0, sizeof(*e));
+        e->kind = kind;
+        e->src = arena_strdup(&m->strings, src);
+        e->out = arena_strdup(&m->strings, out);
+        e->mtime = (long) st->st_mtime;
+        e->size = (long) st->st_size;
+        e->hash = hash;
+        return e;
+}
+
+
+/* copies the metadata of post into the manifest's own storage */
+void manifest_set_post(Manifest* m, ManifestEntry* e, const Post* post)
+{
+        e->post.filename = arena_strdup(&m->strings, post->filename);
+        e->post.title = arena_strdup(&m->strings, post->title);
+        e->post.date_str = arena_strdup(&m->strings, post->date_str);
+        e->post.description = arena_strdup(&m->strings, post->description);
+        e->post.tags = arena_strdup(&m->strings, post->tags);
+        e->post.terms = arena_strdup(&m->strings, post->terms);
+        e->post.date = post->date;
+}
+
+
+void manifest_sort(Manifest* m)
+{
+        qsort(m->entries, m->count, sizeof(ManifestEntry), compare_entries);
+}
+
+
+ManifestEntry* manifest_find(const Manifest* m, const char* src)
+{
+        ManifestEntry key;
+
+        if (m->count == 0)
+                return NULL;
+        key.src = (char*) src;
+        return bsearch(&key, m->entries, m->count, sizeof(ManifestEntry), compare_entries);
+}
+
+
+/*
+ * Returns true when src has not changed since the previous build and its
+ * output still exists. mtime and size are trusted when they match; otherwise
+ * the contents are hashed so that a touched-but-identical file is still
+ * considered unchanged. *hash is set whenever the function returns true.
+ */
+bool manifest_unchanged(const Manifest* m, const char* src, const char* out,
+                        const struct stat* st, unsigned long* hash)
+{
+        ManifestEntry* e = manifest_find(m, src);
+
+        if (e == NULL || strcmp(e->out, out) != 0 || access(out, F_OK) != 0)
+                return false;
+
+        if (e->mtime == (long) st->st_mtime && e->size == (long) st->st_size) {
+                *hash = e->hash;
+                return true;
+        }
+
+        if (e->size != (long) st->st_size || !hash_file(src, hash))
+                return false;
+
+        return *hash == e->hash;
+}
+
+
+/*
+ * Deletes outputs recorded in the previous manifest whose source no longer
+ * exists. Both manifests must be sorted. Returns the number of files removed.
+ */
+int manifest_remove_orphans(const Manifest* prev, const Manifest* next)
+{
+        size_t i;
+        int removed = 0;
+
+        for (i = 0; i < prev->count; i++) {
+                ManifestEntry* e = &prev->entries[i];
+                char* dir;
+                char* slash;
+
+                if (manifest_find(next, e->src) != NULL)
+                        continue;
+
+                printf("Removing orphaned file: %s\n", e->out);
+                if (remove(e->out) == 0)
+                        removed++;
+                compress_remove(e->out);
+
+                /* drop directories the orphan leaves empty; rmdir fails otherwise */
+                dir = strdup(e->out);
+                while ((slash = strrchr(dir, '/')) != NULL) {
+                        *slash = '\0';
+                        if (rmdir(dir) != 0)
+                                break;
+                }
+                free(dir);
+        }
+
+        return removed;
+}
+
+
+static char* field_escape(const char* str)
+{
+        char* result;
+        char* p;
+
+        if (str == NULL)
+                str = "";
+
+        result = malloc(strlen(str) * 2 + 1);
+        for (p = result; *str; str++) {
+                if (*str == '\\' || *str == '\t' || *str == '\n') {
+                        *p++ = '\\';
+                        *p++ = (*str == '\t') ? 't' : (*str == '\n') ? 'n' : '\\';
+                }
+                else {
+                        *p++ = *str;
+                }
+        }
+        *p = '\0';
+        return result;
+}
+
+
+static void field_unescape(char* str)
+{
+        char* out = str;
+
+        for (; *str; str++) {
+                if (*str == '\\' && str[1]) {
+                        str++;
+                        *out++ = (*str == 't') ? '\t' : (*str == 'n') ? '\n' : *str;
+                }
+                else {
+                        *out++ = *str;
+                }
+        }
+        *out = '\0';
+}
+
+
+/* splits the next tab separated field off *cursor; missing fields are "" */
+static char* next_field(char** cursor)
+{
+        char* field = *cursor;
+        char* tab = strchr(field, '\t');
+
+        if (tab) {
+                *tab = '\0';
+                *cursor = tab + 1;
+        }
+        else {
+                *cursor = field + strlen(field);
+        }
+        field_unescape(field);
+        return field;
+}
+
+
+/*
+ * Escapes post metadata that may be absent: "-" when the post has none,
+ * "=value" otherwise, as the render cache stores it. Must be freed.
+ */
+static char* meta_escape(const char* str)
+{
+        char* escaped;
+        char* result;
+
+        if (str == NULL)
+                return str_printf("-");
+        escaped = field_escape(str);
+        result = str_printf("=%s", escaped);
+        free(escaped);
+        return result;
+}
+
+
+/* the next field written by meta_escape(), copied into strings; NULL when absent */
+static char* next_meta(Arena* strings, char** cursor)
+{
+        char* field = next_field(cursor);
+
+        if (*field != '=')
+                return NULL;
+        return arena_strdup(strings, field + 1);
+}
+
+
+static int compare_entries(const void* a, const void* b)
+{
+        const ManifestEntry* entry_a = a;
+        const ManifestEntry* entry_b = b;
+        return strcmp(entry_a->src, entry_b->src);
+}
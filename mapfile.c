@@ -0,0 +1,90 @@
+/*
+ * File: mapfile.c
+ * ---------------
+ * Read-only access to a whole input file. Regular files of a reasonable size
+ * are mmap'd so the parser reads straight from the page cache; small files,
+ * pipes and anything mmap refuses are read into a buffer instead.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "txt2web.h"
+
+/* below this a read() is cheaper than setting up a mapping */
+#define MAP_MIN_SIZE 16384
+
+
+bool map_file(const char* path, MappedFile* f)
+{
+        int fd = open(path, O_RDONLY);
+        bool ok;
+
+        memset(f, 0, sizeof(*f));
+        if (fd == -1)
+                return false;
+        ok = map_fd(fd, f);
+        close(fd);
+        return ok;
+}
+
+
+/* the same for an open descriptor (stdin, say), which is left open */
+bool map_fd(int fd, MappedFile* f)
+{
+        struct stat st;
+        ssize_t n;
+
+        memset(f, 0, sizeof(*f));
+        memset(&st, 0, sizeof(st));
+
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= MAP_MIN_SIZE) {
+                void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (data != MAP_FAILED) {
+                        madvise(data, st.st_size, MADV_SEQUENTIAL);
+                        f->data = data;
+                        f->len = st.st_size;
+                        f->mapped = true;
+                        stats_count(STAT_FILES_READ, 1);
+                        stats_count(STAT_BYTES_READ, f->len);
+                        return true;
+                }
+        }
+
+        buf_reserve(&f->buf, S_ISREG(st.st_mode) && st.st_size > 0 ? (size_t) st.st_size : 4096);
+        for (;;) {
+                buf_reserve(&f->buf, 4096);
+                n = read(fd, f->buf.data + f->buf.len, f->buf.cap - f->buf.len - 1);
+                if (n == 0)
+                        break;
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        buf_free(&f->buf);
+                        return false;
+                }
+                f->buf.len += n;
+        }
+        f->buf.data[f->buf.len] = '\0';
+
+        f->data = f->buf.data;
+        f->len = f->buf.len;
+        stats_count(STAT_FILES_READ, 1);
+        stats_count(STAT_BYTES_READ, f->len);
+        return true;
+}
+
+
+void unmap_file(MappedFile* f)
+{
+        if (f->mapped)
+                munmap((void*) f->data, f->len);
+        else
+                buf_free(&f->buf);
+        f->data = NULL;
+        f->len = 0;
+}
@@ -0,0 +1,247 @@
+/*
+ * File: minify.c
+ * --------------
+ * Minified output (-m). Nothing is minified after the fact: the renderer
+ * writes its markup through buf_put_markup(), which leaves out the
+ * indentation and line breaks between tags, the layout is minified once
+ * when it is loaded, and stylesheets are minified while they are copied.
+ * The text of the posts is written as it is, so code blocks and anything
+ * else that depends on its whitespace come out unchanged.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "txt2web.h"
+
+enum { CSS_TEXT, CSS_STRING, CSS_COMMENT };
+
+static const char* raw_text_end(const char* p);
+static void css_put(CssMinifier* m, Buf* out, char c);
+
+static bool minify_on = false;
+
+/* elements whose text is kept as it is in a layout, with the tag closing them */
+static const char* raw_elements[][2] = {
+        { "<pre", "</pre" },
+        { "<textarea", "</textarea" },
+        { "<script", "</script" },
+        { "<style", "</style" }
+};
+
+
+/* write compact HTML and copy stylesheets minified */
+void minify_enable(void)
+{
+        minify_on = true;
+}
+
+
+bool minify_enabled(void)
+{
+        return minify_on;
+}
+
+
+/* true for the files that are copied minified when minifying */
+bool is_stylesheet(const char* path)
+{
+        size_t len = strlen(path);
+
+        return len >= 4 && strcasecmp(path + len - 4, ".css") == 0;
+}
+
+
+/*
+ * Appends markup, a fixed piece of HTML around the content such as
+ * "\n  <p>\n    ". When minifying, runs of whitespace that hold a newline or
+ * more than one space (the indentation) are left out; single spaces are
+ * kept, as they may separate words.
+ */
+void buf_put_markup(Buf* out, const char* markup)
+{
+        const char* p = markup;
+
+        if (!minify_on) {
+                buf_puts(out, markup);
+                return;
+        }
+
+        while (*p) {
+                const char* run = p;
+                const char* space;
+
+                while (*p && *p != ' ' && *p != '\n')
+                        p++;
+                buf_append(out, run, p - run);
+                for (space = p; *p == ' ' || *p == '\n'; p++)
+                        ;
+                if (p - space == 1 && *space == ' ')
+                        buf_putc(out, ' ');
+        }
+}
+
+
+/*
+ * Minifies a layout in place: whitespace with a line break in it is removed
+ * where it only separates tags and {{slots}}. Everything else, and the
+ * contents of <pre>, <textarea>, <script> and <style>, is kept.
+ */
+void minify_layout(char* source)
+{
+        const char* p = source;
+        char* out = source;
+
+        while (*p) {
+                const char* raw_end = *p == '<' ? raw_text_end(p) : NULL;
+                const char* ws;
+                bool newline = false;
+
+                if (raw_end) {
+                        memmove(out, p, raw_end - p);
+                        out += raw_end - p;
+                        p = raw_end;
+                        continue;
+                }
+                if (*p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') {
+                        *out++ = *p++;
+                        continue;
+                }
+
+                for (ws = p; *p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'; p++)
+                        newline = newline || *p == '\n';
+                if (newline
+                    && (out == source || out[-1] == '>' || (out - source >= 2 && memcmp(out - 2, "}}", 2) == 0))
+                    && (*p == '\0' || *p == '<' || strncmp(p, "{{", 2) == 0))
+                        continue;
+                memmove(out, ws, p - ws);
+                out += p - ws;
+        }
+        *out = '\0';
+}
+
+
+/* where the text of the raw text element opened at p ends, or NULL if p opens none */
+static const char* raw_text_end(const char* p)
+{
+        size_t i;
+
+        for (i = 0; i < sizeof(raw_elements) / sizeof(raw_elements[0]); i++) {
+                size_t len = strlen(raw_elements[i][0]);
+                const char* close;
+
+                if (strncasecmp(p, raw_elements[i][0], len) != 0
+                    || (p[len] != '>' && p[len] != ' ' && p[len] != '\t' && p[len] != '\n'))
+                        continue;
+
+                /* the closing tag itself is minified like any other */
+                len = strlen(raw_elements[i][1]);
+                for (close = p + 1; *close; close++) {
+                        if (*close == '<' && strncasecmp(close, raw_elements[i][1], len) == 0)
+                                return close;
+                }
+                return close;
+        }
+        return NULL;
+}
+
+
+void css_minify_init(CssMinifier* m)
+{
+        memset(m, 0, sizeof(*m));
+        m->state = CSS_TEXT;
+}
+
+
+/*
+ * Appends the minified form of the next len bytes of a stylesheet to out.
+ * The stylesheet may be passed in pieces of any size; comments are removed,
+ * whitespace is collapsed and dropped next to { } ; , > : ( ), and the last
+ * semicolon in a block is left out. Strings are copied as they are.
+ */
+void css_minify(CssMinifier* m, Buf* out, const char* data, size_t len)
+{
+        const char* end = data + len;
+        const char* p;
+
+        for (p = data; p < end; p++) {
+                char c = *p;
+
+                switch (m->state) {
+                case CSS_STRING:
+                        buf_putc(out, c);
+                        if (m->escape)
+                                m->escape = false;
+                        else if (c == '\\')
+                                m->escape = true;
+                        else if (c == m->quote)
+                                m->state = CSS_TEXT;
+                        break;
+                case CSS_COMMENT:
+                        if (m->star && c == '/')
+                                m->state = CSS_TEXT;
+                        m->star = c == '*';
+                        break;
+                default:
+                        if (m->slash) {
+                                m->slash = false;
+                                if (c == '*') {
+                                        /* a comment separates like whitespace */
+                                        m->state = CSS_COMMENT;
+                                        m->star = false;
+                                        m->space = true;
+                                        break;
+                                }
+                                css_put(m, out, '/');
+                        }
+                        if (c == '/')
+                                m->slash = true;
+                        else if (c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\f')
+                                m->space = true;
+                        else
+                                css_put(m, out, c);
+                        break;
+                }
+        }
+}
+
+
+/* appends what css_minify() held back at the end of the stylesheet */
+void css_minify_finish(CssMinifier* m, Buf* out)
+{
+        if (m->state == CSS_TEXT && m->slash)
+                css_put(m, out, '/');
+        if (m->semicolon)
+                buf_putc(out, ';');
+        css_minify_init(m);
+}
+
+
+/* writes c, outside of strings and comments, with the space or semicolon before it that is needed */
+static void css_put(CssMinifier* m, Buf* out, char c)
+{
+        if (m->semicolon) {
+                m->semicolon = false;
+                if (c != '}') {
+                        buf_putc(out, ';');
+                        m->last = ';';
+                }
+        }
+        if (m->space) {
+                m->space = false;
+                if (m->last != '\0' && strchr("{};,>(:", m->last) == NULL && (c == '\0' || strchr("{};,>)", c) == NULL))
+                        buf_putc(out, ' ');
+        }
+
+        if (c == ';') {
+                m->semicolon = true;
+                return;
+        }
+        buf_putc(out, c);
+        m->last = c;
+        if (c == '"' || c == '\'') {
+                m->state = CSS_STRING;
+                m->quote = c;
+                m->escape = false;
+        }
+}
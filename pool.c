@@ -0,0 +1,105 @@
+/*
+ * File: pool.c
+ * ------------
+ * A minimal worker pool. pool_run() hands out the indices [0, count) to a
+ * fixed number of threads and returns once every index has been processed.
+ * Console output from workers should be wrapped in console_lock() and
+ * console_unlock() so that messages belonging to one file stay together.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "txt2web.h"
+
+typedef struct {
+        PoolFunc fn;
+        void* arg;
+        size_t count;
+        size_t next;
+        pthread_mutex_t lock;
+} Pool;
+
+static void* pool_worker(void* arg);
+
+static pthread_mutex_t console_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+int pool_default_jobs(void)
+{
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        return cores > 0 ? (int) cores : 1;
+}
+
+
+void pool_run(int jobs, size_t count, PoolFunc fn, void* arg)
+{
+        Pool pool;
+        pthread_t* threads;
+        int started = 0;
+        int i;
+
+        if (jobs > (int) count)
+                jobs = (int) count;
+
+        if (jobs <= 1) {
+                size_t n;
+                for (n = 0; n < count; n++)
+                        fn(arg, n);
+                return;
+        }
+
+        pool.fn = fn;
+        pool.arg = arg;
+        pool.count = count;
+        pool.next = 0;
+        pthread_mutex_init(&pool.lock, NULL);
+
+        /* the calling thread is one of the workers */
+        threads = malloc((jobs - 1) * sizeof(pthread_t));
+        for (i = 0; threads != NULL && i < jobs - 1; i++) {
+                if (pthread_create(&threads[i], NULL, pool_worker, &pool) != 0)
+                        break;
+                started++;
+        }
+        pool_worker(&pool);
+
+        for (i = 0; i < started; i++)
+                pthread_join(threads[i], NULL);
+
+        free(threads);
+        pthread_mutex_destroy(&pool.lock);
+}
+
+
+void console_lock(void)
+{
+        pthread_mutex_lock(&console_mutex);
+}
+
+
+void console_unlock(void)
+{
+        fflush(stdout);
+        fflush(stderr);
+        pthread_mutex_unlock(&console_mutex);
+}
+
+
+static void* pool_worker(void* arg)
+{
+        Pool* pool = arg;
+        size_t i;
+
+        for (;;) {
+                pthread_mutex_lock(&pool->lock);
+                i = pool->next++;
+                pthread_mutex_unlock(&pool->lock);
+
+                if (i >= pool->count)
+                        break;
+                pool->fn(pool->arg, i);
+        }
+        return NULL;
+}
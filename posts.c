@@ -0,0 +1,112 @@
+/*
+ * File: posts.c
+ * -------------
+ * Growable table of posts. The date sort key of every post is kept in its
+ * own contiguous array together with the post's index, so sorting only moves
+ * small keys around instead of whole Post structs. The keys are sorted with
+ * a least significant byte first radix sort, which is stable, so posts with
+ * the same date keep the order they were added in.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "txt2web.h"
+
+static size_t sort_byte(const PostKey* key, int shift);
+
+
+Post* post_table_add(PostTable* t, const Post* post)
+{
+        if (t->count == t->cap) {
+                t->cap = t->cap ? t->cap * 2 : 256;
+                t->posts = realloc(t->posts, t->cap * sizeof(Post));
+                t->keys = realloc(t->keys, t->cap * sizeof(PostKey));
+                if (t->posts == NULL || t->keys == NULL) {
+                        fprintf(stderr, "ERROR: Out of memory while adding posts\n");
+                        abort();
+                }
+        }
+
+        t->posts[t->count] = *post;
+        t->keys[t->count].date = post->date;
+        t->keys[t->count].index = t->count;
+        return &t->posts[t->count++];
+}
+
+
+/* sorts newest first; post_table_get() then walks the posts in that order */
+void post_table_sort(PostTable* t)
+{
+        PostKey* tmp;
+        PostKey* from = t->keys;
+        PostKey* to;
+        size_t counts[256];
+        size_t i;
+        int shift;
+
+        if (t->count < 2)
+                return;
+        tmp = malloc(t->count * sizeof(PostKey));
+        if (tmp == NULL) {
+                fprintf(stderr, "ERROR: Out of memory while sorting posts\n");
+                abort();
+        }
+        to = tmp;
+
+        for (shift = 0; shift < (int) sizeof(unsigned long) * 8; shift += 8) {
+                size_t first = sort_byte(&from[0], shift);
+                size_t pos = 0;
+
+                memset(counts, 0, sizeof(counts));
+                for (i = 0; i < t->count; i++)
+                        counts[sort_byte(&from[i], shift)]++;
+                /* the dates of a site rarely differ in their high bytes */
+                if (counts[first] == t->count)
+                        continue;
+
+                for (i = 0; i < 256; i++) {
+                        size_t n = counts[i];
+                        counts[i] = pos;
+                        pos += n;
+                }
+                for (i = 0; i < t->count; i++)
+                        to[counts[sort_byte(&from[i], shift)]++] = from[i];
+
+                to = from;
+                from = from == tmp ? t->keys : tmp;
+        }
+
+        if (from != t->keys)
+                memcpy(t->keys, from, t->count * sizeof(PostKey));
+        free(tmp);
+}
+
+
+Post* post_table_get(const PostTable* t, size_t i)
+{
+        return &t->posts[t->keys[i].index];
+}
+
+
+void post_table_free(PostTable* t)
+{
+        free(t->posts);
+        free(t->keys);
+        t->posts = NULL;
+        t->keys = NULL;
+        t->count = 0;
+        t->cap = 0;
+}
+
+
+/*
+ * Byte of the sort key at shift. Flipping the sign bit makes the date sort
+ * as an unsigned number, and inverting all of it puts the newest post first.
+ */
+static size_t sort_byte(const PostKey* key, int shift)
+{
+        unsigned long k = (unsigned long) key->date ^ (1UL << (sizeof(unsigned long) * 8 - 1));
+
+        return (~k >> shift) & 0xff;
+}
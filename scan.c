@@ -0,0 +1,203 @@
+/*
+ * File: scan.c
+ * ------------
+ * Character class scanner for the renderer: scan_next() finds the first
+ * byte in [p, end) that is one of a few characters (a ScanClass), so a line
+ * can be walked from one interesting byte to the next and the text between
+ * them copied in one piece.
+ *
+ * On x86 the bytes are compared 16 (SSE2) or 32 (AVX2) at a time; which
+ * version runs is decided from what the CPU supports when the program
+ * starts, before any thread can scan. Elsewhere, and for the last few bytes
+ * of a line, a plain loop is used.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define SCAN_X86 1
+#include <immintrin.h>
+#else
+#define SCAN_X86 0
+#endif
+
+#include "txt2web.h"
+
+#define SCAN_TABLE_MIN 256       /* bytes left from which scan_scalar() builds a lookup table */
+
+typedef const char* (*ScanFunc)(const ScanClass* c, const char* p, const char* end);
+
+static void scan_select(void) __attribute__((constructor));
+static const char* scan_scalar(const ScanClass* c, const char* p, const char* end);
+static const char* scan_table(const ScanClass* c, const char* p, const char* end);
+#if SCAN_X86
+static const char* scan_sse2(const ScanClass* c, const char* p, const char* end);
+static const char* scan_avx2(const ScanClass* c, const char* p, const char* end);
+#endif
+
+static const char* level_names[] = { "scalar", "sse2", "avx2" };
+
+/* the best version, set by scan_select() at startup */
+static ScanFunc scan_func = scan_scalar;
+static ScanLevel scan_level = SCAN_SCALAR;
+
+
+/* the first byte in [p, end) that belongs to c, or end */
+const char* scan_next(const ScanClass* c, const char* p, const char* end)
+{
+        return scan_func(c, p, end);
+}
+
+
+/*
+ * Uses level from now on, if the CPU supports it. For comparing the versions
+ * (see bench/bench.c); not to be called while other threads are scanning.
+ */
+bool scan_set_level(ScanLevel level)
+{
+        switch (level) {
+        case SCAN_SCALAR:
+                scan_func = scan_scalar;
+                break;
+#if SCAN_X86
+        case SCAN_SSE2:
+                scan_func = scan_sse2;
+                break;
+        case SCAN_AVX2:
+                if (!__builtin_cpu_supports("avx2"))
+                        return false;
+                scan_func = scan_avx2;
+                break;
+#endif
+        default:
+                return false;
+        }
+        scan_level = level;
+        return true;
+}
+
+
+/* name of the version in use, for messages */
+const char* scan_level_name(void)
+{
+        return level_names[scan_level];
+}
+
+
+/* runs before main(), or when the library is loaded */
+static void scan_select(void)
+{
+#if SCAN_X86
+        /* needed before __builtin_cpu_supports() in a constructor */
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+                scan_func = scan_avx2;
+                scan_level = SCAN_AVX2;
+        }
+        else {
+                scan_func = scan_sse2;
+                scan_level = SCAN_SSE2;
+        }
+#else
+        scan_func = scan_scalar;
+        scan_level = SCAN_SCALAR;
+#endif
+}
+
+
+/*
+ * Also the tail of the vector versions, where only a few bytes are left:
+ * the chars of c are compared directly, padded with the first one to 4 or
+ * 8. A lookup table only pays for itself on long runs.
+ */
+static const char* scan_scalar(const ScanClass* c, const char* p, const char* end)
+{
+        char w[SCAN_MAX_CHARS];
+        size_t i;
+
+        if (end - p >= SCAN_TABLE_MIN)
+                return scan_table(c, p, end);
+        for (i = 0; i < SCAN_MAX_CHARS; i++)
+                w[i] = c->chars[i < c->count ? i : 0];
+
+        if (c->count <= 4) {
+                for (; p < end; p++) {
+                        if (*p == w[0] || *p == w[1] || *p == w[2] || *p == w[3])
+                                return p;
+                }
+                return end;
+        }
+        for (; p < end; p++) {
+                if (*p == w[0] || *p == w[1] || *p == w[2] || *p == w[3]
+                    || *p == w[4] || *p == w[5] || *p == w[6] || *p == w[7])
+                        return p;
+        }
+        return end;
+}
+
+
+static const char* scan_table(const ScanClass* c, const char* p, const char* end)
+{
+        unsigned char wanted[256];
+        size_t i;
+
+        memset(wanted, 0, sizeof(wanted));
+        for (i = 0; i < c->count; i++)
+                wanted[(unsigned char) c->chars[i]] = 1;
+        for (; p < end; p++) {
+                if (wanted[(unsigned char) *p])
+                        return p;
+        }
+        return end;
+}
+
+
+#if SCAN_X86
+static const char* scan_sse2(const ScanClass* c, const char* p, const char* end)
+{
+        __m128i wanted[SCAN_MAX_CHARS];
+        size_t i;
+
+        for (i = 0; i < c->count; i++)
+                wanted[i] = _mm_set1_epi8(c->chars[i]);
+
+        for (; end - p >= 16; p += 16) {
+                __m128i bytes = _mm_loadu_si128((const __m128i*) (const void*) p);
+                __m128i hits = _mm_cmpeq_epi8(bytes, wanted[0]);
+                int mask;
+
+                for (i = 1; i < c->count; i++)
+                        hits = _mm_or_si128(hits, _mm_cmpeq_epi8(bytes, wanted[i]));
+                mask = _mm_movemask_epi8(hits);
+                if (mask)
+                        return p + __builtin_ctz(mask);
+        }
+        return scan_scalar(c, p, end);
+}
+
+
+__attribute__((target("avx2")))
+static const char* scan_avx2(const ScanClass* c, const char* p, const char* end)
+{
+        __m256i wanted[SCAN_MAX_CHARS];
+        size_t i;
+
+        for (i = 0; i < c->count; i++)
+                wanted[i] = _mm256_set1_epi8(c->chars[i]);
+
+        for (; end - p >= 32; p += 32) {
+                __m256i bytes = _mm256_loadu_si256((const __m256i*) (const void*) p);
+                __m256i hits = _mm256_cmpeq_epi8(bytes, wanted[0]);
+                unsigned int mask;
+
+                for (i = 1; i < c->count; i++)
+                        hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(bytes, wanted[i]));
+                mask = (unsigned int) _mm256_movemask_epi8(hits);
+                if (mask)
+                        return p + __builtin_ctz(mask);
+        }
+        /* gcc leaves this out before a tail call; without it every SSE instruction after is slow */
+        _mm256_zeroupper();
+        return scan_sse2(c, p, end);
+}
+#endif
@@ -0,0 +1,559 @@
+/*
+ * File: search.c
+ * --------------
+ * Full-text search index (-s). While a post is rendered, the words of its
+ * headings and paragraphs and of its title, description and tags are
+ * collected into a SearchTerms set; the space separated result is kept
+ * with the rest of the post's metadata (Post.terms), so the manifest and
+ * the render cache carry it for the posts that are not rendered again.
+ *
+ * search_write() inverts the terms of all posts into build->dir/search/:
+ *
+ *     docs.json       [url, title, date] of every post, newest first; a
+ *                     post's number in the index is its place in this list
+ *     a.bin ... _.bin the index, one file per first letter of the terms
+ *                     (0-9, a-z, and _ for everything else), so a browser
+ *                     only fetches the files its query needs
+ *     search.js       the lookup script
+ *
+ * An index file is "T2WS", a version byte, the number of terms and then,
+ * for every term in sorted order, the length it shares with the previous
+ * term, the rest of the term, the number of posts it occurs in and those
+ * posts' numbers, each as the difference from the one before. All numbers
+ * are LEB128 varints.
+ */
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "txt2web.h"
+
+#define SEARCH_MAGIC "T2WS"
+#define SEARCH_VERSION 1
+#define SEARCH_MIN_CHARS 2      /* shorter words are not indexed */
+#define SEARCH_MAX_TERM 64      /* nor longer ones, in bytes */
+
+/* ASCII letters and digits and all of UTF-8 beyond ASCII; no locale lookup */
+#define IS_WORD_BYTE(c) ((unsigned char) (((c) | 0x20) - 'a') < 26 || (unsigned char) ((c) - '0') < 10 \
+                         || ((c) & 0x80))
+
+/* the posts one term occurs in */
+typedef struct {
+        const char* term;
+        size_t* ids;
+        size_t count;
+        size_t cap;
+} SearchEntry;
+
+static void add_term(SearchTerms* t, const char* word, size_t len);
+static size_t* find_slot(const SearchTerms* t, const char* term, size_t len, unsigned long hash);
+static size_t* find_entry(size_t* slots, size_t cap, const SearchEntry* entries, const char* term);
+static int compare_entries(const void* a, const void* b);
+static char shard_of(const char* term);
+static void put_varint(Buf* out, unsigned long n);
+static void json_escape(Buf* out, const char* str);
+static bool search_commit(Build* build, const char* name, Buf* out);
+
+static bool search_on = false;
+
+/* ES5, so that it runs as it is in every browser that has fetch() */
+static const char* search_script[] = {
+        "/* txt2web search: txt2webSearch(query) resolves to the posts that contain",
+        "   every word of query (the last one may be the start of a word), newest first.",
+        "   A page with <input id='search'> and <ul id='search-results'> is wired up. */",
+        "(function () {",
+        "  var base = document.currentScript.src.replace(/[^\\/]*$/, '');",
+        "  var root = base.replace(/search\\/$/, '');",
+        "  var shards = {};",
+        "  var docs = null;",
+        "",
+        "  function words(query) {",
+        "    return query.replace(/[A-Z]/g, function (c) { return c.toLowerCase(); })",
+        "      .split(/[^a-z0-9\\u0080-\\uffff]+/).filter(function (w) { return w.length >= 2; });",
+        "  }",
+        "",
+        "  function shard(term) {",
+        "    var c = term.charAt(0);",
+        "    return /[a-z0-9]/.test(c) ? c : '_';",
+        "  }",
+        "",
+        "  function decode(bytes) {",
+        "    var terms = [];",
+        "    var pos = 5;",
+        "    var prev = new Uint8Array(0);",
+        "    var text = new TextDecoder();",
+        "    var count, i, j, shared, len, term, n, id, ids;",
+        "    function varint() {",
+        "      var value = 0, scale = 1, b;",
+        "      do { b = bytes[pos++]; value += (b & 127) * scale; scale *= 128; } while (b & 128);",
+        "      return value;",
+        "    }",
+        "    if (bytes.length < 5 || text.decode(bytes.subarray(0, 4)) !== 'T2WS' || bytes[4] !== 1)",
+        "      return terms;",
+        "    count = varint();",
+        "    for (i = 0; i < count; i++) {",
+        "      shared = varint();",
+        "      len = varint();",
+        "      term = new Uint8Array(shared + len);",
+        "      term.set(prev.subarray(0, shared));",
+        "      term.set(bytes.subarray(pos, pos + len), shared);",
+        "      pos += len;",
+        "      n = varint();",
+        "      ids = [];",
+        "      for (j = 0, id = 0; j < n; j++) { id += varint(); ids.push(id); }",
+        "      terms.push({ term: text.decode(term), ids: ids });",
+        "      prev = term;",
+        "    }",
+        "    return terms;",
+        "  }",
+        "",
+        "  function load(name) {",
+        "    if (!shards[name])",
+        "      shards[name] = fetch(base + name + '.bin')",
+        "        .then(function (r) { return r.ok ? r.arrayBuffer() : new ArrayBuffer(0); })",
+        "        .then(function (b) { return decode(new Uint8Array(b)); });",
+        "    return shards[name];",
+        "  }",
+        "",
+        "  /* the posts of word, or of every term starting with it */",
+        "  function lookup(word, prefix) {",
+        "    return load(shard(word)).then(function (terms) {",
+        "      var seen = {}, ids = [];",
+        "      terms.forEach(function (t) {",
+        "        if (t.term === word || (prefix && t.term.lastIndexOf(word, 0) === 0))",
+        "          t.ids.forEach(function (id) { if (!seen[id]) { seen[id] = true; ids.push(id); } });",
+        "      });",
+        "      return ids.sort(function (a, b) { return a - b; });",
+        "    });",
+        "  }",
+        "",
+        "  window.txt2webSearch = function (query) {",
+        "    var list = words(query);",
+        "    if (!docs)",
+        "      docs = fetch(base + 'docs.json').then(function (r) { return r.json(); });",
+        "    return Promise.all([docs].concat(list.map(function (w, i) {",
+        "      return lookup(w, i === list.length - 1);",
+        "    }))).then(function (found) {",
+        "      var all = found.shift();",
+        "      var ids = found.length ? found.reduce(function (a, b) {",
+        "        return a.filter(function (id) { return b.indexOf(id) >= 0; });",
+        "      }) : [];",
+        "      return ids.map(function (id) {",
+        "        return { url: root + all[id][0], title: all[id][1], date: all[id][2] };",
+        "      });",
+        "    });",
+        "  };",
+        "",
+        "  document.addEventListener('DOMContentLoaded', function () {",
+        "    var input = document.getElementById('search');",
+        "    var results = document.getElementById('search-results');",
+        "    if (!input || !results)",
+        "      return;",
+        "    input.addEventListener('input', function () {",
+        "      var query = input.value;",
+        "      window.txt2webSearch(query).then(function (posts) {",
+        "        if (query !== input.value)",
+        "          return;",
+        "        results.innerHTML = '';",
+        "        posts.forEach(function (post) {",
+        "          var li = document.createElement('li');",
+        "          var a = document.createElement('a');",
+        "          a.href = post.url;",
+        "          a.textContent = post.title;",
+        "          li.textContent = (post.date || '') + ' - ';",
+        "          li.appendChild(a);",
+        "          results.appendChild(li);",
+        "        });",
+        "      });",
+        "    });",
+        "  });",
+        "})();",
+        NULL
+};
+
+
+/* collect terms while rendering and write build->dir/search/ */
+void search_enable(void)
+{
+        search_on = true;
+}
+
+
+bool search_enabled(void)
+{
+        return search_on;
+}
+
+
+/*
+ * Adds the words of [str, str + len) to t: runs of ASCII letters and digits
+ * and of UTF-8 bytes, with ASCII lowercased. URLs, HTML tags and known
+ * placeholders ({title}, {date}) are skipped; post may be NULL.
+ */
+void search_terms_add(SearchTerms* t, const char* str, size_t len, const Post* post)
+{
+        const char* end = str + len;
+        const char* p = str;
+        size_t key_len;
+
+        while (p < end) {
+                const char* start = p;
+
+                if (*p == '<' && p + 1 < end && (isalpha((unsigned char) p[1]) || p[1] == '/')) {
+                        p = memchr(p, '>', end - p);
+                        p = p ? p + 1 : end;
+                }
+                else if (*p == '{' && post && placeholder_value(p, end - p, post, &key_len)) {
+                        p += key_len;
+                }
+                else if (*p == 'h' && str_is_url(p, end - p)) {
+                        while (p < end && !isspace((unsigned char) *p))
+                                p++;
+                }
+                else if (IS_WORD_BYTE(*p)) {
+                        while (p < end && IS_WORD_BYTE(*p))
+                                p++;
+                        add_term(t, start, p - start);
+                }
+                else {
+                        p++;
+                }
+        }
+}
+
+
+/*
+ * The terms of t, in the order they first occur and separated by spaces, in
+ * strings; NULL when there are none. search_write() sorts what it needs to.
+ */
+char* search_terms_join(const SearchTerms* t, Arena* strings)
+{
+        char* result;
+        size_t i;
+
+        if (t->count == 0)
+                return NULL;
+
+        /* every term is followed by a '\0' in text, which becomes a space or the end */
+        result = arena_alloc(strings, t->text.len);
+        memcpy(result, t->text.data, t->text.len);
+        for (i = 0; i < t->text.len - 1; i++) {
+                if (result[i] == '\0')
+                        result[i] = ' ';
+        }
+        return result;
+}
+
+
+void search_terms_free(SearchTerms* t)
+{
+        buf_free(&t->text);
+        free(t->slots);
+        memset(t, 0, sizeof(*t));
+}
+
+
+/*
+ * Writes the search index of posts (sorted, newest first) into
+ * build->dir/search/ and records every file as a generated page.
+ */
+bool search_write(Build* build, const PostTable* posts)
+{
+        Arena words;
+        SearchEntry* entries = NULL;
+        size_t entry_count = 0;
+        size_t entry_cap = 0;
+        size_t* slots = NULL;   /* entry index + 1 by term, 0 when empty */
+        size_t slot_cap = 0;
+        Buf out = { 0 };
+        char* dir = path_join(build->dir, "search");
+        bool ok = true;
+        size_t i;
+        size_t j;
+
+        mkdir(dir, 0755);
+        arena_init(&words);
+
+        /* term -> posts; the posts come in order, so every list is sorted */
+        for (i = 0; i < posts->count; i++) {
+                const Post* post = post_table_get(posts, i);
+                char* term;
+                char* next;
+
+                if (post->terms == NULL || *post->terms == '\0')
+                        continue;
+
+                for (term = arena_strdup(&words, post->terms); term; term = next) {
+                        SearchEntry* e;
+                        size_t* slot;
+
+                        if ((next = strchr(term, ' ')) != NULL)
+                                *next++ = '\0';
+
+                        if ((entry_count + 1) * 3 >= slot_cap * 2) {
+                                size_t* old = slots;
+                                size_t old_cap = slot_cap;
+
+                                slot_cap = slot_cap ? slot_cap * 2 : 4096;
+                                slots = calloc(slot_cap, sizeof(size_t));
+                                if (slots == NULL) {
+                                        fprintf(stderr, "ERROR: Out of memory while writing the search index\n");
+                                        abort();
+                                }
+                                for (j = 0; j < old_cap; j++) {
+                                        if (old[j])
+                                                *find_entry(slots, slot_cap, entries, entries[old[j] - 1].term) = old[j];
+                                }
+                                free(old);
+                        }
+
+                        slot = find_entry(slots, slot_cap, entries, term);
+                        if (*slot == 0) {
+                                if (entry_count == entry_cap) {
+                                        entry_cap = entry_cap ? entry_cap * 2 : 1024;
+                                        entries = realloc(entries, entry_cap * sizeof(SearchEntry));
+                                        if (entries == NULL) {
+                                                fprintf(stderr, "ERROR: Out of memory while writing the search index\n");
+                                                abort();
+                                        }
+                                }
+                                memset(&entries[entry_count], 0, sizeof(SearchEntry));
+                                entries[entry_count].term = term;
+                                *slot = ++entry_count;
+                        }
+
+                        e = &entries[*slot - 1];
+                        if (e->count == e->cap) {
+                                e->cap = e->cap ? e->cap * 2 : 4;
+                                e->ids = realloc(e->ids, e->cap * sizeof(size_t));
+                                if (e->ids == NULL) {
+                                        fprintf(stderr, "ERROR: Out of memory while writing the search index\n");
+                                        abort();
+                                }
+                        }
+                        e->ids[e->count++] = i;
+                }
+        }
+        free(slots);
+
+        /* sorted, the terms of one index file are next to each other */
+        if (entry_count)
+                qsort(entries, entry_count, sizeof(SearchEntry), compare_entries);
+
+        for (i = 0; i < entry_count && ok; i = j) {
+                char shard = shard_of(entries[i].term);
+                char name[16];
+                const char* prev = "";
+                size_t k;
+
+                for (j = i; j < entry_count && shard_of(entries[j].term) == shard; j++)
+                        ;
+
+                buf_puts(&out, SEARCH_MAGIC);
+                buf_putc(&out, SEARCH_VERSION);
+                put_varint(&out, j - i);
+                for (k = i; k < j; k++) {
+                        const char* term = entries[k].term;
+                        size_t shared = 0;
+                        size_t len = strlen(term);
+                        size_t n;
+
+                        while (prev[shared] && prev[shared] == term[shared])
+                                shared++;
+                        put_varint(&out, shared);
+                        put_varint(&out, len - shared);
+                        buf_append(&out, term + shared, len - shared);
+                        put_varint(&out, entries[k].count);
+                        for (n = 0; n < entries[k].count; n++)
+                                put_varint(&out, entries[k].ids[n] - (n ? entries[k].ids[n - 1] : 0));
+                        prev = term;
+                }
+                sprintf(name, "%c.bin", shard);
+                ok = search_commit(build, name, &out);
+        }
+
+        buf_puts(&out, "[\n");
+        for (i = 0; i < posts->count && ok; i++) {
+                const Post* post = post_table_get(posts, i);
+
+                buf_puts(&out, "[\"posts/");
+                json_escape(&out, post->filename);
+                buf_puts(&out, ".html\",\"");
+                json_escape(&out, post->title);
+                buf_puts(&out, "\",\"");
+                json_escape(&out, post->date_str);
+                buf_puts(&out, i + 1 < posts->count ? "\"],\n" : "\"]\n");
+        }
+        buf_puts(&out, "]\n");
+        ok = ok && search_commit(build, "docs.json", &out);
+
+        for (i = 0; search_script[i]; i++) {
+                buf_puts(&out, search_script[i]);
+                buf_putc(&out, '\n');
+        }
+        ok = ok && search_commit(build, "search.js", &out);
+
+        for (i = 0; i < entry_count; i++)
+                free(entries[i].ids);
+        free(entries);
+        buf_free(&out);
+        arena_free(&words);
+        free(dir);
+        return ok;
+}
+
+
+static void add_term(SearchTerms* t, const char* word, size_t len)
+{
+        char term[SEARCH_MAX_TERM];
+        unsigned long hash;
+        size_t chars = 0;
+        size_t* slot;
+        size_t i;
+
+        if (len > SEARCH_MAX_TERM)
+                return;
+        for (i = 0; i < len; i++) {
+                unsigned char c = (unsigned char) word[i];
+
+                term[i] = (char) ((unsigned char) (c - 'A') < 26 ? c + ('a' - 'A') : c);
+                /* UTF-8 continuation bytes do not start a character */
+                if ((c & 0xc0) != 0x80)
+                        chars++;
+        }
+        if (chars < SEARCH_MIN_CHARS)
+                return;
+        hash = hash_bytes(HASH_INIT, term, len);
+
+        if ((t->count + 1) * 3 >= t->cap * 2) {
+                size_t* old = t->slots;
+                size_t old_cap = t->cap;
+
+                t->cap = t->cap ? t->cap * 2 : 1024;
+                t->slots = calloc(t->cap, sizeof(size_t));
+                if (t->slots == NULL) {
+                        fprintf(stderr, "ERROR: Out of memory while collecting search terms\n");
+                        abort();
+                }
+                for (i = 0; i < old_cap; i++) {
+                        if (old[i]) {
+                                const char* key = t->text.data + old[i] - 1;
+                                size_t key_len = strlen(key);
+
+                                *find_slot(t, key, key_len, hash_bytes(HASH_INIT, key, key_len)) = old[i];
+                        }
+                }
+                free(old);
+        }
+
+        slot = find_slot(t, term, len, hash);
+        if (*slot)
+                return;
+        *slot = t->text.len + 1;
+        buf_append(&t->text, term, len);
+        buf_putc(&t->text, '\0');
+        t->count++;
+}
+
+
+/*
+ * The slot of term (whose hash_bytes() is hash) in the open addressing table
+ * of t (slots hold an offset + 1 into t->text), or the empty slot where it
+ * belongs.
+ */
+static size_t* find_slot(const SearchTerms* t, const char* term, size_t len, unsigned long hash)
+{
+        size_t i = hash & (t->cap - 1);
+
+        for (;; i = (i + 1) & (t->cap - 1)) {
+                const char* key;
+
+                if (t->slots[i] == 0)
+                        return &t->slots[i];
+                key = t->text.data + t->slots[i] - 1;
+                if (strncmp(key, term, len) == 0 && key[len] == '\0')
+                        return &t->slots[i];
+        }
+}
+
+
+/* the same for a table of SearchEntry index + 1 */
+static size_t* find_entry(size_t* slots, size_t cap, const SearchEntry* entries, const char* term)
+{
+        size_t i = hash_str(HASH_INIT, term) & (cap - 1);
+
+        for (;; i = (i + 1) & (cap - 1)) {
+                if (slots[i] == 0 || strcmp(entries[slots[i] - 1].term, term) == 0)
+                        return &slots[i];
+        }
+}
+
+
+static int compare_entries(const void* a, const void* b)
+{
+        return strcmp(((const SearchEntry*) a)->term, ((const SearchEntry*) b)->term);
+}
+
+
+/* the index file of a term: its first letter or digit, '_' for the rest */
+static char shard_of(const char* term)
+{
+        return isalnum((unsigned char) *term) ? *term : '_';
+}
+
+
+static void put_varint(Buf* out, unsigned long n)
+{
+        while (n >= 0x80) {
+                buf_putc(out, (char) (n & 0x7f) | (char) 0x80);
+                n >>= 7;
+        }
+        buf_putc(out, (char) n);
+}
+
+
+static void json_escape(Buf* out, const char* str)
+{
+        char code[8];
+
+        if (str == NULL)
+                return;
+
+        for (; *str; str++) {
+                unsigned char c = (unsigned char) *str;
+
+                if (c == '"' || c == '\\') {
+                        buf_putc(out, '\\');
+                        buf_putc(out, *str);
+                }
+                else if (c < 0x20) {
+                        sprintf(code, "\\u%04x", c);
+                        buf_puts(out, code);
+                }
+                else {
+                        buf_putc(out, *str);
+                }
+        }
+}
+
+
+/* writes out to build->dir/search/name, records it and empties out */
+static bool search_commit(Build* build, const char* name, Buf* out)
+{
+        char* path = str_printf("%s/search/%s", build->dir, name);
+        struct stat none = { 0 };
+        unsigned long hash = hash_bytes(HASH_INIT, out->data, out->len);
+        char* tmp;
+        FILE* f = output_open(path, &tmp);
+        bool ok = f != NULL && output_commit(f, path, tmp, buf_flush(out, f));
+
+        if (ok)
+                manifest_add(&build->next, 'G', path, path, &none, hash);
+        else
+                fprintf(stderr, "ERROR: Could not write to file: %s\n", path);
+        buf_clear(out);
+        free(path);
+        return ok;
+}
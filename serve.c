@@ -0,0 +1,424 @@
+/*
+ * File: serve.c
+ * -------------
+ * A small HTTP server for previewing the build directory on localhost while
+ * --watch is running. It is driven by the watch loop's poll() (see watch.c):
+ * connections are read without blocking as their requests arrive, so a
+ * browser that opens a connection and sends nothing on it (to have one ready
+ * for later) holds up neither other requests nor rebuilds. A request is
+ * answered once it is complete, one at a time, which is plenty for a browser
+ * or two.
+ *
+ * Every HTML page it sends gets a script that listens on RELOAD_PATH, a
+ * server-sent event stream; after each rebuild serve_reload() sends an event
+ * down every open stream and the pages reload themselves.
+ */
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "txt2web.h"
+
+#define RELOAD_PATH "/.txt2web-reload"
+
+typedef struct {
+        const char* ext;
+        const char* type;
+} MimeType;
+
+static void serve_accept(Server* s, int fd);
+static void serve_read(Server* s, ServeRequest* r);
+static void serve_request(Server* s, int fd, char* request);
+static void serve_file(int fd, const char* path, bool head_only);
+static void send_status(int fd, const char* status);
+static bool send_all(int fd, const char* data, size_t len);
+static bool url_decode(char* path);
+static const char* mime_type(const char* path);
+
+static const char reload_script[] =
+        "<script>new EventSource('" RELOAD_PATH "').onmessage = function() { location.reload(); };</script>\n";
+
+static const MimeType mime_types[] = {
+        { ".html", "text/html; charset=utf-8" },
+        { ".css", "text/css" },
+        { ".js", "text/javascript" },
+        { ".mjs", "text/javascript" },
+        { ".json", "application/json" },
+        { ".xml", "application/xml" },
+        { ".txt", "text/plain; charset=utf-8" },
+        { ".svg", "image/svg+xml" },
+        { ".png", "image/png" },
+        { ".jpg", "image/jpeg" },
+        { ".jpeg", "image/jpeg" },
+        { ".gif", "image/gif" },
+        { ".webp", "image/webp" },
+        { ".ico", "image/x-icon" },
+        { ".woff2", "font/woff2" },
+        { ".pdf", "application/pdf" }
+};
+
+
+/* listens on 127.0.0.1:port and serves the files below root */
+bool serve_open(Server* s, const char* root, int port)
+{
+        struct sockaddr_in addr;
+        int one = 1;
+        size_t i;
+
+        memset(s, 0, sizeof(*s));
+        s->root = root;
+        for (i = 0; i < SERVE_MAX_REQUESTS; i++)
+                s->requests[i].fd = -1;
+        s->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+        if (s->listen_fd == -1)
+                return false;
+        setsockopt(s->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(s->listen_fd, (struct sockaddr*) &addr, sizeof(addr)) == -1
+            || listen(s->listen_fd, 16) == -1) {
+                close(s->listen_fd);
+                s->listen_fd = -1;
+                return false;
+        }
+        return true;
+}
+
+
+/*
+ * Fills fds with the sockets to poll: the listening one, the reload streams,
+ * then the connections whose request is still arriving.
+ */
+size_t serve_poll_fds(const Server* s, struct pollfd* fds)
+{
+        size_t n = 1;
+        size_t i;
+
+        fds[0].fd = s->listen_fd;
+        fds[0].events = POLLIN;
+        for (i = 0; i < s->client_count; i++) {
+                fds[n].fd = s->clients[i];
+                fds[n].events = POLLIN;
+                n++;
+        }
+        for (i = 0; i < SERVE_MAX_REQUESTS; i++) {
+                if (s->requests[i].fd == -1)
+                        continue;
+                fds[n].fd = s->requests[i].fd;
+                fds[n].events = POLLIN;
+                n++;
+        }
+        return n;
+}
+
+
+/* handles what poll() reported for the fds filled in by serve_poll_fds() */
+void serve_poll_done(Server* s, const struct pollfd* fds, size_t count)
+{
+        size_t streams = s->client_count;
+        size_t n = 1 + streams;
+        size_t i;
+        size_t kept = 0;
+
+        /* a reload stream never sends anything, so any activity means it closed */
+        for (i = 1; i < 1 + streams && i < count; i++) {
+                if (fds[i].revents)
+                        close(fds[i].fd);
+                else
+                        s->clients[kept++] = fds[i].fd;
+        }
+        s->client_count = kept;
+
+        /* the slots are in the order serve_poll_fds() listed them */
+        for (i = 0; i < SERVE_MAX_REQUESTS && n < count; i++) {
+                if (s->requests[i].fd == -1)
+                        continue;
+                if (fds[n].revents)
+                        serve_read(s, &s->requests[i]);
+                n++;
+        }
+
+        if (fds[0].revents & POLLIN) {
+                int fd;
+
+                while ((fd = accept4(s->listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) != -1)
+                        serve_accept(s, fd);
+        }
+}
+
+
+/* tells every open page to reload */
+void serve_reload(Server* s)
+{
+        static const char event[] = "data: reload\n\n";
+        size_t i;
+        size_t kept = 0;
+
+        for (i = 0; i < s->client_count; i++) {
+                if (send_all(s->clients[i], event, sizeof(event) - 1))
+                        s->clients[kept++] = s->clients[i];
+                else
+                        close(s->clients[i]);
+        }
+        s->client_count = kept;
+}
+
+
+void serve_close(Server* s)
+{
+        size_t i;
+
+        for (i = 0; i < s->client_count; i++)
+                close(s->clients[i]);
+        for (i = 0; i < SERVE_MAX_REQUESTS; i++) {
+                if (s->requests[i].fd != -1)
+                        close(s->requests[i].fd);
+        }
+        if (s->listen_fd != -1)
+                close(s->listen_fd);
+        memset(s, 0, sizeof(*s));
+        s->listen_fd = -1;
+}
+
+
+/* takes the new connection fd into a free slot, dropping the oldest one if there is none */
+static void serve_accept(Server* s, int fd)
+{
+        ServeRequest* r = NULL;
+        size_t i;
+
+        for (i = 0; i < SERVE_MAX_REQUESTS; i++) {
+                ServeRequest* slot = &s->requests[i];
+
+                if (slot->fd == -1) {
+                        r = slot;
+                        break;
+                }
+                if (r == NULL || slot->serial < r->serial)
+                        r = slot;
+        }
+        if (r->fd != -1)
+                close(r->fd);
+
+        r->fd = fd;
+        r->serial = s->serial++;
+        r->len = 0;
+        /* the request usually came with the connection */
+        serve_read(s, r);
+}
+
+
+/*
+ * Reads what has arrived on the connection of r without waiting for more,
+ * and answers the request once it is complete. The slot is freed when the
+ * request was answered or the connection closed.
+ */
+static void serve_read(Server* s, ServeRequest* r)
+{
+        int fd = r->fd;
+
+        for (;;) {
+                ssize_t n = recv(fd, r->data + r->len, sizeof(r->data) - 1 - r->len, 0);
+
+                if (n == -1 && errno == EINTR)
+                        continue;
+                if (n == -1 && errno == EAGAIN)
+                        return;
+                if (n <= 0) {
+                        close(fd);
+                        r->fd = -1;
+                        return;
+                }
+                r->len += n;
+                r->data[r->len] = '\0';
+                if (r->len == sizeof(r->data) - 1 || strstr(r->data, "\r\n\r\n") || strstr(r->data, "\n\n"))
+                        break;
+        }
+
+        r->fd = -1;
+        serve_request(s, fd, r->data);
+}
+
+
+/* answers the request read from fd; fd is closed unless it became a reload stream */
+static void serve_request(Server* s, int fd, char* request)
+{
+        static const char events_header[] =
+                "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\n\r\n";
+        struct timeval timeout = { 2, 0 };
+        char* method;
+        char* path;
+        char* end;
+        char* file;
+        struct stat st;
+        bool head_only;
+
+        /* the answer is written out at once; a client that stops reading it gets cut off */
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        method = request;
+        path = strchr(request, ' ');
+        if (path == NULL) {
+                send_status(fd, "400 Bad Request");
+                close(fd);
+                return;
+        }
+        *path++ = '\0';
+        end = path + strcspn(path, " ?#\r\n");
+        *end = '\0';
+
+        head_only = strcmp(method, "HEAD") == 0;
+        if (!head_only && strcmp(method, "GET") != 0) {
+                send_status(fd, "405 Method Not Allowed");
+                close(fd);
+                return;
+        }
+
+        if (strcmp(path, RELOAD_PATH) == 0 && !head_only && s->client_count < SERVE_MAX_CLIENTS) {
+                if (send_all(fd, events_header, sizeof(events_header) - 1))
+                        s->clients[s->client_count++] = fd;
+                else
+                        close(fd);
+                return;
+        }
+
+        if (*path != '/' || !url_decode(path) || strstr(path, "..")) {
+                send_status(fd, "400 Bad Request");
+                close(fd);
+                return;
+        }
+
+        file = str_printf("%s%s%s", s->root, path, path[strlen(path) - 1] == '/' ? "index.html" : "");
+        if (stat(file, &st) == 0 && S_ISDIR(st.st_mode)) {
+                char* index = path_join(file, "index.html");
+                free(file);
+                file = index;
+        }
+        serve_file(fd, file, head_only);
+        free(file);
+        close(fd);
+}
+
+
+static void serve_file(int fd, const char* path, bool head_only)
+{
+        MappedFile src;
+        const char* type = mime_type(path);
+        bool is_html = strncmp(type, "text/html", 9) == 0;
+        const char* body_end = NULL;
+        size_t before;
+        char* header;
+        bool ok;
+
+        if (!map_file(path, &src)) {
+                send_status(fd, "404 Not Found");
+                return;
+        }
+
+        /* the reload script goes in front of </body>, or at the end without one */
+        before = src.len;
+        if (is_html) {
+                const char* p;
+
+                for (p = src.data; p + 7 <= src.data + src.len; p++) {
+                        if (*p == '<' && strncmp(p, "</body>", 7) == 0)
+                                body_end = p;
+                }
+                if (body_end)
+                        before = body_end - src.data;
+        }
+
+        header = str_printf("HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %lu\r\n"
+                            "Cache-Control: no-store\r\nConnection: close\r\n\r\n",
+                            type, (unsigned long) (src.len + (is_html ? sizeof(reload_script) - 1 : 0)));
+        ok = send_all(fd, header, strlen(header)) && !head_only;
+        if (ok && is_html)
+                ok = send_all(fd, src.data, before) && send_all(fd, reload_script, sizeof(reload_script) - 1);
+        else
+                before = 0;
+        if (ok)
+                send_all(fd, src.data + before, src.len - before);
+        free(header);
+        unmap_file(&src);
+}
+
+
+static void send_status(int fd, const char* status)
+{
+        char* response = str_printf("HTTP/1.1 %s\r\nContent-Type: text/plain\r\nContent-Length: %lu\r\n"
+                                    "Connection: close\r\n\r\n%s\n",
+                                    status, (unsigned long) strlen(status) + 1, status);
+
+        send_all(fd, response, strlen(response));
+        free(response);
+}
+
+
+/* MSG_NOSIGNAL: a browser that went away must not kill the watcher with SIGPIPE */
+static bool send_all(int fd, const char* data, size_t len)
+{
+        while (len > 0) {
+                ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+
+                if (n == -1 && errno == EINTR)
+                        continue;
+                if (n <= 0)
+                        return false;
+                data += n;
+                len -= n;
+        }
+        return true;
+}
+
+
+/* decodes %XX escapes in place; false for a malformed escape or an encoded NUL */
+static bool url_decode(char* path)
+{
+        char* in = path;
+        char* out = path;
+
+        while (*in) {
+                if (*in == '%') {
+                        unsigned int c;
+
+                        if (!isxdigit((unsigned char) in[1]) || !isxdigit((unsigned char) in[2])
+                            || sscanf(in + 1, "%2x", &c) != 1 || c == 0)
+                                return false;
+                        *out++ = (char) c;
+                        in += 3;
+                }
+                else {
+                        *out++ = *in++;
+                }
+        }
+        *out = '\0';
+        return true;
+}
+
+
+static const char* mime_type(const char* path)
+{
+        const char* dot = strrchr(path, '.');
+        size_t i;
+
+        if (dot && strchr(dot, '/') == NULL) {
+                for (i = 0; i < sizeof(mime_types) / sizeof(mime_types[0]); i++) {
+                        if (strcmp(dot, mime_types[i].ext) == 0)
+                                return mime_types[i].type;
+                }
+        }
+        return "application/octet-stream";
+}
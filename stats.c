@@ -0,0 +1,277 @@
+/*
+ * File: stats.c
+ * -------------
+ * Build instrumentation for --stats and --trace. Phases of the build and
+ * every rendered post are recorded as timed events (wall clock and CPU
+ * time), next to a few global counters. At the end of the build the data is
+ * printed as a summary and optionally written out as JSON or as a Chrome
+ * trace-event file (load it in chrome://tracing or Perfetto).
+ *
+ * Everything here is a no-op until stats_enable() is called, so the hooks
+ * can stay in the hot paths.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "txt2web.h"
+
+typedef struct {
+        char* name;
+        const char* category;   /* "phase" or "post" */
+        double start;           /* seconds since stats_enable() */
+        double wall;
+        double cpu;
+        long tid;
+} StatEvent;
+
+static const char* counter_names[STAT_COUNTERS] = {
+        "bytes_read",
+        "bytes_written",
+        "bytes_copied",
+        "files_read",
+        "files_written",
+        "files_copied",
+        "files_removed",
+        "allocations"
+};
+
+static bool enabled = false;
+static int slowest_count = 10;
+static double epoch;
+static unsigned long counters[STAT_COUNTERS];
+static StatEvent* events = NULL;
+static size_t event_count = 0;
+static size_t event_cap = 0;
+static pthread_mutex_t events_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double clock_seconds(clockid_t clock);
+static long thread_id(void);
+static void json_string(FILE* f, const char* str);
+static int compare_events(const void* a, const void* b);
+
+
+void stats_enable(int slowest)
+{
+        enabled = true;
+        slowest_count = slowest;
+        epoch = clock_seconds(CLOCK_MONOTONIC);
+}
+
+
+bool stats_enabled(void)
+{
+        return enabled;
+}
+
+
+void stats_count(StatCounter counter, unsigned long n)
+{
+        if (enabled)
+                __atomic_fetch_add(&counters[counter], n, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Starts timing something. With per_thread the CPU time is that of the
+ * calling thread (for work done on the pool), otherwise that of the process.
+ */
+void stats_begin(StatMark* mark, bool per_thread)
+{
+        if (!enabled)
+                return;
+        mark->per_thread = per_thread;
+        mark->wall = clock_seconds(CLOCK_MONOTONIC);
+        mark->cpu = clock_seconds(per_thread ? CLOCK_THREAD_CPUTIME_ID : CLOCK_PROCESS_CPUTIME_ID);
+}
+
+
+void stats_end(const StatMark* mark, const char* category, const char* name)
+{
+        double wall;
+        double cpu;
+        StatEvent* e;
+
+        if (!enabled)
+                return;
+        wall = clock_seconds(CLOCK_MONOTONIC);
+        cpu = clock_seconds(mark->per_thread ? CLOCK_THREAD_CPUTIME_ID : CLOCK_PROCESS_CPUTIME_ID);
+
+        pthread_mutex_lock(&events_lock);
+        if (event_count == event_cap) {
+                event_cap = event_cap ? event_cap * 2 : 256;
+                events = realloc(events, event_cap * sizeof(StatEvent));
+                if (events == NULL) {
+                        fprintf(stderr, "ERROR: Out of memory while recording stats\n");
+                        abort();
+                }
+        }
+        e = &events[event_count++];
+        e->name = strdup(name);
+        e->category = category;
+        e->start = mark->wall - epoch;
+        e->wall = wall - mark->wall;
+        e->cpu = cpu - mark->cpu;
+        e->tid = thread_id();
+        pthread_mutex_unlock(&events_lock);
+}
+
+
+void stats_report(FILE* out)
+{
+        StatEvent** posts;
+        size_t n_posts = 0;
+        double post_wall = 0;
+        double post_cpu = 0;
+        size_t i;
+        int c;
+
+        if (!enabled)
+                return;
+
+        fprintf(out, "\nBuild statistics (wall / cpu seconds)\n");
+        for (i = 0; i < event_count; i++) {
+                if (strcmp(events[i].category, "phase") == 0)
+                        fprintf(out, "  %-12s %9.4f / %9.4f\n", events[i].name, events[i].wall, events[i].cpu);
+        }
+
+        posts = malloc((event_count + 1) * sizeof(StatEvent*));
+        for (i = 0; i < event_count; i++) {
+                if (strcmp(events[i].category, "post") != 0)
+                        continue;
+                posts[n_posts++] = &events[i];
+                post_wall += events[i].wall;
+                post_cpu += events[i].cpu;
+        }
+        fprintf(out, "  %lu posts rendered, %.4f / %.4f seconds summed over all workers\n",
+                (unsigned long) n_posts, post_wall, post_cpu);
+
+        for (c = 0; c < STAT_COUNTERS; c++)
+                fprintf(out, "  %-14s %lu\n", counter_names[c], counters[c]);
+
+        if (n_posts > 0 && slowest_count > 0) {
+                qsort(posts, n_posts, sizeof(StatEvent*), compare_events);
+                fprintf(out, "  slowest posts:\n");
+                for (i = 0; i < n_posts && i < (size_t) slowest_count; i++)
+                        fprintf(out, "    %9.4f  %s\n", posts[i]->wall, posts[i]->name);
+        }
+        free(posts);
+}
+
+
+bool stats_write_json(const char* path)
+{
+        FILE* f = fopen(path, "w");
+        size_t i;
+        int c;
+
+        if (f == NULL) {
+                fprintf(stderr, "Could not write stats file: %s\n", path);
+                return false;
+        }
+
+        fprintf(f, "{\n  \"counters\": {");
+        for (c = 0; c < STAT_COUNTERS; c++)
+                fprintf(f, "%s\n    \"%s\": %lu", c ? "," : "", counter_names[c], counters[c]);
+        fprintf(f, "\n  },\n  \"events\": [");
+        for (i = 0; i < event_count; i++) {
+                StatEvent* e = &events[i];
+                fprintf(f, "%s\n    {\"category\": \"%s\", \"name\": ", i ? "," : "", e->category);
+                json_string(f, e->name);
+                fprintf(f, ", \"start\": %.6f, \"wall\": %.6f, \"cpu\": %.6f}", e->start, e->wall, e->cpu);
+        }
+        fprintf(f, "\n  ]\n}\n");
+
+        return fclose(f) == 0;
+}
+
+
+/* Chrome trace-event format: one complete ("X") event per recorded span */
+bool stats_write_trace(const char* path)
+{
+        FILE* f = fopen(path, "w");
+        size_t i;
+
+        if (f == NULL) {
+                fprintf(stderr, "Could not write trace file: %s\n", path);
+                return false;
+        }
+
+        fprintf(f, "{\"traceEvents\": [");
+        for (i = 0; i < event_count; i++) {
+                StatEvent* e = &events[i];
+                fprintf(f, "%s\n  {\"name\": ", i ? "," : "");
+                json_string(f, e->name);
+                fprintf(f, ", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": %ld, \"tid\": %ld, \"ts\": %.1f, \"dur\": %.1f, \"args\": {\"cpu_us\": %.1f}}",
+                        e->category, (long) getpid(), e->tid, e->start * 1e6, e->wall * 1e6, e->cpu * 1e6);
+        }
+        fprintf(f, "\n], \"displayTimeUnit\": \"ms\"}\n");
+
+        return fclose(f) == 0;
+}
+
+
+void stats_free(void)
+{
+        size_t i;
+
+        for (i = 0; i < event_count; i++)
+                free(events[i].name);
+        free(events);
+        events = NULL;
+        event_count = 0;
+        event_cap = 0;
+}
+
+
+static double clock_seconds(clockid_t clock)
+{
+        struct timespec ts;
+
+        if (clock_gettime(clock, &ts) != 0)
+                return 0;
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static long thread_id(void)
+{
+#if defined(__linux__) && defined(SYS_gettid)
+        return (long) syscall(SYS_gettid);
+#else
+        return 0;
+#endif
+}
+
+
+static void json_string(FILE* f, const char* str)
+{
+        fputc('"', f);
+        for (; *str; str++) {
+                unsigned char c = (unsigned char) *str;
+                if (c == '"' || c == '\\')
+                        fprintf(f, "\\%c", c);
+                else if (c < 0x20)
+                        fprintf(f, "\\u%04x", c);
+                else
+                        fputc(c, f);
+        }
+        fputc('"', f);
+}
+
+
+/* slowest first */
+static int compare_events(const void* a, const void* b)
+{
+        const StatEvent* event_a = *(const StatEvent* const*) a;
+        const StatEvent* event_b = *(const StatEvent* const*) b;
+
+        if (event_a->wall > event_b->wall)
+                return -1;
+        return event_a->wall < event_b->wall;
+}
@@ -0,0 +1,258 @@
+/*
+ * File: template.c
+ * ----------------
+ * Page layouts. A layout is an HTML file with {{slot}} markers; it is
+ * compiled once at startup into a list of literal segments and slots, and
+ * every page is then written by appending the segments in order, without
+ * searching the layout again. See themes/default.html for the layout that
+ * is built in.
+ *
+ * Slots: {{title}}, {{date}}, {{description}} and {{tags}} from the post's
+ * metadata, {{head}} (the <title>, <meta> and stylesheet lines made from
+ * that metadata), {{home}} (the link back to the home page, on posts only),
+ * {{content}} (the rendered text, required) and {{posts}} (the post list,
+ * on the index page only).
+ *
+ * The metadata is at the top of a post, so everything in front of
+ * {{content}} can be written before the body is rendered and the body is
+ * still streamed out in one pass.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "txt2web.h"
+
+static const char* slot_names[] = {
+        NULL, "title", "date", "description", "tags", "head", "home", "content", "posts"
+};
+
+static const char default_layout[] =
+        "<!DOCTYPE html>\n<html lang='en'>\n<head>\n"
+        "  <meta charset='UTF-8'>\n"
+        "  <meta name='viewport' content='width=device-width, initial-scale=1'>\n"
+        "  <link href='/style.css' rel='stylesheet' type='text/css' media='all'>\n"
+        "{{head}}\n</head>\n<body>\n<main>\n"
+        "{{home}}{{content}}{{posts}}</main>\n</body>\n</html>\n";
+
+/* read-only once main() has set it up, so shared by all render threads */
+static Template layout;
+/* layout with its links pointed at fingerprinted assets (-f), when it has any */
+static Template linked;
+
+static void add_segment(Template* t, const char* text, size_t len, TemplateSlot slot);
+
+
+/*
+ * Compiles source into t. source must stay alive as long as t: literal
+ * segments point into it. Returns false (with a message on stderr) for an
+ * unknown slot or a layout without {{content}}.
+ */
+bool template_compile(Template* t, const char* source, const char* name)
+{
+        const char* p = source;
+        const char* open;
+        bool has_content = false;
+
+        memset(t, 0, sizeof(*t));
+        t->hash = hash_str(HASH_INIT, source);
+
+        while ((open = strstr(p, "{{")) != NULL) {
+                const char* close = strstr(open + 2, "}}");
+                size_t len;
+                int s;
+
+                if (close == NULL)
+                        break;
+
+                len = close - (open + 2);
+                for (s = SLOT_TITLE; s < SLOT_COUNT; s++) {
+                        if (strlen(slot_names[s]) == len && memcmp(open + 2, slot_names[s], len) == 0)
+                                break;
+                }
+                if (s == SLOT_COUNT) {
+                        fprintf(stderr, "ERROR: Unknown slot {{%.*s}} in layout %s\n", (int) len, open + 2, name);
+                        template_free(t);
+                        return false;
+                }
+
+                add_segment(t, p, open - p, SLOT_NONE);
+                add_segment(t, NULL, 0, (TemplateSlot) s);
+                has_content = has_content || s == SLOT_CONTENT;
+                p = close + 2;
+        }
+        add_segment(t, p, strlen(p), SLOT_NONE);
+
+        if (!has_content) {
+                fprintf(stderr, "ERROR: Layout %s has no {{content}} slot\n", name);
+                template_free(t);
+                return false;
+        }
+        return true;
+}
+
+
+/*
+ * Appends the segments of t from first on to out, up to and including the
+ * next {{content}} slot or the end. Returns where to continue after the
+ * content. f_out, when not NULL, receives the output in large chunks.
+ */
+size_t template_render(const Template* t, size_t first, Buf* out, FILE* f_out, const TemplatePage* page)
+{
+        size_t i;
+
+        for (i = first; i < t->count; i++) {
+                const TemplateSegment* seg = &t->segments[i];
+
+                switch (seg->slot) {
+                case SLOT_NONE:
+                        buf_append(out, seg->text, seg->len);
+                        break;
+                case SLOT_TITLE:
+                        buf_puts(out, page->post->title);
+                        break;
+                case SLOT_DATE:
+                        buf_puts(out, page->post->date_str);
+                        break;
+                case SLOT_DESCRIPTION:
+                        buf_puts(out, page->post->description);
+                        break;
+                case SLOT_TAGS:
+                        buf_puts(out, page->post->tags);
+                        break;
+                case SLOT_HEAD:
+                        if (page->head && page->head->len)
+                                buf_append(out, page->head->data, page->head->len);
+                        break;
+                case SLOT_HOME:
+                        if (page->add_link)
+                                buf_puts(out, "<a href='/'>&lt;-- go to home page</a><br><br>");
+                        break;
+                case SLOT_POSTS:
+                        if (page->posts)
+                                write_post_list(out, f_out, page->posts);
+                        break;
+                case SLOT_CONTENT:
+                case SLOT_COUNT:
+                        return i + 1;
+                }
+
+                if (f_out && out->len >= OUT_FLUSH_SIZE)
+                        buf_flush(out, f_out);
+        }
+        return t->count;
+}
+
+
+void template_free(Template* t)
+{
+        free(t->segments);
+        free(t->source);
+        memset(t, 0, sizeof(*t));
+}
+
+
+/*
+ * Reads and compiles the layout used for every page; NULL selects the
+ * built-in one. With -m the layout is minified here, once, so the pages
+ * come out minified without any more work per page.
+ */
+bool layout_load(const char* path)
+{
+        MappedFile src;
+        char* source;
+
+        template_free(&layout);
+        template_free(&linked);
+        if (path == NULL && !minify_enabled())
+                return template_compile(&layout, default_layout, "(built in)");
+
+        if (path == NULL) {
+                source = str_printf("%s", default_layout);
+                path = "(built in)";
+        }
+        else {
+                if (!map_file(path, &src)) {
+                        fprintf(stderr, "ERROR: Could not read layout: %s\n", path);
+                        return false;
+                }
+                source = malloc(src.len + 1);
+                if (source == NULL) {
+                        fprintf(stderr, "ERROR: Out of memory while reading layout\n");
+                        abort();
+                }
+                memcpy(source, src.data, src.len);
+                source[src.len] = '\0';
+                unmap_file(&src);
+        }
+        if (minify_enabled())
+                minify_layout(source);
+
+        if (!template_compile(&layout, source, path)) {
+                free(source);
+                return false;
+        }
+        layout.source = source;
+        return true;
+}
+
+
+/*
+ * Points the links of the layout at the fingerprinted assets of this build
+ * (see fingerprint.c), or back at the plain names. Called once the assets
+ * are copied and before any page is rendered. The hash stays that of the
+ * layout itself; the manifest keeps track of the asset names separately.
+ */
+void layout_relink(void)
+{
+        Buf source = { 0 };
+
+        template_free(&linked);
+        if (!fingerprint_enabled())
+                return;
+
+        layout_get();
+        if (fingerprint_html(&source, layout.source ? layout.source : default_layout)
+            && template_compile(&linked, source.data, "(linked)")) {
+                linked.source = source.data;
+                linked.hash = layout.hash;
+                return;
+        }
+        buf_free(&source);
+}
+
+
+/* the layout set up by layout_load(), compiling the built-in one on first use */
+const Template* layout_get(void)
+{
+        if (layout.count == 0)
+                layout_load(NULL);
+        return linked.count ? &linked : &layout;
+}
+
+
+void layout_free(void)
+{
+        template_free(&layout);
+        template_free(&linked);
+}
+
+
+static void add_segment(Template* t, const char* text, size_t len, TemplateSlot slot)
+{
+        if (slot == SLOT_NONE && len == 0)
+                return;
+
+        if (t->count == t->cap) {
+                t->cap = t->cap ? t->cap * 2 : 16;
+                t->segments = realloc(t->segments, t->cap * sizeof(TemplateSegment));
+                if (t->segments == NULL) {
+                        fprintf(stderr, "ERROR: Out of memory while compiling layout\n");
+                        abort();
+                }
+        }
+        t->segments[t->count].text = text;
+        t->segments[t->count].len = len;
+        t->segments[t->count].slot = slot;
+        t->count++;
+}
@@ -8,301 +8,981 @@
  */
 #include <ctype.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <time.h>
 
-typedef struct {
-        char* filename;
-        char* title;
-        char* date_str;
-        char* description;
-        time_t date;
-} Post;
-
-Post txt_to_html(const char* input_filename, const char* output_filename, bool add_link);
-bool direxists(const char* dir);
-void cleandirname(char* str);
-void free_post(Post* post);
-bool hasperms(const char* dir);
-void copy_dir(const char* src, char* dest);
-void remove_dir(const char* dirpath);
-void file_warning(const char* err, const char* filename);
-void parse_date(const char* date_str, time_t* result);
-int compare_dates(const void* a, const void* b);
-void remove_extension(const char* filename, char* output);
-char* replace_links(const char* str);
-char* replace_str(char* str, const char* find, const char* replace);
-bool str_starts_with(const char* str, const char* prefix);
-int str_starts_with_count(const char* str, const char prefix);
-void clean_str(char* str);
-char* str_repl_keywords(char* str, Post blog_post);
-char* str_get_value(const char* str, const char* substring);
-char* str_get_value_after_token(const char* str, const char* tok);
+#include "txt2web.h"
 
+#define SLOWEST_POSTS 10
+#define SERVE_PORT 8000
+#define CACHE_SIZE_MB 256
 
+
+/* the benchmarks link against everything but main() */
+#ifndef TXT2WEB_NO_MAIN
 int main(int argc, char **argv)
 {
-        FILE* index;
-        char line[1024];
-        DIR* dir;
-        struct dirent* ent;
-        Post files[512];
-        Post index_post;
-        int file_count = 0;
-        long index_pos;
-        int i;
-        char postdir[512];
-        char indexloc[512];
+        Post post;
+        Arena strings;
+        int opt;
+        int status;
+        Build build = { 0 };
+        const char* layout_path = NULL;
+        const char* cache_path = NULL;
+        const char* batch_path = NULL;
+        unsigned long cache_mb = CACHE_SIZE_MB;
+        bool watch = false;
+        int port = 0;
+        static const struct option long_options[] = {
+                { "stats", optional_argument, NULL, 'S' },
+                { "trace", required_argument, NULL, 'T' },
+                { "rss", no_argument, NULL, 'R' },
+                { "feed-entries", required_argument, NULL, 'F' },
+                { "watch", no_argument, NULL, 'w' },
+                { "serve", optional_argument, NULL, 'H' },
+                { "cache", required_argument, NULL, 'C' },
+                { "cache-size", required_argument, NULL, 'M' },
+                { "srcset", required_argument, NULL, 'W' },
+                { NULL, 0, NULL, 0 }
+        };
+
+        build.src = ".";
+        build.jobs = pool_default_jobs();
+        build.queue_depth = 64;
+        build.feed_entries = 20;
+        while ((opt = getopt_long(argc, argv, "ab:c:fij:lmp:q:st:u:wz", long_options, NULL)) != -1) {
+                switch (opt) {
+                case 'S':
+                        stats_enable(SLOWEST_POSTS);
+                        build.stats_file = optarg;
+                        break;
+                case 'T':
+                        stats_enable(SLOWEST_POSTS);
+                        build.trace_file = optarg;
+                        break;
+                case 'R':
+                        build.rss = true;
+                        break;
+                case 'F':
+                        if (atoi(optarg) < 1) {
+                                fprintf(stderr, "Invalid number of feed entries: %s\n", optarg);
+                                return 1;
+                        }
+                        build.feed_entries = atoi(optarg);
+                        break;
+                case 'C':
+                        cache_path = optarg;
+                        break;
+                case 'M':
+                        if (atoi(optarg) < 1) {
+                                fprintf(stderr, "Invalid cache size: %s\n", optarg);
+                                return 1;
+                        }
+                        cache_mb = atoi(optarg);
+                        break;
+                case 'w':
+                        watch = true;
+                        break;
+                case 'H':
+                        port = optarg ? atoi(optarg) : SERVE_PORT;
+                        if (port < 1 || port > 65535) {
+                                fprintf(stderr, "Invalid port: %s\n", optarg);
+                                return 1;
+                        }
+                        watch = true;
+                        break;
+                case 'z':
+                        if (*compress_formats() == '\0') {
+                                fprintf(stderr, "Built without zlib, brotli or zstd: -z is not available\n");
+                                return 1;
+                        }
+                        build.compress = true;
+                        break;
+                case 't':
+                        layout_path = optarg;
+                        break;
+                case 'u':
+                        cleandirname(optarg);
+                        build.base_url = optarg;
+                        break;
+                case 'a':
+                        build.archives = true;
+                        break;
+                case 'b':
+                        batch_path = optarg;
+                        break;
+                case 'c':
+                        if (!parse_copy_mode(optarg, &build.copy_mode)) {
+                                fprintf(stderr, "Unknown copy mode: %s\n", optarg);
+                                return 1;
+                        }
+                        break;
+                case 'i':
+                        build.incremental = true;
+                        break;
+                case 's':
+                        search_enable();
+                        break;
+                case 'm':
+                        minify_enable();
+                        break;
+                case 'f':
+                        fingerprint_enable();
+                        break;
+                case 'l':
+                        image_enable();
+                        break;
+                case 'W':
+                        if (!image_set_widths(optarg)) {
+                                fprintf(stderr, "Invalid srcset widths: %s\n", optarg);
+                                return 1;
+                        }
+                        image_enable();
+                        break;
+                case 'j':
+                        build.jobs = atoi(optarg);
+                        if (build.jobs < 1) {
+                                fprintf(stderr, "Invalid number of jobs: %s\n", optarg);
+                                return 1;
+                        }
+                        break;
+                case 'p':
+                        if (atoi(optarg) < 0) {
+                                fprintf(stderr, "Invalid number of posts per page: %s\n", optarg);
+                                return 1;
+                        }
+                        build.per_page = atoi(optarg);
+                        break;
+                case 'q':
+                        if (atoi(optarg) < 1) {
+                                fprintf(stderr, "Invalid queue depth: %s\n", optarg);
+                                return 1;
+                        }
+                        build.queue_depth = atoi(optarg);
+                        break;
+                default:
+                        usage(argv[0]);
+                        return 1;
+                }
+        }
+        argc -= optind - 1;
+        argv += optind - 1;
 
-        if (argc == 3) {
+        if (!layout_load(layout_path))
+                return 1;
+        if (cache_path && !cache_open(cache_path, cache_mb * 1024 * 1024))
+                return 1;
+
+        if (batch_path && (argc != 1 || watch)) {
+                fprintf(stderr, "-b takes the build directories from the site list and cannot be used with -w\n");
+                return 1;
+        }
+        else if ((argc == 2 || argc == 3) && (strcmp(argv[1], "-") == 0 || (argc == 3 && strcmp(argv[2], "-") == 0))) {
+                /* streaming: nothing but the page goes to stdout */
+                status = render_stream(argv[1], argc == 3 ? argv[2] : "-");
+                layout_free();
+                cache_close();
+                return status;
+        }
+        else if (argc == 3) {
                 if (strstr(argv[1], ".txt") == NULL) {
                         fprintf(stderr, "Usage: %s <input text file> <output file>\n", argv[0]);
                         return 0;
                 }
 
                 printf("Processing %s\n", argv[1]);
-                txt_to_html(argv[1], argv[2], false);
-                return 0;
+                arena_init(&strings);
+                status = txt_to_html(argv[1], argv[2], false, NULL, &post, &strings, NULL, stderr) ? 0 : 1;
+                arena_free(&strings);
+                layout_free();
+                cache_close();
+                return status;
         }
-        else if (argc != 2) {
-                fprintf(stderr, "Usage: %s <destination_directory>\n", argv[0]);
+        else if (argc != 2 && batch_path == NULL) {
+                usage(argv[0]);
                 return 0;
         }
 
-        cleandirname(argv[1]);
-        if (!direxists(argv[1])) {
-                mkdir(argv[1], 0755);
+        if (batch_path) {
+                status = batch_build(&build, batch_path);
         }
+        else {
+                cleandirname(argv[1]);
+                build.dir = argv[1];
+                if (!direxists(argv[1])) {
+                        mkdir(argv[1], 0755);
+                }
 
-        if (!hasperms(argv[1])) {
-                fprintf(stderr, "Write or read permission not granted for directory: %s\n", argv[1]);
-                return 1;
+                if (!hasperms(argv[1])) {
+                        fprintf(stderr, "Write or read permission not granted for directory: %s\n", argv[1]);
+                        return 1;
+                }
+
+                status = build_site(&build);
+                if (watch)
+                        status = watch_site(&build, layout_path, port);
+        }
+        layout_free();
+        cache_close();
+
+        if (stats_enabled()) {
+                stats_report(stdout);
+                if (build.stats_file && !stats_write_json(build.stats_file))
+                        status = 1;
+                if (build.trace_file && !stats_write_trace(build.trace_file))
+                        status = 1;
+                stats_free();
+        }
+        return status;
+}
+#endif
+
+
+int build_site(Build* build)
+{
+        DIR* dir;
+        struct dirent* ent;
+        PostTable posts = { 0 };
+        PostJob* jobs = NULL;
+        size_t job_count = 0;
+        size_t job_cap = 0;
+        Post index_post;
+        PostList list;
+        int rendered = 0;
+        int status = 0;
+        size_t i;
+        char* srcpostdir;
+        char* indexsrc;
+        char* postdir;
+        char* indexloc;
+        char* manifestloc;
+        struct stat st;
+        unsigned long hash;
+        bool index_changed;
+        bool relayout;          /* the layout changed: every page must be rewritten */
+        StatMark mark;
+
+        manifest_init(&build->prev);
+        manifest_init(&build->next);
+        arena_init(&build->strings);
+        fs_batch_init(&build->fs, build->queue_depth, build->jobs);
+
+        /* "./posts/x.txt" and "index" when building the current directory, as always */
+        srcpostdir = path_join(build->src, "posts");
+        if (strcmp(build->src, ".") == 0)
+                indexsrc = str_printf("index");
+        else
+                indexsrc = path_join(build->src, "index");
+        postdir = path_join(build->dir, "posts");
+        indexloc = path_join(build->dir, "index.html");
+        manifestloc = path_join(build->dir, MANIFEST_NAME);
+        if (stat(build->dir, &st) == 0) {
+                build->dir_dev = st.st_dev;
+                build->dir_ino = st.st_ino;
         }
 
-        remove_dir(argv[1]);
-        printf("Copying files into build directory: %s\n", argv[1]);
-        copy_dir(".", argv[1]);
-        sprintf(postdir, "%s/posts/", argv[1]);
-        sprintf(indexloc, "%s/index.html", argv[1]);
+        if (build->incremental && !manifest_load(&build->prev, manifestloc)) {
+                printf("No usable manifest in %s, doing a full build\n", build->dir);
+                manifest_free(&build->prev);
+                manifest_init(&build->prev);
+                build->incremental = false;
+        }
 
-        mkdir(argv[1], 0755);
+        /* pages rendered without search terms, unminified or without image sizes have to be rendered again for -s, -m and -l */
+        build->next.layout_hash = layout_get()->hash;
+        if (search_enabled())
+                build->next.layout_hash = hash_str(build->next.layout_hash, "search");
+        if (minify_enabled())
+                build->next.layout_hash = hash_str(build->next.layout_hash, "minify");
+        if (image_enabled())
+                build->next.layout_hash = hash_str(build->next.layout_hash, "images");
+        relayout = build->prev.layout_hash != build->next.layout_hash;
+
+        if (!build->incremental) {
+                stats_begin(&mark, false);
+                remove_dir(build, build->dir);
+                stats_end(&mark, "phase", "clean");
+        }
+        printf("Copying files into build directory: %s\n", build->dir);
+        stats_begin(&mark, false);
+        fingerprint_reset();
+        image_reset();
+        copy_dir(build, build->src, build->dir);
+        stats_end(&mark, "phase", "copy");
+
+        /* every page links to the assets by name: when a fingerprinted name changes, all pages do */
+        build->next.asset_hash = fingerprint_finish();
+        if (image_enabled())
+                build->next.asset_hash = image_finish(build->next.asset_hash);
+        layout_relink();
+        relayout = relayout || build->prev.asset_hash != build->next.asset_hash;
+
+        mkdir(build->dir, 0755);
         mkdir(postdir, 0755);
 
-        if ((dir = opendir("./posts/")) == NULL) {
-                fprintf(stderr, "Could not open directory");
-                return 1;
+        stats_begin(&mark, false);
+        if ((dir = opendir(srcpostdir)) == NULL) {
+                fprintf(stderr, "ERROR: Could not open directory: %s\n", srcpostdir);
+                status = 1;
+                goto done;
         }
 
         while ((ent = readdir(dir)) != NULL) {
-                char new_filename[273];
-                char output_file[789];
-                char input_filename[273];
+                PostJob* job;
+                char* input;
 
                 if (strstr(ent->d_name, ".txt") == NULL)
                         continue;
 
-                printf("Processing %s\n", ent->d_name);
-                remove_extension(ent->d_name, new_filename);
+                input = path_join(srcpostdir, ent->d_name);
+                if (job_count == job_cap) {
+                        job_cap = job_cap ? job_cap * 2 : 256;
+                        jobs = realloc(jobs, job_cap * sizeof(PostJob));
+                }
+
+                job = &jobs[job_count];
+                memset(job, 0, sizeof(*job));
+                if (stat(input, &job->st) == -1) {
+                        free(input);
+                        continue;
+                }
+
+                job->input = arena_strdup(&build->strings, input);
+                job->name = arena_strdup(&build->strings, ent->d_name);
+                remove_extension(job->name);
+                free(input);
 
-                sprintf(output_file, "%s%s.html", postdir, new_filename);
-                sprintf(input_filename, "./posts/%s", ent->d_name);
-                files[file_count] = txt_to_html(input_filename, output_file, true);
-                files[file_count].filename = strdup(new_filename);
-                file_count++;
+                input = str_printf("%s/%s.html", postdir, job->name);
+                job->output = arena_strdup(&build->strings, input);
+                free(input);
+
+                job->render = relayout || !manifest_unchanged(&build->prev, job->input, job->output, &job->st, &job->hash);
+                job->strings = &build->strings;
+                job_count++;
         }
         closedir(dir);
+        stats_end(&mark, "phase", "scan");
+
+        /* render changed posts in parallel, collect them in directory order */
+        stats_begin(&mark, false);
+        pool_run(build->jobs, job_count, render_post_job, jobs);
+        stats_end(&mark, "phase", "render");
+
+        for (i = 0; i < job_count; i++) {
+                PostJob* job = &jobs[i];
+                Post* post;
+                ManifestEntry* e;
+
+                if (job->render && !job->ok) {
+                        status = 1;
+                        continue;
+                }
+
+                if (job->render) {
+                        job->post.filename = job->name;
+                        post = post_table_add(&posts, &job->post);
+                        rendered++;
+                }
+                else {
+                        /* the previous manifest outlives the post table */
+                        post = post_table_add(&posts, &manifest_find(&build->prev, job->input)->post);
+                }
+
+                e = manifest_add(&build->next, 'P', job->input, job->output, &job->st, job->hash);
+                manifest_set_post(&build->next, e, post);
+        }
+        free(jobs);
 
         /* sort posts by date */
-        qsort(files, file_count, sizeof(Post), compare_dates);
+        stats_begin(&mark, false);
+        post_table_sort(&posts);
+        stats_end(&mark, "phase", "sort");
+
+        /* everything the list and archive pages (and the search index) are made of */
+        build->next.list_hash = hash_bytes(HASH_INIT, &build->per_page, sizeof(build->per_page));
+        build->next.list_hash = hash_bytes(build->next.list_hash, &build->archives, sizeof(build->archives));
+        build->next.list_hash = hash_str(build->next.list_hash, build->base_url);
+        build->next.list_hash = hash_bytes(build->next.list_hash, &build->rss, sizeof(build->rss));
+        build->next.list_hash = hash_bytes(build->next.list_hash, &build->feed_entries, sizeof(build->feed_entries));
+        for (i = 0; i < posts.count; i++) {
+                Post* post = post_table_get(&posts, i);
+                build->next.list_hash = hash_str(build->next.list_hash, post->filename);
+                build->next.list_hash = hash_str(build->next.list_hash, post->date_str);
+                build->next.list_hash = hash_str(build->next.list_hash, post->title);
+                build->next.list_hash = hash_str(build->next.list_hash, post->tags);
+                build->next.list_hash = hash_str(build->next.list_hash, post->description);
+                if (search_enabled())
+                        build->next.list_hash = hash_str(build->next.list_hash, post->terms);
+        }
 
         /* process index file */
-        printf("Processing index.html\n");
-        index_post = txt_to_html("index", indexloc, false);
+        stats_begin(&mark, false);
+        if (stat(indexsrc, &st) == -1) {
+                fprintf(stderr, "ERROR: Trying to read from nonexistent file: %s\n", indexsrc);
+                status = 1;
+                goto done;
+        }
+        index_changed = relayout || !manifest_unchanged(&build->prev, indexsrc, indexloc, &st, &hash)
+                || build->prev.list_hash != build->next.list_hash;
+        if (index_changed)
+                hash_file(indexsrc, &hash);
+        manifest_add(&build->next, 'I', indexsrc, indexloc, &st, hash);
+
+        if (index_changed) {
+                printf("Processing index.html\n");
+                list.posts = &posts;
+                list.per_page = build->per_page;
+                list.archives = build->archives;
+                if (!txt_to_html(indexsrc, indexloc, false, &list, &index_post, &build->strings, NULL, stderr)
+                    || !archive_write(build, &posts, index_post.title)) {
+                        status = 1;
+                        goto done;
+                }
+                if (build->base_url
+                    && (!feed_write(build, &posts, index_post.title, index_post.description)
+                        || !sitemap_write(build, &posts))) {
+                        status = 1;
+                        goto done;
+                }
+                if (search_enabled() && !search_write(build, &posts)) {
+                        status = 1;
+                        goto done;
+                }
+        }
+        else {
+                /* generated pages and feeds are as current as index.html; keep them */
+                struct stat none = { 0 };
+
+                for (i = 0; i < build->prev.count; i++) {
+                        ManifestEntry* e = &build->prev.entries[i];
+                        if (e->kind == 'G')
+                                manifest_add(&build->next, 'G', e->src, e->out, &none, e->hash);
+                }
+        }
+
+        stats_end(&mark, "phase", "index");
+
+        if (cache_enabled()) {
+                stats_begin(&mark, false);
+                cache_trim();
+                stats_end(&mark, "phase", "cache");
+        }
+
+        if (build->compress) {
+                printf("Compressing output (%s)\n", compress_formats());
+                stats_begin(&mark, false);
+                compress_outputs(build);
+                stats_end(&mark, "phase", "compress");
+        }
+        else if (build->prev.compressed) {
+                /* the variants of pages rewritten since -z was dropped would be stale */
+                for (i = 0; i < build->prev.count; i++)
+                        compress_remove(build->prev.entries[i].out);
+        }
+        build->next.compressed = build->compress;
+
+        /* outputs whose source disappeared since the last build */
+        stats_begin(&mark, false);
+        manifest_sort(&build->next);
+        if (build->incremental)
+                manifest_remove_orphans(&build->prev, &build->next);
+        manifest_save(&build->next, manifestloc);
+        stats_end(&mark, "phase", "manifest");
+
+        build->post_count = posts.count;
+        build->rendered = rendered;
+        if (build->incremental)
+                printf("Rendered %d of %lu posts (%lu unchanged)\n", rendered,
+                       (unsigned long) posts.count, (unsigned long) posts.count - rendered);
+
+done:
+        post_table_free(&posts);
+        manifest_free(&build->prev);
+        manifest_free(&build->next);
+        arena_free(&build->strings);
+        fs_batch_free(&build->fs);
+        free(srcpostdir);
+        free(indexsrc);
+        free(postdir);
+        free(indexloc);
+        free(manifestloc);
+        return status;
+}
+
+
+/* the list of posts on the index page, newest first; see archive.c for the other pages */
+void write_post_list(Buf* out, FILE* f_out, const PostList* list)
+{
+        size_t count = list->posts->count;
+        size_t i;
+
+        if (list->per_page && list->per_page < count)
+                count = list->per_page;
+
+        buf_put_markup(out, "  <nav><ul>\n");
+        for (i = 0; i < count; i++) {
+                write_post_item(out, post_table_get(list->posts, i), "");
+                if (out->len >= OUT_FLUSH_SIZE)
+                        buf_flush(out, f_out);
+        }
+        buf_put_markup(out, "  </ul></nav>\n");
 
-        index = fopen(indexloc, "r+");
-        if (index == NULL) {
-                fprintf(stderr, "Could not open index.html\n");
+        if (list->per_page)
+                write_pager(out, 1, (list->posts->count + list->per_page - 1) / list->per_page);
+        if (list->archives)
+                buf_put_markup(out, "  <nav class='archive'><a href='archive.html'>archive</a></nav>\n");
+}
+
+
+void usage(const char* prog)
+{
+        fprintf(stderr, "Usage: %s [-afilmsz] [-j jobs] [-c mode] [-p posts] [-q depth] [-t layout] [-u url [--rss] [--feed-entries=N]]\n", prog);
+        fprintf(stderr, "       [--srcset=widths] [--cache=DIR [--cache-size=MB]] [--stats[=FILE]] [--trace=FILE] [-w | --serve[=PORT]]\n");
+        fprintf(stderr, "       <destination_directory>\n");
+        fprintf(stderr, "       %s [options] -b <site list>\n", prog);
+        fprintf(stderr, "       %s <input text file> <output file>\n", prog);
+        fprintf(stderr, "       %s - [<output file>]  or  %s <input text file> -   (- is stdin or stdout)\n", prog, prog);
+        fprintf(stderr, "  -b  build every site in a list of \"<source dir> <build dir> [base url]\" lines in one process\n");
+        fprintf(stderr, "  -a  write archive pages per year and per tag, listed on archive.html\n");
+        fprintf(stderr, "  -f  also copy assets under names with a hash of their contents, and link pages to those\n");
+        fprintf(stderr, "  -i  incremental build: only rebuild what changed since the last build\n");
+        fprintf(stderr, "  -j  number of posts rendered in parallel (default: number of cores)\n");
+        fprintf(stderr, "  -c  how files are copied: auto, hardlink, reflink, kernel or copy (default: auto)\n");
+        fprintf(stderr, "  -l  write the size of images on <img>, and load all but the first one on a page lazily\n");
+        fprintf(stderr, "  -m  write compact HTML and copy stylesheets minified\n");
+        fprintf(stderr, "  -p  posts listed per page; older posts go to page/2.html and on (default: 0, all on index.html)\n");
+        fprintf(stderr, "  -q  filesystem operations kept in flight while cleaning and copying (default: 64)\n");
+        fprintf(stderr, "  -s  write a full-text search index of the posts and a script to query it into search/\n");
+        fprintf(stderr, "  -t  HTML layout every page is written into, see themes/default.html\n");
+        fprintf(stderr, "  -w  watch mode: keep running and rebuild whenever a source changes\n");
+        fprintf(stderr, "  -u  base URL of the site; writes feed.xml (Atom) and sitemap.xml\n");
+        fprintf(stderr, "  -z  also write precompressed .gz, .br and .zst files, as far as built in (%s)\n",
+                *compress_formats() ? compress_formats() : "none");
+        fprintf(stderr, "  --rss               write feed.xml as RSS 2.0 instead of Atom\n");
+        fprintf(stderr, "  --feed-entries=N    newest posts in feed.xml (default: 20)\n");
+        fprintf(stderr, "  --cache=DIR         reuse posts rendered by earlier builds, into any directory, from DIR\n");
+        fprintf(stderr, "  --cache-size=MB     size the cache is trimmed to, least recently used first (default: %d)\n", CACHE_SIZE_MB);
+        fprintf(stderr, "  --srcset=W,...      with -l, also write PNG and JPEG images scaled to these widths, listed in srcset\n");
+        fprintf(stderr, "  --watch             same as -w\n");
+        fprintf(stderr, "  --serve[=PORT]      watch, and serve the site on http://127.0.0.1:PORT/ (default: %d)\n", SERVE_PORT);
+        fprintf(stderr, "  --stats[=FILE]  print where the build spent its time, and write it to FILE as JSON\n");
+        fprintf(stderr, "  --trace=FILE    write a Chrome trace-event file of the build to FILE\n");
+}
+
+
+/*
+ * Renders one post from input to output, either of which may be "-" for
+ * stdin or stdout, through the library API (lib.c). Messages go to stderr.
+ */
+int render_stream(const char* input, const char* output)
+{
+        RenderResult result;
+        bool from_stdin = strcmp(input, "-") == 0;
+        bool to_stdout = strcmp(output, "-") == 0;
+        int in = STDIN_FILENO;
+        int out = STDOUT_FILENO;
+        FILE* f = NULL;
+        char* tmp = NULL;
+        bool ok;
+
+        if (!from_stdin && (in = open(input, O_RDONLY)) == -1) {
+                fprintf(stderr, "ERROR: Trying to read from nonexistent file: %s\n", input);
                 return 1;
         }
+        if (!to_stdout) {
+                if ((f = output_open(output, &tmp)) == NULL) {
+                        fprintf(stderr, "ERROR: Could not write to file: %s\n", output);
+                        if (!from_stdin)
+                                close(in);
+                        return 1;
+                }
+                out = fileno(f);
+        }
 
-        while (fgets(line, sizeof(line), index)) {
-                if (strstr(line, "</main>") != NULL) {
-                        index_pos = ftell(index) - strlen(line);
-                        break;
+        ok = render_fd(in, from_stdin ? "stdin" : input, false, render_sink_fd, &out, &result);
+        fputs(result.messages, stderr);
+        render_result_free(&result);
+
+        if (!from_stdin)
+                close(in);
+        if (f && !output_commit(f, output, tmp, ok)) {
+                if (ok)
+                        fprintf(stderr, "ERROR: Could not write to file: %s\n", output);
+                ok = false;
+        }
+        return ok ? 0 : 1;
+}
+
+
+/*
+ * Opens path for writing. Regular files are written to a temporary file next
+ * to path and renamed over it by output_commit(), so the live file is never
+ * half-written; anything else (/dev/stdout) is opened directly.
+ */
+FILE* output_open(const char* path, char** tmp_path)
+{
+        struct stat st;
+        FILE* f;
+
+        *tmp_path = NULL;
+        if (stat(path, &st) != 0 || S_ISREG(st.st_mode))
+                *tmp_path = str_printf("%s.tmp", path);
+
+        if ((f = fopen(*tmp_path ? *tmp_path : path, "w")) == NULL) {
+                free(*tmp_path);
+                *tmp_path = NULL;
+        }
+        return f;
+}
+
+
+/* closes a file from output_open() and, if ok, moves it into place */
+bool output_commit(FILE* f, const char* path, char* tmp_path, bool ok)
+{
+        ok = fclose(f) == 0 && ok;
+        if (tmp_path) {
+                if (ok && rename(tmp_path, path) != 0)
+                        ok = false;
+                if (!ok)
+                        remove(tmp_path);
+                free(tmp_path);
+        }
+        if (ok)
+                stats_count(STAT_FILES_WRITTEN, 1);
+        return ok;
+}
+
+
+/*
+ * Renders one post. Safe to call from several threads at once: all messages go
+ * to log and errors are reported through the return value. When hash is not
+ * NULL it receives the hash of the source, computed from the same read. With
+ * a post_list (the index page) the list of posts ends the page.
+ */
+bool txt_to_html(const char* input_filename, const char* output_filename, bool add_link,
+                 const PostList* post_list, Post* blog_post, Arena* strings, unsigned long* hash, FILE* log)
+{
+        MappedFile src;
+        FILE* f_out;
+        FILE* render_log = log;
+        char* tmp_filename;
+        char* messages = NULL;
+        size_t messages_len = 0;
+        unsigned long source_hash;
+        unsigned long key = 0;
+        size_t size;
+        bool cached;
+        bool ok;
+
+        memset(blog_post, 0, sizeof(*blog_post));
+
+        if (!map_file(input_filename, &src)) {
+                fprintf(log, "ERROR: Trying to read from nonexistent file: %s\n", input_filename);
+                return false;
+        }
+        source_hash = hash_bytes(HASH_INIT, src.data, src.len);
+        size = src.len;
+        if (hash)
+                *hash = source_hash;
+
+        /* posts only: the index page depends on every other post as well */
+        cached = post_list == NULL && cache_enabled();
+        if (cached) {
+                key = cache_key(source_hash, input_filename, add_link);
+                if (cache_fetch(key, source_hash, size, output_filename, blog_post, strings, log)) {
+                        unmap_file(&src);
+                        return true;
+                }
+                /* the messages are stored with the page and repeated on every hit */
+                if ((render_log = open_memstream(&messages, &messages_len)) == NULL) {
+                        render_log = log;
+                        cached = false;
                 }
         }
 
-        fseek(index, index_pos, SEEK_SET);
-        fprintf(index, "  <nav><ul>\n");
-        for (i = 0; i < file_count; i++) {
-                fprintf(index, "    <li><span class='date'>%s</span> - <a href='posts/%s.html'>%s</a></li>\n", files[i].date_str, files[i].filename, files[i].title);
-                free_post(&files[i]);
+        if ((f_out = output_open(output_filename, &tmp_filename)) == NULL) {
+                fprintf(log, "ERROR: Could not write to file: %s\n", output_filename);
+                if (render_log != log)
+                        fclose(render_log);
+                free(messages);
+                unmap_file(&src);
+                return false;
         }
 
-        fprintf(index, "  </ul></nav>\n</main>\n</body>\n</html>\n");
-        fclose(index);
-        free_post(&index_post);
+        ok = render_html(src.data, src.len, input_filename, f_out, add_link, post_list, blog_post, strings, render_log);
+        unmap_file(&src);
 
-        return 0;
+        if (render_log != log) {
+                fclose(render_log);
+                if (messages)
+                        fputs(messages, log);
+        }
+
+        if (!output_commit(f_out, output_filename, tmp_filename, ok)) {
+                if (ok)
+                        fprintf(log, "ERROR: Could not write to file: %s\n", output_filename);
+                ok = false;
+        }
+        if (ok && cached)
+                cache_store(key, source_hash, size, output_filename, blog_post, messages);
+        free(messages);
+        return ok;
 }
 
 
-Post txt_to_html(const char* input_filename, const char* output_filename, bool add_link)
+/*
+ * Renders the source text in [data, data + size) to f_out. The text does not
+ * need to be NUL terminated: every line is handled as a (pointer, length)
+ * slice, and only the metadata that outlives the source is copied (into
+ * strings).
+ */
+bool render_html(const char* data, size_t size, const char* input_filename, FILE* f_out, bool add_link,
+                 const PostList* post_list, Post* blog_post, Arena* strings, FILE* log)
 {
-        FILE* f_in = fopen(input_filename, "r");
-        FILE* f_out = fopen(output_filename, "w");
-        char line[1024];
+        const char* end = data + size;
+        const char* line;
+        const char* next;
+        const Template* layout = layout_get();
+        TemplatePage page;
+        Buf out = { 0 };        /* rendered page, flushed in large chunks */
+        Buf scratch = { 0 };    /* line with {title} and {date} expanded */
+        Buf head = { 0 };       /* <head> lines from the metadata, for {{head}} */
+        SearchTerms terms;      /* words of the post for the search index */
+        bool collect = post_list == NULL && search_enabled();
+        const char* page_dir = post_list ? "/" : "/posts/";    /* where relative links start */
+        size_t rest = 0;        /* layout segment after {{content}} */
+        bool in_body = false;
         bool in_paragraph = false;
         bool in_code = false;
         bool in_meta = false;
-        bool has_tags = false;
-        Post blog_post = { 0 };
+        bool first_image = true;        /* in view when the page opens, so not loaded lazily */
+        bool ok;
+        const char* value;
+        size_t value_len;
 
-        if (f_in == NULL) {
-                fprintf(stderr, "ERROR: Trying to read from nonexistent file: %s", input_filename);
-                exit(1);
-        }
+        page.post = blog_post;
+        page.head = &head;
+        page.add_link = add_link;
+        page.posts = post_list;
+        memset(&terms, 0, sizeof(terms));
+
+        for (line = data; line < end; line = next) {
+                const char* nl = memchr(line, '\n', end - line);
+                size_t len;
 
-        fprintf(f_out, "<!DOCTYPE html>\n<html lang='en'>\n<head>\n");
-        fprintf(f_out, "  <meta charset='UTF-8'>\n");
-        fprintf(f_out, "  <meta name='viewport' content='width=device-width, initial-scale=1'>\n");
-        fprintf(f_out, "  <link href='/style.css' rel='stylesheet' type='text/css' media='all'>\n");
+                next = nl ? nl + 1 : end;
+                len = next - line;      /* includes the newline, if any */
 
-        while(fgets(line, sizeof(line), f_in)) {
                 /* META */
-                if (str_starts_with(line, "-----") && !in_meta && !in_code) {
+                if (str_starts_with(line, len, "-----") && !in_meta && !in_code) {
                         in_meta = true;
                 }
-                else if (str_starts_with(line, "-----") && !in_code) {
+                else if (str_starts_with(line, len, "-----") && !in_code) {
                         in_meta = false;
-                        fprintf(f_out, "\n</head>\n<body>\n<main>\n");
-                        if (add_link) {
-                                fprintf(f_out, "<a href='/'>&lt;-- go to home page</a><br><br>");
-                        }
                         continue;
                 }
+
+                /* the metadata is complete: write the layout up to {{content}} */
+                if (!in_meta && !in_body) {
+                        rest = template_render(layout, 0, &out, f_out, &page);
+                        in_body = true;
+                }
+
                 if (in_meta && !in_code) {
-                        if (str_starts_with(line, "title:")) {
-                                blog_post.title = str_get_value(line, "title:");
-                                fprintf(f_out, "  <title>%s</title>", blog_post.title);
+                        if (str_starts_with(line, len, "title:")) {
+                                value = str_get_value(line, len, "title:", &value_len);
+                                blog_post->title = arena_strndup(strings, value, value_len);
+                                if (collect)
+                                        search_terms_add(&terms, value, value_len, NULL);
+                                buf_put_markup(&head, "  <title>");
+                                buf_puts(&head, blog_post->title);
+                                buf_puts(&head, "</title>");
                         }
-                        else if (str_starts_with(line, "date:")) {
-                                blog_post.date_str = str_get_value(line, "date:");
-                                parse_date(blog_post.date_str, &blog_post.date);
+                        else if (str_starts_with(line, len, "date:")) {
+                                value = str_get_value(line, len, "date:", &value_len);
+                                blog_post->date_str = arena_strndup(strings, value, value_len);
+                                if (!parse_date(blog_post->date_str, &blog_post->date))
+                                        fprintf(log, "Error: Could not read date \"%s\" in %s. Please write it as May 11 2023 or 2023-05-11.\n",
+                                                blog_post->date_str, input_filename);
                         }
-                        else if (str_starts_with(line, "description:")) {
-                                blog_post.description = str_get_value(line, "description:");
-                                fprintf(f_out, "\n  <meta name='description' content='%s'>", blog_post.description);
+                        else if (str_starts_with(line, len, "description:")) {
+                                value = str_get_value(line, len, "description:", &value_len);
+                                blog_post->description = arena_strndup(strings, value, value_len);
+                                if (collect)
+                                        search_terms_add(&terms, value, value_len, NULL);
+                                buf_put_markup(&head, "\n  <meta name='description' content='");
+                                buf_puts(&head, blog_post->description);
+                                buf_puts(&head, "'>");
                         }
-                        else if (str_starts_with(line, "tags:")) {
-                                char* str_tags = str_get_value(line, "tags:");
-                                fprintf(f_out, "\n  <meta name='keywords' content='%s'>", str_tags);
-                                free(str_tags);
-                                has_tags = true;
+                        else if (str_starts_with(line, len, "tags:")) {
+                                value = str_get_value(line, len, "tags:", &value_len);
+                                blog_post->tags = arena_strndup(strings, value, value_len);
+                                if (collect)
+                                        search_terms_add(&terms, value, value_len, NULL);
+                                buf_put_markup(&head, "\n  <meta name='keywords' content='");
+                                buf_puts(&head, blog_post->tags);
+                                buf_puts(&head, "'>");
                         }
-                        else if (str_starts_with(line, "style:")) {
-                                char* str_style = str_get_value(line, "style:");
-                                fprintf(f_out, "\n  <link href='%s' rel='stylesheet' type='text/css' media='all'>", str_style);
-                                free(str_style);
+                        else if (str_starts_with(line, len, "style:")) {
+                                value = str_get_value(line, len, "style:", &value_len);
+                                buf_put_markup(&head, "\n  <link href='");
+                                buf_put_asset_url(&head, page_dir, value, value_len);
+                                buf_puts(&head, "' rel='stylesheet' type='text/css' media='all'>");
                         }
                 }
                 /* code blocks */
                 else if (in_code) {
-                        if (str_starts_with(line, "```")) {
-                                fprintf(f_out, "</code></pre>\n");
+                        if (str_starts_with(line, len, "```")) {
+                                buf_put_markup(&out, "</code></pre>\n");
                                 in_code = false;
                         }
                         else {
-                                char* rpl_less = replace_str(line, "<", "&lt;");
-                                char* rpl_greater = replace_str(rpl_less, ">", "&gt;");
-                                fprintf(f_out, "%s", rpl_greater);
-                                free(rpl_less);
-                                free(rpl_greater);
+                                render_code(&out, line, len);
                         }
                 }
                 /* Images */
-                else if (str_starts_with(line, "@")) {
-                        char* str_img = str_get_value(line, "@");
+                else if (str_starts_with(line, len, "@")) {
                         if (in_paragraph) {
                                 in_paragraph = false;
-                                fprintf(f_out, "  </p>\n");
+                                buf_put_markup(&out, "  </p>\n");
                         }
-                        fprintf(f_out, "  <img src='%s'>\n", str_img);
-                        free(str_img);
+                        value = str_get_value(line, len, "@", &value_len);
+                        buf_put_markup(&out, "  <img src='");
+                        buf_put_asset_url(&out, page_dir, value, value_len);
+                        buf_putc(&out, '\'');
+                        image_put_attributes(&out, page_dir, value, value_len, first_image);
+                        first_image = false;
+                        buf_put_markup(&out, ">\n");
                 }
                 /* headings */
-                else if (str_starts_with(line, "#")) {
-                        int header_level = str_starts_with_count(line, '#');
-                        char* str = str_get_value_after_token(line, "#");
-                        char* rpl = str_repl_keywords(str, blog_post);
-                        char* link_rpl = replace_links(rpl);
+                else if (str_starts_with(line, len, "#")) {
+                        int header_level = str_starts_with_count(line, len, '#');
+                        const char* start = line + header_level;
+                        const char* stop;
+
+                        /* text up to the next '#' or newline, without leading whitespace */
+                        while (start < next && isspace((unsigned char) *start))
+                                start++;
+                        for (stop = start; stop < next && *stop != '#' && *stop != '\n'; stop++)
+                                ;
+
                         if (in_paragraph) {
                                 in_paragraph = false;
-                                fprintf(f_out, "  </p>\n");
+                                buf_put_markup(&out, "  </p>\n");
                         }
-                        fprintf(f_out, "  <h%d>%s</h%d>\n", header_level, link_rpl, header_level);
-                        free(str);
-                        free(rpl);
-                        free(link_rpl);
+                        buf_put_markup(&out, "  <h");
+                        buf_put_int(&out, header_level);
+                        buf_putc(&out, '>');
+                        render_inline(&out, &scratch, start, stop - start, blog_post);
+                        if (collect)
+                                search_terms_add(&terms, start, stop - start, blog_post);
+                        buf_puts(&out, "</h");
+                        buf_put_int(&out, header_level);
+                        buf_put_markup(&out, ">\n");
                 }
-                else if (str_starts_with(line, "```")) {
+                else if (str_starts_with(line, len, "```")) {
                         if (in_paragraph)
-                                fprintf(f_out, "  </p>\n");
-                        fprintf(f_out, "<pre><code>");
+                                buf_put_markup(&out, "  </p>\n");
+                        buf_puts(&out, "<pre><code>");
                         in_code = true;
                         in_paragraph = false;
                 }
                 /* Paragraph tags */
-                else if (in_paragraph && strlen(line) <= 1) {
-                        fprintf(f_out, "  </p>\n");
+                else if (in_paragraph && len <= 1) {
+                        buf_put_markup(&out, "  </p>\n");
                         in_paragraph = false;
                 }
-                else if (!in_paragraph && strlen(line) > 1 && (strstr(line, "<") == NULL || strstr(line, "<a"))) {
-                        char* str = str_repl_keywords(line, blog_post);
-                        char* rpl = replace_links(str);
-                        fprintf(f_out, "\n  <p>\n    %s", rpl);
+                else if (!in_paragraph && len > 1 && (memchr(line, '<', len) == NULL || memmem(line, len, "<a", 2))) {
+                        buf_put_markup(&out, "\n  <p>\n    ");
+                        render_inline(&out, &scratch, line, len, blog_post);
+                        if (collect)
+                                search_terms_add(&terms, line, len, blog_post);
                         in_paragraph = true;
-                        free(str);
-                        free(rpl);
                 }
                 else {
-                        char* str = str_repl_keywords(line, blog_post);
-                        char* rpl = replace_links(str);
-                        fprintf(f_out, "    %s", rpl);
-                        free(str);
-                        free(rpl);
+                        buf_put_markup(&out, "    ");
+                        render_inline(&out, &scratch, line, len, blog_post);
+                        if (collect)
+                                search_terms_add(&terms, line, len, blog_post);
                 }
+
+                if (out.len >= OUT_FLUSH_SIZE)
+                        buf_flush(&out, f_out);
         }
 
         if (in_paragraph) {
-                fprintf(f_out, "  </p>\n");
+                buf_put_markup(&out, "  </p>\n");
         }
-        fprintf(f_out, "</main>\n</body>\n</html>\n");
+        if (!in_body)
+                rest = template_render(layout, 0, &out, f_out, &page);
+        template_render(layout, rest, &out, f_out, &page);
+        ok = buf_flush(&out, f_out);
+        buf_free(&out);
+        buf_free(&scratch);
+        buf_free(&head);
+        if (collect)
+                blog_post->terms = search_terms_join(&terms, strings);
+        search_terms_free(&terms);
 
         /* Errors and warnings */
-        if (blog_post.date_str == NULL) {
-                fprintf(stderr, "Error: Document date not set in %s. Please set the date in your document.", input_filename);
+        if (blog_post->date_str == NULL) {
+                fprintf(log, "Error: Document date not set in %s. Please set the date in your document.\n", input_filename);
         }
-        if (blog_post.title == NULL) {
-                file_warning("Document title not set. Title will be the name of the document filename.", input_filename);
-                remove_extension(input_filename, blog_post.title);
+        if (blog_post->title == NULL) {
+                const char* base = strrchr(input_filename, '/');
+
+                file_warning(log, "Document title not set. Title will be the name of the document filename.", input_filename);
+                blog_post->title = arena_strdup(strings, base ? base + 1 : input_filename);
+                remove_extension(blog_post->title);
         }
-        if (blog_post.description == NULL) {
-                file_warning("Document description not set.", input_filename);
+        if (blog_post->description == NULL) {
+                file_warning(log, "Document description not set.", input_filename);
         }
-        if (!has_tags) {
-                file_warning("Document tags not set.", input_filename);
+        if (blog_post->tags == NULL) {
+                file_warning(log, "Document tags not set.", input_filename);
         }
 
-        fclose(f_in);
-        fclose(f_out);
+        return ok;
+}
+
+
+/* pool callback: renders jobs[i] and prints its messages in one piece */
+void render_post_job(void* arg, size_t i)
+{
+        PostJob* job = (PostJob*) arg + i;
+        char* messages = NULL;
+        size_t messages_len = 0;
+        FILE* log;
+        StatMark mark;
+
+        if (!job->render)
+                return;
+
+        stats_begin(&mark, true);
+        log = open_memstream(&messages, &messages_len);
+        if (log == NULL)
+                log = stderr;
+
+        job->ok = txt_to_html(job->input, job->output, true, NULL, &job->post, job->strings, &job->hash, log);
 
-        return blog_post;
+        if (log != stderr)
+                fclose(log);
+        stats_end(&mark, "post", job->input);
+
+        console_lock();
+        printf("Processing %s\n", strrchr(job->input, '/') + 1);
+        if (messages)
+                fputs(messages, stderr);
+        console_unlock();
+        free(messages);
 }
 
 
@@ -321,315 +1001,569 @@ void cleandirname(char* str)
 }
 
 
-void free_post(Post* post)
+bool hasperms(const char* dir)
 {
-        free(post->title);
-        free(post->description);
-        free(post->date_str);
-        free(post->filename);
+        return (access(dir, R_OK | W_OK) == 0);
 }
 
 
-bool hasperms(const char* dir)
+/*
+ * Decides which names in the source tree are copied into the build. The build
+ * directory is recognized by its device and inode, however it was spelled.
+ */
+bool copy_filter(const char* path, const char* name, bool is_dir, void* ctx)
 {
-        return (access(dir, R_OK | W_OK) == 0);
+        Build* build = ctx;
+        struct stat st;
+        bool is_index = strcmp(name, "index") == 0;
+        bool is_dest = is_dir && stat(path, &st) == 0 && st.st_dev == build->dir_dev && st.st_ino == build->dir_ino;
+        bool is_sh = strstr(name, ".sh") != NULL;
+        bool is_txt = strstr(name, ".txt") != NULL;
+        bool is_git = strstr(name, ".git") != NULL;
+
+        return !(is_index || is_dest || is_sh || is_txt || is_git);
 }
 
 
-void copy_dir(const char* src, char* dest)
+/*
+ * Mirrors src into dest. The tree is listed first, then directories are
+ * created level by level and every source and destination is stat'ed in one
+ * batch (see fsbatch.c); the files that changed are copied on the worker pool.
+ */
+void copy_dir(Build* build, const char* src, const char* dest)
 {
-        DIR* dir = opendir(src);
-        struct dirent* entry;
-        char src_path[1024];
-        char dest_path[1024];
-        struct stat st;
+        FsEntry* entries;
+        size_t count;
+        FsOp* ops;
+        CopyJob* jobs;
+        struct statx* stx;
+        size_t n_ops = 0;
+        size_t n_jobs = 0;
+        size_t i;
+        int depth;
+        int max_depth = 0;
+        bool relayout = build->prev.layout_hash != build->next.layout_hash;
 
-        if (dir == NULL)
+        if (!fs_scan(&build->strings, src, true, copy_filter, build, &entries, &count))
                 return;
         mkdir(dest, 0755);
 
+        ops = malloc((count * 2 + 1) * sizeof(FsOp));
+        jobs = malloc((count + 1) * sizeof(CopyJob));
+        stx = malloc((count * 2 + 1) * sizeof(struct statx));
+        if (ops == NULL || jobs == NULL || stx == NULL) {
+                fprintf(stderr, "ERROR: Out of memory while copying %s\n", src);
+                abort();
+        }
 
-        while ((entry = readdir(dir)) != NULL) {
-                bool is_dir = strcmp(entry->d_name, ".") == 0;
-                bool is_pdir = strcmp(entry->d_name, "..") == 0;
-                bool is_index = strcmp(entry->d_name, "index") == 0;
-                bool is_dest = strcmp(entry->d_name, dest) == 0;
-                bool is_sh = strstr(entry->d_name, ".sh") != NULL;
-                bool is_txt = strstr(entry->d_name, ".txt") != NULL;
-                bool is_git = strstr(entry->d_name, ".git") != NULL;
+        /* directories, parents before children */
+        for (i = 0; i < count; i++) {
+                if (entries[i].depth > max_depth)
+                        max_depth = entries[i].depth;
+        }
+        for (depth = 0; depth <= max_depth; depth++) {
+                n_ops = 0;
+                for (i = 0; i < count; i++) {
+                        if (!entries[i].is_dir || entries[i].depth != depth)
+                                continue;
+                        ops[n_ops].kind = FS_MKDIR;
+                        ops[n_ops].path = str_rebase(&build->strings, entries[i].path, src, dest);
+                        n_ops++;
+                }
+                fs_batch_run(&build->fs, ops, n_ops);
+        }
 
-                if (is_dir || is_pdir || is_index || is_dest || is_sh || is_txt || is_git)
+        /* stat every file and its current copy in one batch */
+        n_ops = 0;
+        for (i = 0; i < count; i++) {
+                CopyJob* job;
+
+                if (entries[i].is_dir)
                         continue;
+                job = &jobs[n_jobs++];
+                memset(job, 0, sizeof(*job));
+                job->src = entries[i].path;
+                job->dest = str_rebase(&build->strings, entries[i].path, src, dest);
+                job->minify = minify_enabled() && is_stylesheet(job->src);
+                job->fingerprint = fingerprint_wanted(job->dest);
+                /* read and write, so the hash for the fingerprint comes with the copy */
+                job->mode = job->fingerprint ? COPY_READ : build->copy_mode;
+                job->image = image_wanted(job->dest);
+
+                ops[n_ops].kind = FS_STATX;
+                ops[n_ops].path = job->src;
+                ops[n_ops].stx = &stx[n_ops];
+                n_ops++;
+                ops[n_ops].kind = FS_STATX;
+                ops[n_ops].path = job->dest;
+                ops[n_ops].stx = &stx[n_ops];
+                n_ops++;
+        }
+        fs_batch_run(&build->fs, ops, n_ops);
 
-                snprintf(src_path, sizeof(src_path), "%s/%s", src, entry->d_name);
-                snprintf(dest_path, sizeof(dest_path), "%s/%s", dest, entry->d_name);
+        for (i = 0; i < n_jobs; i++) {
+                CopyJob* job = &jobs[i];
+                FsOp* src_op = &ops[i * 2];
+                FsOp* dest_op = &ops[i * 2 + 1];
+                struct stat dest_st;
+
+                if (src_op->result != 0 || !S_ISREG(src_op->stx->stx_mode))
+                        continue;
+                statx_to_stat(src_op->stx, &job->st);
+                job->ok = true;
 
-                if (stat(src_path, &st) == -1)
+                /* -m may have been switched on or off, which changes every stylesheet */
+                if (!(relayout && is_stylesheet(job->src))
+                    && manifest_unchanged(&build->prev, job->src, job->dest, &job->st, &job->hash))
                         continue;
 
-                if (S_ISDIR(st.st_mode)) {
-                        copy_dir(src_path, dest_path);
+                /* a minified copy never has its source's size and mtime */
+                if (dest_op->result == 0 && !job->minify) {
+                        statx_to_stat(dest_op->stx, &dest_st);
+                        if (copy_up_to_date(&job->st, &dest_st)) {
+                                job->hash = 0;
+                                continue;
+                        }
                 }
-                else if (S_ISREG(st.st_mode)) {
-                        FILE* src_file = fopen(src_path, "rb");
-                        FILE* dest_file = fopen(dest_path, "wb");
+                job->copy = true;
+        }
 
-                        char buf[1024];
-                        size_t size;
+        pool_run(build->jobs, n_jobs, copy_asset_job, jobs);
 
-                        printf("Copying file: %s to %s\n", src_path, dest_path);
+        for (i = 0; i < n_jobs; i++) {
+                struct stat none = { 0 };
+                char* fp = jobs[i].fingerprint_dest;
+                int k;
 
-                        while ((size = fread(buf, 1, sizeof(buf), src_file)) > 0) {
-                                fwrite(buf, 1, size, dest_file);
+                if (jobs[i].ok)
+                        manifest_add(&build->next, 'A', jobs[i].src, jobs[i].dest, &jobs[i].st, jobs[i].hash);
+                if (jobs[i].width) {
+                        for (k = 0; k < IMAGE_MAX_WIDTHS; k++) {
+                                char* variant = image_variant(&jobs[i], k);
+
+                                if (variant) {
+                                        manifest_add(&build->next, 'V', variant, variant, &none, 0);
+                                        free(variant);
+                                }
                         }
+                        image_add(&jobs[i], strlen(dest));
+                }
+                if (fp) {
+                        /* both as site URLs: what follows dest is "/images/pic.png" */
+                        manifest_add(&build->next, 'F', fp, fp, &none, jobs[i].hash);
+                        fingerprint_add(jobs[i].dest + strlen(dest), fp + strlen(dest));
+                        free(fp);
+                }
+        }
+
+        free(entries);
+        free(ops);
+        free(jobs);
+        free(stx);
+}
+
 
-                        fclose(src_file);
-                        fclose(dest_file);
+/* pool callback: copies jobs[i] if it needs copying */
+void copy_asset_job(void* arg, size_t i)
+{
+        CopyJob* job = (CopyJob*) arg + i;
+
+        if (job->copy) {
+                console_lock();
+                printf("Copying file: %s to %s\n", job->src, job->dest);
+                console_unlock();
+
+                if (job->minify)
+                        job->ok = copy_css_minified(job->src, job->dest, &job->hash);
+                else
+                        job->ok = copy_file(job->src, job->dest, &job->st, job->mode, &job->hash);
+                if (!job->ok) {
+                        console_lock();
+                        fprintf(stderr, "ERROR: Could not copy %s to %s\n", job->src, job->dest);
+                        console_unlock();
                 }
         }
-        closedir(dir);
+        if (job->ok && job->fingerprint)
+                fingerprint_copy(job);
+        if (job->ok && job->image)
+                image_copy(job);
 }
 
 
-void remove_dir(const char* dirpath)
+/*
+ * Empties dirpath: all files in one batch of unlinks, then the directories,
+ * deepest first so each one is empty by the time it is removed.
+ */
+void remove_dir(Build* build, const char* dirpath)
 {
-        DIR* dir = opendir(dirpath);
-        struct dirent* entry;
-        char path[1024];
-        struct stat st;
+        FsEntry* entries;
+        size_t count;
+        FsOp* ops;
+        size_t n_ops = 0;
+        size_t i;
+        int depth;
+        int max_depth = 0;
 
-        if (dir == NULL)
+        if (!fs_scan(&build->strings, dirpath, false, NULL, NULL, &entries, &count))
                 return;
 
-        while ((entry = readdir(dir)) != NULL) {
-                if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-                        continue;
-                }
+        ops = malloc((count + 1) * sizeof(FsOp));
+        if (ops == NULL) {
+                fprintf(stderr, "ERROR: Out of memory while cleaning %s\n", dirpath);
+                abort();
+        }
 
-                snprintf(path, sizeof(path), "%s/%s", dirpath, entry->d_name);
-                if (stat(path, &st) == -1) {
+        for (i = 0; i < count; i++) {
+                if (entries[i].depth > max_depth)
+                        max_depth = entries[i].depth;
+                if (entries[i].is_dir)
                         continue;
+                ops[n_ops].kind = FS_UNLINK;
+                ops[n_ops].path = entries[i].path;
+                n_ops++;
+        }
+        fs_batch_run(&build->fs, ops, n_ops);
+        stats_count(STAT_FILES_REMOVED, n_ops);
+
+        for (depth = max_depth; depth >= 0; depth--) {
+                n_ops = 0;
+                for (i = 0; i < count; i++) {
+                        if (!entries[i].is_dir || entries[i].depth != depth)
+                                continue;
+                        ops[n_ops].kind = FS_RMDIR;
+                        ops[n_ops].path = entries[i].path;
+                        n_ops++;
                 }
-
-                if (S_ISDIR(st.st_mode)) {
-                        remove_dir(path);
-                        rmdir(path);
-                }
-                else if (S_ISREG(st.st_mode)) {
-                        remove(path);
-                }
+                fs_batch_run(&build->fs, ops, n_ops);
         }
-        closedir(dir);
+
+        free(entries);
+        free(ops);
 }
 
 
-void file_warning(const char* err, const char* filename)
+void file_warning(FILE* log, const char* err, const char* filename)
 {
-        fprintf(stderr, "WARNING: %s (%s)\n", err, filename);
+        fprintf(log, "WARNING: %s (%s)\n", err, filename);
 }
 
 
-void parse_date(const char* date_str, time_t* result)
+/* strips the extension off filename in place */
+void remove_extension(char* filename)
 {
-        struct tm tm_date = { 0 };
-        strptime(date_str, "%b %d %Y", &tm_date);
-        *result = mktime(&tm_date);
+        char* dot = strrchr(filename, '.');
+        if (dot && strchr(dot, '/') == NULL)
+                *dot = '\0';
 }
 
 
-int compare_dates(const void* a, const void* b)
+/* turns a path below from into the same path below to, stored in strings */
+char* str_rebase(Arena* strings, const char* path, const char* from, const char* to)
 {
-        Post* blog_a = (Post*) a;
-        Post* blog_b = (Post*) b;
+        const char* rest = path + strlen(from);
+        char* result = arena_alloc(strings, strlen(to) + strlen(rest) + 1);
 
-        if (blog_a->date > blog_b->date)
-                return -1;
-        else if (blog_a->date < blog_b->date)
-                return 1;
-        else
-                return 0;
+        strcpy(result, to);
+        strcat(result, rest);
+        return result;
 }
 
 
-void remove_extension(const char* filename, char* output)
+/*
+ * Writes the site URL of the link [url, url + len) on a page in directory dir
+ * ("/posts/") to dst: "/images/a.png" stays as it is, "a.png" and "./a.png"
+ * become "/posts/a.png", and "../images/a.png" becomes "/images/a.png".
+ * Returns false for links to other sites and for URLs that do not fit in cap
+ * bytes.
+ */
+bool site_url(char* dst, size_t cap, const char* dir, const char* url, size_t len)
 {
-        char *dot = strrchr(filename, '.');
-        if (dot) {
-                strncpy(output, filename, dot - filename);
-                output[dot - filename] = '\0';
+        size_t dir_len = 0;
+
+        if (len == 0 || memchr(url, ':', len) != NULL || (len >= 2 && memcmp(url, "//", 2) == 0))
+                return false;
+        if (*url != '/') {
+                if (len > 2 && memcmp(url, "./", 2) == 0) {
+                        url += 2;
+                        len -= 2;
+                }
+                dir_len = strlen(dir);
+                /* "../" leaves dir, but never the root */
+                while (len > 3 && memcmp(url, "../", 3) == 0 && dir_len > 1) {
+                        url += 3;
+                        len -= 3;
+                        for (dir_len--; dir_len > 0 && dir[dir_len - 1] != '/'; dir_len--)
+                                ;
+                }
         }
+        if (dir_len + len >= cap)
+                return false;
+
+        memcpy(dst, dir, dir_len);
+        memcpy(dst + dir_len, url, len);
+        dst[dir_len + len] = '\0';
+        return true;
 }
 
 
-char* replace_str(char* str, const char* find, const char* replace)
+/* returns a newly allocated "dir/name" */
+char* path_join(const char* dir, const char* name)
 {
-        char* result;
-        char* ins; /* next insert point */
-        char* tmp;
-        int len_find;
-        int len_replace;
-        int len_front; /* distance between ins and end of the last match */
-        int count;
-
-        if (!str || !find || !replace)
-                return NULL;
-        len_find = strlen(find);
-        if (len_find == 0)
-                return NULL;
-        len_replace = strlen(replace);
-
-        /* count number of needed replacements */
-        ins = str;
-        for (count = 0; (tmp = strstr(ins, find)); ++count) {
-                ins = tmp + len_find;
-        }
-
-        tmp = result = malloc(strlen(str) + (len_replace - len_find) * count + 1);
-
-        if (!result)
-                return NULL;
-
-        while (count--) {
-                ins = strstr(str, find);
-                len_front = ins - str;
-                tmp = strncpy(tmp, str, len_front) + len_front;
-                tmp = strcpy(tmp, replace) + len_replace;
-                str += len_front + len_find; /* move to end of next match */
-        }
-        strcpy(tmp, str);
-        return result;
+        return str_printf("%s/%s", dir, name);
 }
 
 
-char* replace_links(const char* str)
+char* str_printf(const char* fmt, ...)
 {
-        const char* http = "http://";
-        const char* https = "https://";
-        const char* start = str;
-        const char* pos = NULL;
+        va_list args;
         char* result;
-        char* result_pos;
+        int len;
 
-        if (strstr(str, "<a href")) {
-                result = malloc(strlen(str) + 1);
-                if (result) {
-                        strcpy(result, str);
-                        return result;
-                }
-                return NULL;
+        va_start(args, fmt);
+        len = vsnprintf(NULL, 0, fmt, args);
+        va_end(args);
+
+        result = malloc(len + 1);
+        if (result == NULL) {
+                fprintf(stderr, "ERROR: Out of memory\n");
+                abort();
         }
 
-        result = malloc(strlen(str) * 3 + strlen("<a href=''></a>") + 1);
-        result_pos = result;
+        va_start(args, fmt);
+        vsnprintf(result, len + 1, fmt, args);
+        va_end(args);
+        return result;
+}
 
-        if (!result)
-                return NULL;
 
+/*
+ * Writes one line of paragraph or heading text: {title} and {date} are
+ * expanded and bare http(s) URLs become links, in a single scan over the
+ * line. scratch is only used when the line contains a placeholder.
+ */
+void render_inline(Buf* out, Buf* scratch, const char* str, size_t len, const Post* post)
+{
+        static const ScanClass inline_chars = { ":<{", 3 };
+        size_t start = out->len;
+        const char* end = str + len;
+        const char* run = str;
+        const char* p = str;
+        bool expanded = false;
+
+        /*
+         * One walk over the bytes that matter: URLs (found by their ':', which
+         * is rarer in prose than the 'h' they start with), "<a href" and
+         * placeholders.
+         */
+        while ((p = scan_next(&inline_chars, p, end)) < end) {
+                const char* url_end = p;
+                const char* link_end;
+                const char* brace;
+                bool expand = false;
+                bool has_link = false;
+
+                if (*p == '{') {
+                        expand = !expanded && placeholder_value(p, end - p, post, NULL);
+                        p++;
+                }
+                else if (*p == '<') {
+                        has_link = end - p >= 7 && memcmp(p, "<a href", 7) == 0;
+                        p++;
+                }
+                else if (!url_start(run, &p, end)) {
+                        p++;
+                }
+                else {
+                        /* the URL is skipped in one go, so look inside it (and across its end) as well */
+                        while (url_end < end && !isspace((unsigned char) *url_end))
+                                url_end++;
+                        link_end = end - url_end > 6 ? url_end + 6 : end;
+                        has_link = memmem(p, link_end - p, "<a href", 7) != NULL;
+                        for (brace = p; !expanded && brace < url_end; brace++) {
+                                brace = memchr(brace, '{', url_end - brace);
+                                if (brace == NULL)
+                                        break;
+                                expand = expand || placeholder_value(brace, end - brace, post, NULL);
+                        }
 
-        while ((pos = strstr(start, http)) || (pos = strstr(start, https))) {
-                const char* end = pos;
-                char* url;
-                size_t url_len;
+                        if (!expand && !has_link) {
+                                buf_append(out, run, p - run);
+                                buf_puts(out, "<a href='");
+                                buf_append(out, p, url_end - p);
+                                buf_puts(out, "'>");
+                                buf_append(out, p, url_end - p);
+                                buf_puts(out, "</a>");
+                                run = p = url_end;
+                        }
+                }
 
-                memcpy(result_pos, start, pos - start);
-                result_pos += pos - start;
+                /* lines that already contain a link are written as they are */
+                if (has_link) {
+                        if (!expanded && memchr(str, '{', len)) {
+                                expand_placeholders(scratch, str, len, post);
+                                str = scratch->data;
+                                len = scratch->len;
+                        }
+                        out->len = start;
+                        buf_append(out, str, len);
+                        return;
+                }
 
-                while (*end && !isspace(*end))
-                        end++;
+                /* start over on the expanded line; the values are not expanded again */
+                if (expand) {
+                        expand_placeholders(scratch, str, len, post);
+                        str = run = p = scratch->data;
+                        len = scratch->len;
+                        end = str + len;
+                        out->len = start;
+                        expanded = true;
+                }
+        }
+        buf_append(out, run, end - run);
+}
 
-                url_len = end - pos;
-                url = malloc(url_len + 1);
 
-                if (!url) {
-                        free(result);
-                        return NULL;
-                }
+/* moves *p from the ':' of a URL back to its start, if it is one that begins at or after run */
+bool url_start(const char* run, const char** p, const char* end)
+{
+        const char* colon = *p;
 
-                strncpy(url, pos, url_len);
-                url[url_len] = '\0';
+        if (colon - run >= 5 && memcmp(colon - 5, "https", 5) == 0)
+                *p = colon - 5;
+        else if (colon - run >= 4 && memcmp(colon - 4, "http", 4) == 0)
+                *p = colon - 4;
+        else
+                return false;
 
-                result_pos += sprintf(result_pos, "<a href='%s'>%s</a>", url, url);
-                free(url);
-                start = end;
-        }
-        strcpy(result_pos, start);
-        return result;
+        if (str_is_url(*p, end - *p))
+                return true;
+        *p = colon;
+        return false;
 }
 
 
-int str_starts_with_count(const char* str, const char prefix)
+/*
+ * Replaces {title}, then {date}, with their values; dst is overwritten. The
+ * second pass runs over the first one's result, so a {date} in the title is
+ * replaced as well.
+ */
+void expand_placeholders(Buf* dst, const char* str, size_t len, const Post* post)
 {
-        int count = 0;
-        size_t i;
+        Buf titled = { 0 };
 
-        for (i = 0; i < strlen(str); i++) {
-                if (str[i] != prefix) {
-                        break;
-                }
-                count++;
+        replace_placeholder(dst, str, len, "{title}", post->title);
+        if (post->date_str && dst->len && memmem(dst->data, dst->len, "{date}", 6)) {
+                buf_append(&titled, dst->data, dst->len);
+                replace_placeholder(dst, titled.data, titled.len, "{date}", post->date_str);
+                buf_free(&titled);
         }
+}
 
-        return count;
+
+/* writes [str, str + len) to dst with every key replaced by value, if there is one */
+void replace_placeholder(Buf* dst, const char* str, size_t len, const char* key, const char* value)
+{
+        const char* end = str + len;
+        const char* run = str;
+        const char* p;
+        size_t key_len = strlen(key);
+
+        buf_clear(dst);
+        for (p = str; value && (p = memmem(p, end - p, key, key_len)) != NULL; p += key_len) {
+                buf_append(dst, run, p - run);
+                buf_puts(dst, value);
+                run = p + key_len;
+        }
+        buf_append(dst, run, end - run);
 }
 
 
-bool str_starts_with(const char* str, const char* prefix)
+/*
+ * The value of the {title} or {date} placeholder at str, or NULL when there
+ * is none or it has no value. *key_len, if not NULL, is set to its length.
+ */
+const char* placeholder_value(const char* str, size_t len, const Post* post, size_t* key_len)
 {
-        return strncmp(prefix, str, strlen(prefix)) == 0;
+        size_t dummy;
+
+        if (key_len == NULL)
+                key_len = &dummy;
+        if (len >= 7 && memcmp(str, "{title}", 7) == 0 && post->title) {
+                *key_len = 7;
+                return post->title;
+        }
+        if (len >= 6 && memcmp(str, "{date}", 6) == 0 && post->date_str) {
+                *key_len = 6;
+                return post->date_str;
+        }
+        return NULL;
 }
 
 
-void clean_str(char* str)
+/* code block line: only < and > need escaping */
+void render_code(Buf* out, const char* str, size_t len)
 {
-        /* find first non-whitespace char */
-        char* first_non_space = str;
-        while(isspace((unsigned char)*first_non_space)) first_non_space++;
+        static const ScanClass code_chars = { "<>", 2 };
+        const char* end = str + len;
+        const char* run = str;
+        const char* p;
+
+        for (p = str; (p = scan_next(&code_chars, p, end)) < end; p++) {
+                buf_append(out, run, p - run);
+                buf_puts(out, *p == '<' ? "&lt;" : "&gt;");
+                run = p + 1;
+        }
+        buf_append(out, run, end - run);
+}
 
-        /* create new string without the leading whitespace */
-        memmove(str, first_non_space, strlen(first_non_space) + 1);
 
-        str[strcspn(str, "\n")] = 0; /* remove newline */
+/* true for metadata that is not there: never set, or set to nothing ("date:" on its own) */
+bool str_empty(const char* str)
+{
+        return str == NULL || *str == '\0';
 }
 
 
-char* str_repl_keywords(char* str, Post blog_post)
+bool str_is_url(const char* str, size_t len)
 {
-        char* result;
-        char* final_result;
-        /* replace {title} and {date} with their respective values */
-        result = replace_str(str, "{title}", blog_post.title);
-        final_result = replace_str(result, "{date}", blog_post.date_str);
-        free(result);
-        return final_result;
+        return (len >= 7 && memcmp(str, "http://", 7) == 0)
+                || (len >= 8 && memcmp(str, "https://", 8) == 0);
 }
 
 
-char* str_get_value(const char* str, const char* substring)
+int str_starts_with_count(const char* str, size_t len, const char prefix)
 {
-        char* substr_in_str = strstr(str, substring);
-        size_t start_pos = substr_in_str - str + strlen(substring);
-        char* value = malloc(strlen(str) - start_pos + 1);
+        size_t count = 0;
 
-        strcpy(value, &str[start_pos]);
-        clean_str(value);
-        return value;
+        while (count < len && str[count] == prefix)
+                count++;
+
+        return (int) count;
 }
 
 
-char* str_get_value_after_token(const char* str, const char* tok)
+bool str_starts_with(const char* str, size_t len, const char* prefix)
 {
-        char* str_cpy = strdup(str);
-        char* value = strtok(str_cpy, tok);
-        char* result;
+        size_t prefix_len = strlen(prefix);
+        return len >= prefix_len && memcmp(str, prefix, prefix_len) == 0;
+}
 
-        if (!value) {
-                fprintf(stderr, "Error when calling strtok, str_get_value_after_token\n");
-                free(str_cpy);
-                return NULL;
-        }
-        clean_str(value);
-        result = strdup(value);
-        free(str_cpy);
 
-        return result;
+/*
+ * Finds the value of a "key: value" line of length len that starts with key:
+ * the text after key, without leading whitespace and up to the end of the
+ * line. Returns a pointer into line.
+ */
+const char* str_get_value(const char* line, size_t len, const char* key, size_t* value_len)
+{
+        const char* end = line + len;
+        const char* value = line + strlen(key);
+        const char* stop;
+
+        while (value < end && isspace((unsigned char) *value))
+                value++;
+        for (stop = value; stop < end && *stop != '\n'; stop++)
+                ;
+        *value_len = stop - value;
+        return value;
 }
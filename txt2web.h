@@ -0,0 +1,543 @@
+/*
+ * File: txt2web.h
+ * ---------------
+ * Shared types and prototypes for txt2web.
+ */
+#ifndef TXT2WEB_H
+#define TXT2WEB_H
+
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define MANIFEST_NAME ".txt2web-manifest"
+#define HASH_INIT 14695981039346656037UL /* FNV-1a 64-bit offset basis */
+#define OUT_FLUSH_SIZE 65536    /* rendered output is written in chunks of about this size */
+#define SITE_URL_MAX 4096       /* longest link looked up among the copied assets */
+#define IMAGE_MAX_WIDTHS 8      /* widths given with --srcset */
+
+typedef struct {
+        char* filename;
+        char* title;
+        char* date_str;
+        char* description;
+        char* tags;             /* comma separated, as written in the post */
+        char* terms;            /* words for the search index, space separated (-s) */
+        time_t date;
+} Post;
+
+typedef struct {
+        char* data;
+        size_t len;
+        size_t cap;
+} Buf;
+
+typedef struct {
+        const char* data;
+        size_t len;
+        bool mapped;            /* data is an mmap of the file, otherwise it lives in buf */
+        Buf buf;
+} MappedFile;
+
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct {
+        ArenaBlock* head;
+        pthread_mutex_t lock;
+} Arena;
+
+typedef struct {
+        time_t date;
+        size_t index;           /* position of the post in PostTable.posts */
+} PostKey;
+
+typedef struct {
+        Post* posts;
+        PostKey* keys;          /* sort keys, kept apart from the posts */
+        size_t count;
+        size_t cap;
+} PostTable;
+
+/* receives a rendered page piece by piece; returns false to stop, see lib.c */
+typedef bool (*RenderSink)(void* ctx, const char* data, size_t len);
+
+typedef struct {
+        Post post;              /* metadata of the page, in strings */
+        char* messages;         /* warnings and errors, one per line; "" when there are none */
+        Arena strings;
+} RenderResult;
+
+/* the distinct words of one post, see search.c */
+typedef struct {
+        Buf text;               /* the words, each followed by a '\0' */
+        size_t* slots;          /* hash table: offset + 1 into text, 0 when empty */
+        size_t cap;             /* a power of two */
+        size_t count;
+} SearchTerms;
+
+/* state of a stylesheet being minified in pieces, see minify.c */
+typedef struct {
+        int state;              /* in text, a string or a comment */
+        char quote;             /* that closes the string */
+        char last;              /* last byte written outside strings, '\0' at the start */
+        bool escape;            /* in a string, after a backslash */
+        bool slash;             /* '/' held back: it may start a comment */
+        bool star;              /* in a comment, after a '*' */
+        bool space;             /* whitespace or a comment since last */
+        bool semicolon;         /* ';' held back: it is left out before '}' */
+} CssMinifier;
+
+#define SCAN_MAX_CHARS 8
+
+/* the bytes scan_next() stops at, see scan.c */
+typedef struct {
+        const char* chars;
+        size_t count;           /* at most SCAN_MAX_CHARS */
+} ScanClass;
+
+typedef enum {
+        SCAN_SCALAR,
+        SCAN_SSE2,
+        SCAN_AVX2
+} ScanLevel;
+
+/* the posts listed on index.html: the first per_page (all when 0) */
+typedef struct {
+        const PostTable* posts;
+        size_t per_page;
+        bool archives;          /* link to archive.html */
+} PostList;
+
+typedef enum {
+        SLOT_NONE,              /* literal text */
+        SLOT_TITLE,
+        SLOT_DATE,
+        SLOT_DESCRIPTION,
+        SLOT_TAGS,
+        SLOT_HEAD,
+        SLOT_HOME,
+        SLOT_CONTENT,
+        SLOT_POSTS,
+        SLOT_COUNT
+} TemplateSlot;
+
+typedef struct {
+        const char* text;       /* points into Template.source */
+        size_t len;
+        TemplateSlot slot;
+} TemplateSegment;
+
+typedef struct {
+        char* source;           /* owned copy of the layout file, if read from one */
+        TemplateSegment* segments;
+        size_t count;
+        size_t cap;
+        unsigned long hash;     /* of the layout source, for incremental builds */
+} Template;
+
+/* what the slots of a layout are filled with for one page */
+typedef struct {
+        const Post* post;
+        const Buf* head;        /* <head> lines made from the metadata */
+        bool add_link;
+        const PostList* posts;  /* index page only */
+} TemplatePage;
+
+typedef struct {
+        char kind;              /* 'P' post, 'A' asset, 'I' index, 'G' generated page, 'F' fingerprinted asset, 'V' scaled image */
+        char* src;
+        char* out;
+        long mtime;
+        long size;
+        unsigned long hash;     /* FNV-1a hash of the source contents */
+        Post post;              /* only set for posts */
+} ManifestEntry;
+
+typedef struct {
+        ManifestEntry* entries;
+        size_t count;
+        size_t cap;
+        Arena strings;          /* paths and post metadata of all entries */
+        unsigned long list_hash; /* hash of the post list on index.html */
+        unsigned long layout_hash; /* hash of the page layout every page was written with */
+        unsigned long asset_hash; /* hash of the fingerprinted asset names and image sizes the pages link to */
+        bool compressed;        /* the outputs have .gz/.br/.zst variants (-z) */
+} Manifest;
+
+typedef struct {
+        char* input;
+        char* output;
+        char* name;             /* file name without the .txt extension */
+        struct stat st;
+        unsigned long hash;
+        bool render;            /* false when the previous output is reused */
+        bool ok;
+        Post post;
+        Arena* strings;         /* where the post's metadata is stored */
+} PostJob;
+
+/* order matches the names accepted by -c, see copy.c */
+typedef enum {
+        COPY_AUTO,
+        COPY_HARDLINK,
+        COPY_REFLINK,
+        COPY_KERNEL,
+        COPY_READ
+} CopyMode;
+
+typedef struct {
+        const char* src;
+        const char* dest;
+        struct stat st;
+        unsigned long hash;
+        CopyMode mode;
+        bool minify;            /* a stylesheet copied with -m */
+        bool fingerprint;       /* also give it a fingerprinted name (-f) */
+        char* fingerprint_dest; /* that name, once it exists; must be freed */
+        bool image;             /* an image to measure for <img> (-l) */
+        int width;              /* its size as displayed, 0 when unknown */
+        int height;
+        unsigned variants;      /* bit i: its copy downscaled to the i-th --srcset width exists */
+        bool copy;              /* false when dest is already up to date */
+        bool ok;
+} CopyJob;
+
+typedef void (*PoolFunc)(void* arg, size_t i);
+
+typedef enum {
+        STAT_BYTES_READ,
+        STAT_BYTES_WRITTEN,
+        STAT_BYTES_COPIED,
+        STAT_FILES_READ,
+        STAT_FILES_WRITTEN,
+        STAT_FILES_COPIED,
+        STAT_FILES_REMOVED,
+        STAT_ALLOCS,
+        STAT_COUNTERS
+} StatCounter;
+
+typedef struct {
+        double wall;
+        double cpu;
+        bool per_thread;
+} StatMark;
+
+typedef enum {
+        FS_STATX,
+        FS_UNLINK,
+        FS_RMDIR,
+        FS_MKDIR
+} FsOpKind;
+
+#define FS_PENDING 1
+
+typedef struct {
+        FsOpKind kind;
+        const char* path;
+        struct statx* stx;      /* FS_STATX only */
+        int result;             /* 0 or -errno once the op has run */
+} FsOp;
+
+typedef struct {
+        char* path;
+        const char* name;       /* last component of path */
+        int depth;              /* 0 for entries directly inside the root */
+        bool is_dir;
+} FsEntry;
+
+/* path is the entry as listed, name its last component */
+typedef bool (*FsFilter)(const char* path, const char* name, bool is_dir, void* ctx);
+
+typedef struct {
+        int ring_fd;            /* -1 when ops run on the worker pool */
+        unsigned depth;         /* maximum number of ops in flight */
+        int jobs;
+        void* sq_ring;
+        void* cq_ring;
+        void* sqes;
+        void* cqes;
+        size_t sq_ring_size;
+        size_t cq_ring_size;
+        size_t sqes_size;
+        unsigned* sq_head;
+        unsigned* sq_tail;
+        unsigned* sq_array;
+        unsigned sq_mask;
+        unsigned* cq_head;
+        unsigned* cq_tail;
+        unsigned cq_mask;
+} FsBatch;
+
+typedef struct {
+        const char* src;        /* source directory with index and posts/, "." for the current one */
+        const char* dir;
+        dev_t dir_dev;          /* dir as stat() sees it, set by build_site() so copies of src skip it */
+        ino_t dir_ino;
+        bool incremental;
+        int jobs;               /* number of render threads */
+        CopyMode copy_mode;
+        unsigned queue_depth;   /* filesystem ops kept in flight, see fsbatch.c */
+        FsBatch fs;
+        size_t per_page;        /* posts per list page, 0 lists all of them on index.html */
+        bool archives;          /* write per-year and per-tag archive pages */
+        const char* base_url;   /* -u, enables feed.xml and sitemap.xml */
+        bool rss;               /* RSS 2.0 feed instead of Atom */
+        size_t feed_entries;    /* newest posts in feed.xml */
+        bool compress;          /* write .gz/.br/.zst variants next to the output */
+        const char* stats_file; /* --stats=FILE, JSON */
+        const char* trace_file; /* --trace=FILE, Chrome trace events */
+        Manifest prev;          /* manifest of the last build (may be empty) */
+        Manifest next;          /* manifest written at the end of this build */
+        Arena strings;          /* post metadata and paths for this build */
+        size_t post_count;      /* results, set by build_site() */
+        int rendered;
+} Build;
+
+#define SERVE_MAX_CLIENTS 32    /* pages listening for reloads at one time */
+#define SERVE_MAX_REQUESTS 16   /* connections whose request is still arriving */
+#define SERVE_REQUEST_MAX 4096  /* longest request read; the rest is ignored */
+
+/* a connection whose request has not fully arrived yet */
+typedef struct {
+        int fd;                 /* -1 for a free slot */
+        unsigned long serial;   /* order of arrival, the oldest is dropped when all slots are taken */
+        size_t len;
+        char data[SERVE_REQUEST_MAX];
+} ServeRequest;
+
+typedef struct {
+        int listen_fd;
+        const char* root;       /* the build directory */
+        int clients[SERVE_MAX_CLIENTS]; /* open reload event streams */
+        size_t client_count;
+        ServeRequest requests[SERVE_MAX_REQUESTS];
+        unsigned long serial;
+} Server;
+
+/* txt2web.c */
+void usage(const char* prog);
+int build_site(Build* build);
+void write_post_list(Buf* out, FILE* f_out, const PostList* list);
+int render_stream(const char* input, const char* output);
+FILE* output_open(const char* path, char** tmp_path);
+bool output_commit(FILE* f, const char* path, char* tmp_path, bool ok);
+bool txt_to_html(const char* input_filename, const char* output_filename, bool add_link,
+                 const PostList* post_list, Post* blog_post, Arena* strings, unsigned long* hash, FILE* log);
+bool render_html(const char* data, size_t size, const char* input_filename, FILE* f_out, bool add_link,
+                 const PostList* post_list, Post* blog_post, Arena* strings, FILE* log);
+void render_post_job(void* arg, size_t i);
+bool direxists(const char* dir);
+void cleandirname(char* str);
+bool hasperms(const char* dir);
+bool copy_filter(const char* path, const char* name, bool is_dir, void* ctx);
+void copy_dir(Build* build, const char* src, const char* dest);
+void copy_asset_job(void* arg, size_t i);
+void remove_dir(Build* build, const char* dirpath);
+void file_warning(FILE* log, const char* err, const char* filename);
+void remove_extension(char* filename);
+char* str_rebase(Arena* strings, const char* path, const char* from, const char* to);
+bool site_url(char* dst, size_t cap, const char* dir, const char* url, size_t len);
+char* path_join(const char* dir, const char* name);
+char* str_printf(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+void render_inline(Buf* out, Buf* scratch, const char* str, size_t len, const Post* post);
+void expand_placeholders(Buf* dst, const char* str, size_t len, const Post* post);
+void replace_placeholder(Buf* dst, const char* str, size_t len, const char* key, const char* value);
+const char* placeholder_value(const char* str, size_t len, const Post* post, size_t* key_len);
+void render_code(Buf* out, const char* str, size_t len);
+bool str_empty(const char* str);
+bool str_is_url(const char* str, size_t len);
+bool url_start(const char* run, const char** p, const char* end);
+bool str_starts_with(const char* str, size_t len, const char* prefix);
+int str_starts_with_count(const char* str, size_t len, const char prefix);
+const char* str_get_value(const char* line, size_t len, const char* key, size_t* value_len);
+
+/* buf.c */
+void buf_reserve(Buf* b, size_t extra);
+void buf_append(Buf* b, const char* data, size_t len);
+void buf_puts(Buf* b, const char* str);
+void buf_putc(Buf* b, char c);
+void buf_put_int(Buf* b, int n);
+void buf_clear(Buf* b);
+bool buf_flush(Buf* b, FILE* f);
+void buf_free(Buf* b);
+
+/* mapfile.c */
+bool map_file(const char* path, MappedFile* f);
+bool map_fd(int fd, MappedFile* f);
+void unmap_file(MappedFile* f);
+
+/* arena.c */
+void arena_init(Arena* a);
+void* arena_alloc(Arena* a, size_t size);
+char* arena_strndup(Arena* a, const char* str, size_t len);
+char* arena_strdup(Arena* a, const char* str);
+void arena_free(Arena* a);
+
+/* archive.c */
+void write_post_item(Buf* out, const Post* post, const char* root);
+void write_pager(Buf* out, size_t page, size_t pages);
+bool archive_write(Build* build, const PostTable* posts, const char* site_title);
+
+/* feed.c */
+bool feed_write(Build* build, const PostTable* posts, const char* site_title, const char* site_description);
+bool sitemap_write(Build* build, const PostTable* posts);
+
+/* compress.c */
+const char* compress_formats(void);
+void compress_outputs(Build* build);
+void compress_remove(const char* path);
+
+/* template.c */
+bool template_compile(Template* t, const char* source, const char* name);
+size_t template_render(const Template* t, size_t first, Buf* out, FILE* f_out, const TemplatePage* page);
+void template_free(Template* t);
+bool layout_load(const char* path);
+void layout_relink(void);
+const Template* layout_get(void);
+void layout_free(void);
+
+/* batch.c */
+int batch_build(const Build* options, const char* list_path);
+
+/* watch.c */
+int watch_site(Build* build, const char* layout_path, int port);
+
+/* serve.c */
+bool serve_open(Server* s, const char* root, int port);
+size_t serve_poll_fds(const Server* s, struct pollfd* fds);
+void serve_poll_done(Server* s, const struct pollfd* fds, size_t count);
+void serve_reload(Server* s);
+void serve_close(Server* s);
+
+/* cache.c */
+bool cache_open(const char* dir, unsigned long max_bytes);
+bool cache_enabled(void);
+void cache_close(void);
+unsigned long cache_key(unsigned long source_hash, const char* input_filename, bool add_link);
+bool cache_fetch(unsigned long key, unsigned long source_hash, size_t size, const char* output_filename,
+                 Post* blog_post, Arena* strings, FILE* log);
+void cache_store(unsigned long key, unsigned long source_hash, size_t size, const char* output_filename,
+                 const Post* blog_post, const char* messages);
+void cache_trim(void);
+
+/* lib.c */
+bool render_buffer(const char* data, size_t len, const char* name, bool add_link,
+                   RenderSink sink, void* ctx, RenderResult* result);
+bool render_fd(int fd, const char* name, bool add_link, RenderSink sink, void* ctx, RenderResult* result);
+void render_result_free(RenderResult* result);
+bool render_sink_buf(void* ctx, const char* data, size_t len);
+bool render_sink_fd(void* ctx, const char* data, size_t len);
+
+/* fingerprint.c */
+void fingerprint_enable(void);
+bool fingerprint_enabled(void);
+bool fingerprint_wanted(const char* path);
+char* fingerprint_path(const char* path, unsigned long hash);
+void fingerprint_copy(CopyJob* job);
+void fingerprint_reset(void);
+void fingerprint_add(const char* url, const char* target);
+unsigned long fingerprint_finish(void);
+unsigned long fingerprint_hash(void);
+const char* fingerprint_lookup(const char* dir, const char* url, size_t len);
+void buf_put_asset_url(Buf* out, const char* dir, const char* url, size_t len);
+bool fingerprint_html(Buf* out, const char* html);
+
+/* image.c */
+void image_enable(void);
+bool image_enabled(void);
+bool image_set_widths(const char* list);
+bool image_wanted(const char* path);
+char* image_variant_path(const char* path, int width);
+char* image_variant(const CopyJob* job, int i);
+void image_copy(CopyJob* job);
+void image_reset(void);
+void image_add(const CopyJob* job, size_t root_len);
+unsigned long image_finish(unsigned long hash);
+unsigned long image_hash(void);
+void image_put_attributes(Buf* out, const char* dir, const char* url, size_t len, bool first);
+
+/* minify.c */
+void minify_enable(void);
+bool minify_enabled(void);
+bool is_stylesheet(const char* path);
+void buf_put_markup(Buf* out, const char* markup);
+void minify_layout(char* source);
+void css_minify_init(CssMinifier* m);
+void css_minify(CssMinifier* m, Buf* out, const char* data, size_t len);
+void css_minify_finish(CssMinifier* m, Buf* out);
+
+/* search.c */
+void search_enable(void);
+bool search_enabled(void);
+void search_terms_add(SearchTerms* t, const char* str, size_t len, const Post* post);
+char* search_terms_join(const SearchTerms* t, Arena* strings);
+void search_terms_free(SearchTerms* t);
+bool search_write(Build* build, const PostTable* posts);
+
+/* scan.c */
+const char* scan_next(const ScanClass* c, const char* p, const char* end);
+bool scan_set_level(ScanLevel level);
+const char* scan_level_name(void);
+
+/* date.c */
+bool parse_date(const char* date_str, time_t* result);
+
+/* posts.c */
+Post* post_table_add(PostTable* t, const Post* post);
+void post_table_sort(PostTable* t);
+Post* post_table_get(const PostTable* t, size_t i);
+void post_table_free(PostTable* t);
+
+/* copy.c */
+bool parse_copy_mode(const char* name, CopyMode* mode);
+bool copy_up_to_date(const struct stat* src_st, const struct stat* dest_st);
+bool copy_file(const char* src, const char* dest, const struct stat* st, CopyMode mode, unsigned long* hash);
+bool copy_css_minified(const char* src, const char* dest, unsigned long* hash);
+
+/* fsbatch.c */
+bool fs_batch_init(FsBatch* b, unsigned depth, int jobs);
+void fs_batch_run(FsBatch* b, FsOp* ops, size_t count);
+void fs_batch_free(FsBatch* b);
+bool fs_scan(Arena* strings, const char* root, bool follow_links, FsFilter filter, void* ctx,
+             FsEntry** entries, size_t* count);
+void statx_to_stat(const struct statx* stx, struct stat* st);
+
+/* stats.c */
+void stats_enable(int slowest);
+bool stats_enabled(void);
+void stats_count(StatCounter counter, unsigned long n);
+void stats_begin(StatMark* mark, bool per_thread);
+void stats_end(const StatMark* mark, const char* category, const char* name);
+void stats_report(FILE* out);
+bool stats_write_json(const char* path);
+bool stats_write_trace(const char* path);
+void stats_free(void);
+
+/* manifest.c */
+unsigned long hash_bytes(unsigned long hash, const void* data, size_t len);
+unsigned long hash_str(unsigned long hash, const char* str);
+bool hash_file(const char* path, unsigned long* hash);
+void manifest_init(Manifest* m);
+bool manifest_load(Manifest* m, const char* path);
+bool manifest_save(Manifest* m, const char* path);
+void manifest_free(Manifest* m);
+ManifestEntry* manifest_add(Manifest* m, char kind, const char* src, const char* out,
+                            const struct stat* st, unsigned long hash);
+void manifest_set_post(Manifest* m, ManifestEntry* e, const Post* post);
+void manifest_sort(Manifest* m);
+ManifestEntry* manifest_find(const Manifest* m, const char* src);
+bool manifest_unchanged(const Manifest* m, const char* src, const char* out,
+                        const struct stat* st, unsigned long* hash);
+int manifest_remove_orphans(const Manifest* prev, const Manifest* next);
+
+/* pool.c */
+int pool_default_jobs(void);
+void pool_run(int jobs, size_t count, PoolFunc fn, void* arg);
+void console_lock(void);
+void console_unlock(void);
+
+#endif
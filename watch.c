@@ -0,0 +1,194 @@
+/*
+ * File: watch.c
+ * -------------
+ * --watch: after the first build, txt2web stays running and watches the
+ * source tree with inotify. A burst of changes (an editor saving a file
+ * usually writes it more than once) is collected for WATCH_SETTLE_MS, then
+ * the site is rebuilt incrementally, so only the posts that changed are
+ * rendered again, and the index, archive pages and feed only when the post
+ * list changed (see build_site).
+ *
+ * With --serve the build directory is also served on localhost and open
+ * pages reload after every rebuild, see serve.c.
+ */
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "txt2web.h"
+
+#define WATCH_SETTLE_MS 50
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+static volatile sig_atomic_t watch_stop;
+
+static void watch_signal(int sig);
+static bool watch_tree(int fd, Build* build);
+static bool watch_read(int fd, bool* new_dir);
+static double now_ms(void);
+
+
+/*
+ * Rebuilds build->dir whenever the sources change, until SIGINT or SIGTERM.
+ * layout_path is read again before every rebuild; port 0 means no server.
+ */
+int watch_site(Build* build, const char* layout_path, int port)
+{
+        struct pollfd fds[SERVE_MAX_CLIENTS + SERVE_MAX_REQUESTS + 2];
+        Server server;
+        bool serving = port > 0;
+        bool pending = false;
+        bool new_dir = false;
+        double deadline = 0;
+        int fd;
+
+        fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd == -1 || !watch_tree(fd, build)) {
+                fprintf(stderr, "ERROR: Could not watch the source tree\n");
+                return 1;
+        }
+        if (serving && !serve_open(&server, build->dir, port)) {
+                fprintf(stderr, "ERROR: Could not listen on 127.0.0.1:%d\n", port);
+                close(fd);
+                return 1;
+        }
+
+        signal(SIGINT, watch_signal);
+        signal(SIGTERM, watch_signal);
+        if (serving)
+                printf("Serving %s on http://127.0.0.1:%d/\n", build->dir, port);
+        printf("Watching for changes, press Ctrl-C to stop\n");
+        fflush(stdout);
+
+        /* from here on nothing is wiped: every rebuild starts from the last one */
+        build->incremental = true;
+
+        while (!watch_stop) {
+                size_t count = 1;
+                int timeout = -1;
+
+                fds[0].fd = fd;
+                fds[0].events = POLLIN;
+                if (serving)
+                        count += serve_poll_fds(&server, fds + 1);
+                if (pending) {
+                        double left = deadline - now_ms();
+                        timeout = left > 0 ? (int) left + 1 : 0;
+                }
+
+                if (poll(fds, count, timeout) == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        perror("poll");
+                        break;
+                }
+
+                if ((fds[0].revents & POLLIN) && watch_read(fd, &new_dir)) {
+                        pending = true;
+                        deadline = now_ms() + WATCH_SETTLE_MS;
+                }
+                if (serving)
+                        serve_poll_done(&server, fds + 1, count - 1);
+
+                if (!pending || now_ms() < deadline)
+                        continue;
+
+                /* a new directory (an asset folder, say) has to be watched as well */
+                if (new_dir)
+                        watch_tree(fd, build);
+                pending = false;
+                new_dir = false;
+
+                if (!layout_load(layout_path))
+                        continue;
+                if (build_site(build) == 0 && serving)
+                        serve_reload(&server);
+                printf("Watching for changes\n");
+                fflush(stdout);
+        }
+
+        if (serving)
+                serve_close(&server);
+        close(fd);
+        return 0;
+}
+
+
+static void watch_signal(int sig)
+{
+        (void) sig;
+        watch_stop = 1;
+}
+
+
+/*
+ * Watches the source directory (index and top level assets) and every
+ * directory that is copied into the build, posts/ among them. Watching a
+ * directory twice is harmless, so this simply runs again for new ones.
+ */
+static bool watch_tree(int fd, Build* build)
+{
+        FsEntry* entries;
+        size_t count;
+        size_t i;
+        Arena strings;
+        bool ok;
+
+        if (inotify_add_watch(fd, build->src, WATCH_EVENTS) == -1)
+                return false;
+
+        arena_init(&strings);
+        ok = fs_scan(&strings, build->src, true, copy_filter, build, &entries, &count);
+        if (ok) {
+                for (i = 0; i < count; i++) {
+                        if (entries[i].is_dir)
+                                inotify_add_watch(fd, entries[i].path, WATCH_EVENTS);
+                }
+                free(entries);
+        }
+        arena_free(&strings);
+        return ok;
+}
+
+
+/*
+ * Drains the inotify queue. Returns whether any event can change the site.
+ * The build directory is never watched (copy_filter skips it), so writing
+ * the site does not show up here.
+ */
+static bool watch_read(int fd, bool* new_dir)
+{
+        char events[4096 + sizeof(struct inotify_event) + NAME_MAX + 1]
+                __attribute__((aligned(__alignof__(struct inotify_event))));
+        bool changed = false;
+        ssize_t len;
+
+        while ((len = read(fd, events, sizeof(events))) > 0) {
+                char* p;
+
+                for (p = events; p < events + len; ) {
+                        struct inotify_event* ev = (struct inotify_event*) (void*) p;
+
+                        p += sizeof(struct inotify_event) + ev->len;
+                        if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO)))
+                                *new_dir = true;
+                        changed = true;
+                }
+        }
+        return changed;
+}
+
+
+static double now_ms(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}